@@ -0,0 +1,132 @@
+#include "AsyncTessellator.h"
+
+AsyncTessellator::AsyncTessellator(const std::vector<TerrainPatch*> &patches) :
+    Indexed(true),
+    Incremental(false),
+    TriangleBudget(0),
+    TimeBudget(0),
+    HorizonCulling(false),
+    ErrorMargin(0.001f),
+    ProjectionScale(0),
+    Morph(false),
+    Linked(false),
+    m_patches(patches),
+    m_backVerteces(patches.size()),
+    m_backIndeces(patches.size()),
+    m_backMorphs(patches.size()),
+    m_pending(false),
+    m_running(false),
+    m_ready(false),
+    m_stop(false)
+{
+    m_worker = std::thread(&AsyncTessellator::Run, this);
+}
+
+AsyncTessellator::~AsyncTessellator()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_signal.notify_all();
+    m_worker.join();
+}
+
+void AsyncTessellator::Post(const std::vector<glm::vec3> &views, const std::vector<Frustum> &frusta)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_job.views = views;
+        m_job.frusta = frusta;
+        m_job.horizon = HorizonCulling;
+        m_job.errorMargin = ErrorMargin;
+        m_job.projectionScale = ProjectionScale;
+        m_job.linked = Linked;
+        m_job.morph = Morph;
+        m_job.indexed = Indexed;
+        m_job.incremental = Incremental;
+        m_job.maxTriangles = TriangleBudget;
+        m_job.maxMilliseconds = TimeBudget;
+        m_pending = true;
+    }
+    m_signal.notify_all();
+}
+
+bool AsyncTessellator::Swap()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(!m_ready) {
+            return false;
+        }
+        for (size_t i = 0; i < m_patches.size(); i++)
+        {
+            // the old front buffers become the next back buffers, capacity is kept
+            m_patches[i]->m->Verteces.swap(m_backVerteces[i]);
+            m_patches[i]->m->Indeces.swap(m_backIndeces[i]);
+            m_patches[i]->Morphs.swap(m_backMorphs[i]);
+        }
+        m_ready = false;
+    }
+    // a job posted meanwhile waits for the back buffers
+    m_signal.notify_all();
+    return true;
+}
+
+void AsyncTessellator::Wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_running || (m_pending && !m_ready)) {
+        m_signal.wait(lock);
+    }
+}
+
+bool AsyncTessellator::Busy()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending || m_running;
+}
+
+void AsyncTessellator::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(;;) {
+        while (!m_stop && !(m_pending && !m_ready)) {
+            m_signal.wait(lock);
+        }
+        if(m_stop) {
+            return;
+        }
+        Job job = m_job;
+        m_pending = false;
+        m_running = true;
+        lock.unlock();
+
+        if(job.linked) {
+            TerrainPatch::tessellateLinked(m_patches, job.views, job.errorMargin, job.frusta, job.horizon, job.projectionScale);
+        }
+        for (size_t i = 0; i < m_patches.size() && i < job.views.size(); i++)
+        {
+            TerrainPatch *tp = m_patches[i];
+            const Frustum *frustum = i < job.frusta.size() ? &job.frusta[i] : nullptr;
+            if(job.linked) {
+                // tessellated together above
+            } else if(job.incremental) {
+                tp->update(job.views[i], job.errorMargin, job.maxTriangles, job.maxMilliseconds, frustum, job.horizon,
+                    job.projectionScale);
+            } else {
+                tp->reset();
+                tp->tessellate(job.views[i], job.errorMargin, frustum, job.horizon, job.projectionScale);
+            }
+            tp->getMesh(m_backVerteces[i], m_backIndeces[i], job.indexed, job.morph ? &m_backMorphs[i] : nullptr);
+            if(!job.morph) {
+                m_backMorphs[i].clear();
+            }
+        }
+
+        lock.lock();
+        m_running = false;
+        m_ready = true;
+        m_signal.notify_all();
+    }
+}
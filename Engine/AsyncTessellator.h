@@ -0,0 +1,84 @@
+#pragma once
+#ifndef AsyncTessellator_h__
+#define AsyncTessellator_h__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "ROAMgrid.h"
+
+//************************************
+// Retessellates a fixed set of patches on one background thread.
+// The render thread posts patch space views, the worker tessellates and
+// writes the meshes into back buffers, the render thread swaps them into
+// TerrainPatch::m and uploads. The worker never touches m, the render
+// thread never touches the trees while a job is in flight.
+//************************************
+class AsyncTessellator
+{
+public:
+    AsyncTessellator(const std::vector<TerrainPatch*> &patches);
+    ~AsyncTessellator();
+
+    // queues a job, views[i] is the view for patches[i], frusta[i] its patch
+    // space frustum (empty - no frustum culling). A job that has not started
+    // yet is replaced, so only the latest views are tessellated
+    void Post(const std::vector<glm::vec3> &views, const std::vector<Frustum> &frusta = std::vector<Frustum>());
+
+    // moves a finished result into the patch meshes, returns false if there is none
+    bool Swap();
+
+    // blocks until the worker is idle, for tests and shutdown
+    void Wait();
+
+    // a job is queued or running
+    bool Busy();
+
+    // settings are copied when a job is posted
+    bool Indexed;
+    bool Incremental;
+    size_t TriangleBudget;
+    float TimeBudget;
+    bool HorizonCulling;
+    // see TerrainPatch::tessellate
+    float ErrorMargin;
+    float ProjectionScale;
+    // fill TerrainPatch::Morphs, swapped in together with the meshes
+    bool Morph;
+    // the patches are linked (TerrainPatch::linkPatches), Incremental is ignored
+    bool Linked;
+
+private:
+    struct Job {
+        std::vector<glm::vec3> views;
+        std::vector<Frustum> frusta;
+        bool horizon;
+        float errorMargin;
+        float projectionScale;
+        bool linked;
+        bool morph;
+        bool indexed;
+        bool incremental;
+        size_t maxTriangles;
+        float maxMilliseconds;
+    };
+
+    void Run();
+
+    std::vector<TerrainPatch*> m_patches;
+    std::vector<std::vector<VertexPositionNormalTexture>> m_backVerteces;
+    std::vector<std::vector<GLuint>> m_backIndeces;
+    std::vector<std::vector<MorphTarget>> m_backMorphs;
+
+    std::mutex m_mutex;
+    std::condition_variable m_signal;
+    Job m_job;
+    bool m_pending;
+    bool m_running;
+    bool m_ready;
+    bool m_stop;
+    std::thread m_worker;
+};
+
+#endif // AsyncTessellator_h__
@@ -1,6 +1,12 @@
 #include "ClassicNoise.h"
 #include <GameMath.h>
 #include <glm.hpp>
+#include <string.h>
+#include <float.h>
+#include <vector>
+#include <functional>
+#include "heightmap.h"
+#include "ParallelFor.h"
 
 #define v3 glm::vec3
 #define v4 glm::vec4
@@ -45,25 +51,6 @@ static const int p[] = {
     49, 192, 214,  31, 181, 199, 106, 157, 184,  84, 204, 176, 115, 121, 50, 45, 127,  4, 150, 254, 
     138, 236, 205, 93, 222, 114, 67, 29, 24, 72, 243, 141, 128, 195, 78, 66, 215, 61, 156, 180};
 
-//p[i]&255
-static const int perm[] = {
-    151, 160, 137, 91, 90, 15, 131, 13, 201, 95, 96, 53, 194, 233, 7, 225, 140,
-    36, 103, 30, 69, 142, 8, 99, 37, 240, 21, 10, 23, 190, 6, 148, 247, 120, 234,
-    75, 0, 26, 197, 62, 94, 252, 219, 203, 117, 35, 11, 32, 57, 177, 33, 88, 237,
-    149, 56, 87, 174, 20, 125, 136, 171, 168, 68, 175, 74, 165, 71, 134, 139, 48,
-    27, 166, 77, 146, 158, 231, 83, 111, 229, 122, 60, 211, 133, 230, 220, 105,
-    92, 41, 55, 46, 245, 40, 244, 102, 143, 54, 65, 25, 63, 161, 1, 216, 80, 73,
-    209, 76, 132, 187, 208, 89, 18, 169, 200, 196, 135, 130, 116, 188, 159, 86,
-    164, 100, 109, 198, 173, 186, 3, 64, 52, 217, 226, 250, 124, 123, 5, 202,
-    38, 147, 118, 126, 255, 82, 85, 212, 207, 206, 59, 227, 47, 16, 58, 17, 182,
-    189, 28, 42, 223, 183, 170, 213, 119, 248, 152, 2, 44, 154, 163, 70, 221,
-    153, 101, 155, 167, 43, 172, 9, 129, 22, 39, 253, 19, 98, 108, 110, 79, 113,
-    224, 232, 178, 185, 112, 104, 218, 246, 97, 228, 251, 34, 242, 193, 238, 210,
-    144, 12, 191, 179, 162, 241, 81, 51, 145, 235, 249, 14, 239, 107, 49, 192, 214,
-    31, 181, 199, 106, 157, 184, 84, 204, 176, 115, 121, 50, 45, 127, 4, 150, 254,
-    138, 236, 205, 93, 222, 114, 67, 29, 24, 72, 243, 141, 128, 195, 78, 66, 215,
-    61, 156, 180};
-
 inline float dot3( glm::vec3 g, float x, float y, float z )
 {
     return g[0] * x + g[1] * y + g[2] * z;
@@ -79,8 +66,71 @@ inline float dot2 ( glm::vec3 g, float x, float y )
     return g[0] * x + g[1] * y;
 }
 
+Noise::Noise( unsigned int seed ) :
+    m_seed(seed)
+{
+    int permutation[256];
+    for (int i = 0; i < 256; i++) {
+        permutation[i] = p[i];
+    }
+    if (seed != 0) {
+        // Fisher-Yates driven by xorshift32
+        unsigned int state = seed;
+        for (int i = 255; i > 0; i--) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            int j = state % (i + 1);
+            int swap = permutation[i];
+            permutation[i] = permutation[j];
+            permutation[j] = swap;
+        }
+    }
+    for (int i = 0; i < 512; i++) {
+        m_tables.perm[i] = permutation[i & 255];
+        const glm::vec3 &g = grad3[m_tables.perm[i] % 12];
+        m_tables.gradX[i] = g[0];
+        m_tables.gradY[i] = g[1];
+        m_tables.gradZ[i] = g[2];
+    }
+}
+
+unsigned int Noise::Seed() const
+{
+    return m_seed;
+}
+
+const Noise::Tables &Noise::GetTables() const
+{
+    return m_tables;
+}
+
+// the free functions sample the reference permutation
+static const Noise referenceNoise(0);
+
 float noise ( float x, float y, float z )
 {
+    return referenceNoise.Classic(x, y, z);
+}
+
+float simplexnoise( float x, float y, float z, float w )
+{
+    return referenceNoise.Simplex(x, y, z, w);
+}
+
+float simplexnoise( float xin, float yin, float zin )
+{
+    return referenceNoise.Simplex(xin, yin, zin);
+}
+
+float simplexnoise( float xin, float yin )
+{
+    return referenceNoise.Simplex(xin, yin);
+}
+
+float Noise::Classic( float x, float y, float z ) const
+{
+    const int *perm = m_tables.perm;
     int X = floor(x);
     int Y = floor(y);
     int Z = floor(z);
@@ -137,8 +187,9 @@ float noise ( float x, float y, float z )
 }
 
 
-float simplexnoise( float xin, float yin )
+float Noise::Simplex( float xin, float yin ) const
 {
+    const int *perm = m_tables.perm;
     float n0, n1, n2; // Noise contributions from the three corners
     // Skew the input space to determine which simplex cell we're in
     const float F2 = 0.5 * ( sqrt( 3.0 ) - 1.0 );
@@ -207,8 +258,9 @@ float simplexnoise( float xin, float yin )
     return 70.0 * ( n0 + n1 + n2 );
 }
 // 3D simplex noise
-float simplexnoise( float xin, float yin, float zin )
+float Noise::Simplex( float xin, float yin, float zin ) const
 {
+    const int *perm = m_tables.perm;
     float n0, n1, n2, n3; // Noise contributions from the four corners
     // Skew the input space to determine which simplex cell we're in
     const float F3 = 1.0 / 3.0;
@@ -323,8 +375,9 @@ float simplexnoise( float xin, float yin, float zin )
     return 32.0 * ( n0 + n1 + n2 + n3 );
 }
 // 4D simplex noise
-float simplexnoise( float x, float y, float z, float w )
+float Noise::Simplex( float x, float y, float z, float w ) const
 {
+    const int *perm = m_tables.perm;
     // The skewing and unskewing factors are hairy again for the 4D case
     const float F4 = ( sqrt( 5.0 ) - 1.0 ) / 4.0;
     const float G4 = ( 5.0 - sqrt( 5.0 ) ) / 20.0;
@@ -451,4 +504,853 @@ float simplexnoise( float x, float y, float z, float w )
     }
     // Sum up and scale the result to cover the range [-1,1]
     return 27.0 * ( n0 + n1 + n2 + n3 + n4 );
-}
\ No newline at end of file
+}
+
+// batched evaluation
+
+static const float F2 = 0.36602540378443860F;   // 0.5*(sqrt(3)-1)
+static const float G2 = 0.21132486540518713F;   // (3-sqrt(3))/6
+static const float F3 = 1.0F/3.0F;
+static const float G3 = 1.0F/6.0F;
+
+static void simplex2_scalar(const Noise &n, const float *x, const float *y, float *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = n.Simplex(x[i], y[i]);
+    }
+}
+
+static void simplex3_scalar(const Noise &n, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = n.Simplex(x[i], y[i], z[i]);
+    }
+}
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define NOISE_SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define NOISE_AVX2
+#else
+#define NOISE_AVX2 __attribute__((target("avx2")))
+#endif
+
+// floor for |v| < 2^31 with SSE2 only
+static inline __m128i floor_sse2(__m128 v)
+{
+    __m128i i = _mm_cvttps_epi32(v);
+    __m128 above = _mm_cmpgt_ps(_mm_cvtepi32_ps(i), v);
+    return _mm_add_epi32(i, _mm_castps_si128(above));   // mask is -1 where truncation went up
+}
+
+// t^4 * (g . d) for t = r2 - |d|^2, 0 outside the corner's radius
+static inline __m128 corner2_sse2(__m128 x, __m128 y, __m128 gx, __m128 gy, __m128 r2)
+{
+    __m128 t = _mm_sub_ps(_mm_sub_ps(r2, _mm_mul_ps(x, x)), _mm_mul_ps(y, y));
+    t = _mm_max_ps(t, _mm_setzero_ps());
+    t = _mm_mul_ps(t, t);
+    t = _mm_mul_ps(t, t);
+    return _mm_mul_ps(t, _mm_add_ps(_mm_mul_ps(gx, x), _mm_mul_ps(gy, y)));
+}
+
+static inline __m128 corner3_sse2(__m128 x, __m128 y, __m128 z, __m128 gx, __m128 gy, __m128 gz, __m128 r2)
+{
+    __m128 t = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(r2, _mm_mul_ps(x, x)), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+    t = _mm_max_ps(t, _mm_setzero_ps());
+    t = _mm_mul_ps(t, t);
+    t = _mm_mul_ps(t, t);
+    return _mm_mul_ps(t, _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, x), _mm_mul_ps(gy, y)), _mm_mul_ps(gz, z)));
+}
+
+static inline __m128 simplex2_sse2_4(const Noise::Tables &tables, __m128 x, __m128 y)
+{
+    const __m128 one = _mm_set1_ps(1.0F);
+    const __m128 g2 = _mm_set1_ps(G2);
+    __m128 s = _mm_mul_ps(_mm_add_ps(x, y), _mm_set1_ps(F2));
+    __m128i i = floor_sse2(_mm_add_ps(x, s));
+    __m128i j = floor_sse2(_mm_add_ps(y, s));
+    __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(i, j)), g2);
+    __m128 x0 = _mm_sub_ps(x, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+    __m128 y0 = _mm_sub_ps(y, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+    __m128 lower = _mm_cmpgt_ps(x0, y0);
+    __m128 x1 = _mm_add_ps(_mm_sub_ps(x0, _mm_and_ps(lower, one)), g2);
+    __m128 y1 = _mm_add_ps(_mm_sub_ps(y0, _mm_andnot_ps(lower, one)), g2);
+    __m128 x2 = _mm_add_ps(_mm_sub_ps(x0, one), _mm_set1_ps(2*G2));
+    __m128 y2 = _mm_add_ps(_mm_sub_ps(y0, one), _mm_set1_ps(2*G2));
+
+    // no gathers before AVX2, the hashes go lane by lane
+    int ii[4], jj[4], i1[4];
+    _mm_storeu_si128((__m128i *)ii, _mm_and_si128(i, _mm_set1_epi32(255)));
+    _mm_storeu_si128((__m128i *)jj, _mm_and_si128(j, _mm_set1_epi32(255)));
+    _mm_storeu_si128((__m128i *)i1, _mm_castps_si128(lower));
+    float g[6][4];
+    const int *perm = tables.perm;
+    for (int l = 0; l < 4; l++) {
+        int a = i1[l] & 1;
+        int h0 = ii[l] + perm[jj[l]];
+        int h1 = ii[l] + a + perm[jj[l] + 1 - a];
+        int h2 = ii[l] + 1 + perm[jj[l] + 1];
+        g[0][l] = tables.gradX[h0]; g[1][l] = tables.gradY[h0];
+        g[2][l] = tables.gradX[h1]; g[3][l] = tables.gradY[h1];
+        g[4][l] = tables.gradX[h2]; g[5][l] = tables.gradY[h2];
+    }
+
+    const __m128 r2 = _mm_set1_ps(0.5F);
+    __m128 n = corner2_sse2(x0, y0, _mm_loadu_ps(g[0]), _mm_loadu_ps(g[1]), r2);
+    n = _mm_add_ps(n, corner2_sse2(x1, y1, _mm_loadu_ps(g[2]), _mm_loadu_ps(g[3]), r2));
+    n = _mm_add_ps(n, corner2_sse2(x2, y2, _mm_loadu_ps(g[4]), _mm_loadu_ps(g[5]), r2));
+    return _mm_mul_ps(n, _mm_set1_ps(70.0F));
+}
+
+static inline __m128 simplex3_sse2_4(const Noise::Tables &tables, __m128 x, __m128 y, __m128 z)
+{
+    const __m128 one = _mm_set1_ps(1.0F);
+    const __m128 g3 = _mm_set1_ps(G3);
+    __m128 s = _mm_mul_ps(_mm_add_ps(_mm_add_ps(x, y), z), _mm_set1_ps(F3));
+    __m128i i = floor_sse2(_mm_add_ps(x, s));
+    __m128i j = floor_sse2(_mm_add_ps(y, s));
+    __m128i k = floor_sse2(_mm_add_ps(z, s));
+    __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(i, j), k)), g3);
+    __m128 x0 = _mm_sub_ps(x, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+    __m128 y0 = _mm_sub_ps(y, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+    __m128 z0 = _mm_sub_ps(z, _mm_sub_ps(_mm_cvtepi32_ps(k), t));
+
+    // the simplex corner order of simplexnoise(x, y, z) without the branches
+    __m128 xy = _mm_cmpge_ps(x0, y0);
+    __m128 yz = _mm_cmpge_ps(y0, z0);
+    __m128 xz = _mm_cmpge_ps(x0, z0);
+    __m128 m_i1 = _mm_and_ps(xy, xz);
+    __m128 m_j1 = _mm_andnot_ps(xy, yz);
+    __m128 m_k1 = _mm_andnot_ps(_mm_or_ps(m_i1, m_j1), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+    __m128 m_i2 = _mm_or_ps(xy, xz);
+    __m128 m_j2 = _mm_or_ps(_mm_andnot_ps(xy, _mm_castsi128_ps(_mm_set1_epi32(-1))), yz);
+    __m128 m_k2 = _mm_andnot_ps(_mm_and_ps(m_i2, m_j2), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+
+    __m128 x1 = _mm_add_ps(_mm_sub_ps(x0, _mm_and_ps(m_i1, one)), g3);
+    __m128 y1 = _mm_add_ps(_mm_sub_ps(y0, _mm_and_ps(m_j1, one)), g3);
+    __m128 z1 = _mm_add_ps(_mm_sub_ps(z0, _mm_and_ps(m_k1, one)), g3);
+    __m128 x2 = _mm_add_ps(_mm_sub_ps(x0, _mm_and_ps(m_i2, one)), _mm_set1_ps(2*G3));
+    __m128 y2 = _mm_add_ps(_mm_sub_ps(y0, _mm_and_ps(m_j2, one)), _mm_set1_ps(2*G3));
+    __m128 z2 = _mm_add_ps(_mm_sub_ps(z0, _mm_and_ps(m_k2, one)), _mm_set1_ps(2*G3));
+    __m128 x3 = _mm_add_ps(_mm_sub_ps(x0, one), _mm_set1_ps(3*G3));
+    __m128 y3 = _mm_add_ps(_mm_sub_ps(y0, one), _mm_set1_ps(3*G3));
+    __m128 z3 = _mm_add_ps(_mm_sub_ps(z0, one), _mm_set1_ps(3*G3));
+
+    int ii[4], jj[4], kk[4], o1[4], o2[4];
+    _mm_storeu_si128((__m128i *)ii, _mm_and_si128(i, _mm_set1_epi32(255)));
+    _mm_storeu_si128((__m128i *)jj, _mm_and_si128(j, _mm_set1_epi32(255)));
+    _mm_storeu_si128((__m128i *)kk, _mm_and_si128(k, _mm_set1_epi32(255)));
+    // offsets of the second and third corners as bits 0 (i), 1 (j), 2 (k)
+    __m128i b1 = _mm_or_si128(_mm_or_si128(
+        _mm_and_si128(_mm_castps_si128(m_i1), _mm_set1_epi32(1)),
+        _mm_and_si128(_mm_castps_si128(m_j1), _mm_set1_epi32(2))),
+        _mm_and_si128(_mm_castps_si128(m_k1), _mm_set1_epi32(4)));
+    __m128i b2 = _mm_or_si128(_mm_or_si128(
+        _mm_and_si128(_mm_castps_si128(m_i2), _mm_set1_epi32(1)),
+        _mm_and_si128(_mm_castps_si128(m_j2), _mm_set1_epi32(2))),
+        _mm_and_si128(_mm_castps_si128(m_k2), _mm_set1_epi32(4)));
+    _mm_storeu_si128((__m128i *)o1, b1);
+    _mm_storeu_si128((__m128i *)o2, b2);
+    float g[12][4];
+    const int *perm = tables.perm;
+    for (int l = 0; l < 4; l++) {
+        int a1 = o1[l] & 1, b1 = (o1[l] >> 1) & 1, c1 = o1[l] >> 2;
+        int a2 = o2[l] & 1, b2 = (o2[l] >> 1) & 1, c2 = o2[l] >> 2;
+        int h0 = ii[l] + perm[jj[l] + perm[kk[l]]];
+        int h1 = ii[l] + a1 + perm[jj[l] + b1 + perm[kk[l] + c1]];
+        int h2 = ii[l] + a2 + perm[jj[l] + b2 + perm[kk[l] + c2]];
+        int h3 = ii[l] + 1 + perm[jj[l] + 1 + perm[kk[l] + 1]];
+        g[0][l] = tables.gradX[h0]; g[1][l] = tables.gradY[h0]; g[2][l] = tables.gradZ[h0];
+        g[3][l] = tables.gradX[h1]; g[4][l] = tables.gradY[h1]; g[5][l] = tables.gradZ[h1];
+        g[6][l] = tables.gradX[h2]; g[7][l] = tables.gradY[h2]; g[8][l] = tables.gradZ[h2];
+        g[9][l] = tables.gradX[h3]; g[10][l] = tables.gradY[h3]; g[11][l] = tables.gradZ[h3];
+    }
+
+    const __m128 r2 = _mm_set1_ps(0.6F);
+    __m128 n = corner3_sse2(x0, y0, z0, _mm_loadu_ps(g[0]), _mm_loadu_ps(g[1]), _mm_loadu_ps(g[2]), r2);
+    n = _mm_add_ps(n, corner3_sse2(x1, y1, z1, _mm_loadu_ps(g[3]), _mm_loadu_ps(g[4]), _mm_loadu_ps(g[5]), r2));
+    n = _mm_add_ps(n, corner3_sse2(x2, y2, z2, _mm_loadu_ps(g[6]), _mm_loadu_ps(g[7]), _mm_loadu_ps(g[8]), r2));
+    n = _mm_add_ps(n, corner3_sse2(x3, y3, z3, _mm_loadu_ps(g[9]), _mm_loadu_ps(g[10]), _mm_loadu_ps(g[11]), r2));
+    return _mm_mul_ps(n, _mm_set1_ps(32.0F));
+}
+
+static NOISE_AVX2 inline __m256i floor_avx2(__m256 v)
+{
+    return _mm256_cvttps_epi32(_mm256_floor_ps(v));
+}
+
+// the gradient comes straight from the hash, no % 12 step
+static NOISE_AVX2 inline __m256 corner2_avx2(const Noise::Tables &tables, __m256 x, __m256 y, __m256i h, __m256 r2)
+{
+    __m256 gx = _mm256_i32gather_ps(tables.gradX, h, 4);
+    __m256 gy = _mm256_i32gather_ps(tables.gradY, h, 4);
+    __m256 t = _mm256_sub_ps(_mm256_sub_ps(r2, _mm256_mul_ps(x, x)), _mm256_mul_ps(y, y));
+    t = _mm256_max_ps(t, _mm256_setzero_ps());
+    t = _mm256_mul_ps(t, t);
+    t = _mm256_mul_ps(t, t);
+    return _mm256_mul_ps(t, _mm256_add_ps(_mm256_mul_ps(gx, x), _mm256_mul_ps(gy, y)));
+}
+
+static NOISE_AVX2 inline __m256 corner3_avx2(const Noise::Tables &tables, __m256 x, __m256 y, __m256 z, __m256i h, __m256 r2)
+{
+    __m256 gx = _mm256_i32gather_ps(tables.gradX, h, 4);
+    __m256 gy = _mm256_i32gather_ps(tables.gradY, h, 4);
+    __m256 gz = _mm256_i32gather_ps(tables.gradZ, h, 4);
+    __m256 t = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(r2, _mm256_mul_ps(x, x)), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z));
+    t = _mm256_max_ps(t, _mm256_setzero_ps());
+    t = _mm256_mul_ps(t, t);
+    t = _mm256_mul_ps(t, t);
+    return _mm256_mul_ps(t, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(gx, x), _mm256_mul_ps(gy, y)), _mm256_mul_ps(gz, z)));
+}
+
+// perm[a + perm[b]] and friends, a mask of -1 adds 1
+static NOISE_AVX2 inline __m256i perm_avx2(const Noise::Tables &tables, __m256i index)
+{
+    return _mm256_i32gather_epi32(tables.perm, index, 4);
+}
+
+static NOISE_AVX2 inline __m256i step_avx2(__m256i v, __m256 mask)
+{
+    return _mm256_sub_epi32(v, _mm256_castps_si256(mask));
+}
+
+static NOISE_AVX2 inline __m256 simplex2_avx2_8(const Noise::Tables &tables, __m256 x, __m256 y)
+{
+    const __m256 one = _mm256_set1_ps(1.0F);
+    const __m256 g2 = _mm256_set1_ps(G2);
+    const __m256i wrap = _mm256_set1_epi32(255);
+    const __m256i inc = _mm256_set1_epi32(1);
+    __m256 s = _mm256_mul_ps(_mm256_add_ps(x, y), _mm256_set1_ps(F2));
+    __m256i i = floor_avx2(_mm256_add_ps(x, s));
+    __m256i j = floor_avx2(_mm256_add_ps(y, s));
+    __m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(i, j)), g2);
+    __m256 x0 = _mm256_sub_ps(x, _mm256_sub_ps(_mm256_cvtepi32_ps(i), t));
+    __m256 y0 = _mm256_sub_ps(y, _mm256_sub_ps(_mm256_cvtepi32_ps(j), t));
+    __m256 lower = _mm256_cmp_ps(x0, y0, _CMP_GT_OQ);
+    __m256 upper = _mm256_andnot_ps(lower, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+    __m256 x1 = _mm256_add_ps(_mm256_sub_ps(x0, _mm256_and_ps(lower, one)), g2);
+    __m256 y1 = _mm256_add_ps(_mm256_sub_ps(y0, _mm256_and_ps(upper, one)), g2);
+    __m256 x2 = _mm256_add_ps(_mm256_sub_ps(x0, one), _mm256_set1_ps(2*G2));
+    __m256 y2 = _mm256_add_ps(_mm256_sub_ps(y0, one), _mm256_set1_ps(2*G2));
+
+    __m256i ii = _mm256_and_si256(i, wrap);
+    __m256i jj = _mm256_and_si256(j, wrap);
+    __m256i h0 = _mm256_add_epi32(ii, perm_avx2(tables, jj));
+    __m256i h1 = _mm256_add_epi32(step_avx2(ii, lower), perm_avx2(tables, step_avx2(jj, upper)));
+    __m256i h2 = _mm256_add_epi32(_mm256_add_epi32(ii, inc), perm_avx2(tables, _mm256_add_epi32(jj, inc)));
+
+    const __m256 r2 = _mm256_set1_ps(0.5F);
+    __m256 n = corner2_avx2(tables, x0, y0, h0, r2);
+    n = _mm256_add_ps(n, corner2_avx2(tables, x1, y1, h1, r2));
+    n = _mm256_add_ps(n, corner2_avx2(tables, x2, y2, h2, r2));
+    return _mm256_mul_ps(n, _mm256_set1_ps(70.0F));
+}
+
+static NOISE_AVX2 inline __m256 simplex3_avx2_8(const Noise::Tables &tables, __m256 x, __m256 y, __m256 z)
+{
+    const __m256 one = _mm256_set1_ps(1.0F);
+    const __m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    const __m256 g3 = _mm256_set1_ps(G3);
+    const __m256i wrap = _mm256_set1_epi32(255);
+    const __m256i inc = _mm256_set1_epi32(1);
+    __m256 s = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(x, y), z), _mm256_set1_ps(F3));
+    __m256i i = floor_avx2(_mm256_add_ps(x, s));
+    __m256i j = floor_avx2(_mm256_add_ps(y, s));
+    __m256i k = floor_avx2(_mm256_add_ps(z, s));
+    __m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_add_epi32(i, j), k)), g3);
+    __m256 x0 = _mm256_sub_ps(x, _mm256_sub_ps(_mm256_cvtepi32_ps(i), t));
+    __m256 y0 = _mm256_sub_ps(y, _mm256_sub_ps(_mm256_cvtepi32_ps(j), t));
+    __m256 z0 = _mm256_sub_ps(z, _mm256_sub_ps(_mm256_cvtepi32_ps(k), t));
+
+    __m256 xy = _mm256_cmp_ps(x0, y0, _CMP_GE_OQ);
+    __m256 yz = _mm256_cmp_ps(y0, z0, _CMP_GE_OQ);
+    __m256 xz = _mm256_cmp_ps(x0, z0, _CMP_GE_OQ);
+    __m256 m_i1 = _mm256_and_ps(xy, xz);
+    __m256 m_j1 = _mm256_andnot_ps(xy, yz);
+    __m256 m_k1 = _mm256_andnot_ps(_mm256_or_ps(m_i1, m_j1), all);
+    __m256 m_i2 = _mm256_or_ps(xy, xz);
+    __m256 m_j2 = _mm256_or_ps(_mm256_andnot_ps(xy, all), yz);
+    __m256 m_k2 = _mm256_andnot_ps(_mm256_and_ps(m_i2, m_j2), all);
+
+    __m256 x1 = _mm256_add_ps(_mm256_sub_ps(x0, _mm256_and_ps(m_i1, one)), g3);
+    __m256 y1 = _mm256_add_ps(_mm256_sub_ps(y0, _mm256_and_ps(m_j1, one)), g3);
+    __m256 z1 = _mm256_add_ps(_mm256_sub_ps(z0, _mm256_and_ps(m_k1, one)), g3);
+    __m256 x2 = _mm256_add_ps(_mm256_sub_ps(x0, _mm256_and_ps(m_i2, one)), _mm256_set1_ps(2*G3));
+    __m256 y2 = _mm256_add_ps(_mm256_sub_ps(y0, _mm256_and_ps(m_j2, one)), _mm256_set1_ps(2*G3));
+    __m256 z2 = _mm256_add_ps(_mm256_sub_ps(z0, _mm256_and_ps(m_k2, one)), _mm256_set1_ps(2*G3));
+    __m256 x3 = _mm256_add_ps(_mm256_sub_ps(x0, one), _mm256_set1_ps(3*G3));
+    __m256 y3 = _mm256_add_ps(_mm256_sub_ps(y0, one), _mm256_set1_ps(3*G3));
+    __m256 z3 = _mm256_add_ps(_mm256_sub_ps(z0, one), _mm256_set1_ps(3*G3));
+
+    __m256i ii = _mm256_and_si256(i, wrap);
+    __m256i jj = _mm256_and_si256(j, wrap);
+    __m256i kk = _mm256_and_si256(k, wrap);
+    __m256i h0 = _mm256_add_epi32(ii,
+        perm_avx2(tables, _mm256_add_epi32(jj, perm_avx2(tables, kk))));
+    __m256i h1 = _mm256_add_epi32(step_avx2(ii, m_i1),
+        perm_avx2(tables, _mm256_add_epi32(step_avx2(jj, m_j1), perm_avx2(tables, step_avx2(kk, m_k1)))));
+    __m256i h2 = _mm256_add_epi32(step_avx2(ii, m_i2),
+        perm_avx2(tables, _mm256_add_epi32(step_avx2(jj, m_j2), perm_avx2(tables, step_avx2(kk, m_k2)))));
+    __m256i h3 = _mm256_add_epi32(_mm256_add_epi32(ii, inc),
+        perm_avx2(tables, _mm256_add_epi32(_mm256_add_epi32(jj, inc), perm_avx2(tables, _mm256_add_epi32(kk, inc)))));
+
+    const __m256 r2 = _mm256_set1_ps(0.6F);
+    __m256 n = corner3_avx2(tables, x0, y0, z0, h0, r2);
+    n = _mm256_add_ps(n, corner3_avx2(tables, x1, y1, z1, h1, r2));
+    n = _mm256_add_ps(n, corner3_avx2(tables, x2, y2, z2, h2, r2));
+    n = _mm256_add_ps(n, corner3_avx2(tables, x3, y3, z3, h3, r2));
+    return _mm256_mul_ps(n, _mm256_set1_ps(32.0F));
+}
+
+// the tail goes through a zero padded block of the kernel's width
+static void simplex2_sse2(const Noise::Tables &tables, const float *x, const float *y, float *out, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, simplex2_sse2_4(tables, _mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+    if (i < count) {
+        float bx[4] = {0}, by[4] = {0}, bo[4];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        _mm_storeu_ps(bo, simplex2_sse2_4(tables, _mm_loadu_ps(bx), _mm_loadu_ps(by)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+}
+
+static void simplex3_sse2(const Noise::Tables &tables, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, simplex3_sse2_4(tables, _mm_loadu_ps(x + i), _mm_loadu_ps(y + i), _mm_loadu_ps(z + i)));
+    }
+    if (i < count) {
+        float bx[4] = {0}, by[4] = {0}, bz[4] = {0}, bo[4];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        memcpy(bz, z + i, (count - i)*sizeof(float));
+        _mm_storeu_ps(bo, simplex3_sse2_4(tables, _mm_loadu_ps(bx), _mm_loadu_ps(by), _mm_loadu_ps(bz)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+}
+
+static NOISE_AVX2 void simplex2_avx2(const Noise::Tables &tables, const float *x, const float *y, float *out, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, simplex2_avx2_8(tables, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    if (i < count) {
+        float bx[8] = {0}, by[8] = {0}, bo[8];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        _mm256_storeu_ps(bo, simplex2_avx2_8(tables, _mm256_loadu_ps(bx), _mm256_loadu_ps(by)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+    _mm256_zeroupper();
+}
+
+static NOISE_AVX2 void simplex3_avx2(const Noise::Tables &tables, const float *x, const float *y, const float *z, float *out, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, simplex3_avx2_8(tables, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), _mm256_loadu_ps(z + i)));
+    }
+    if (i < count) {
+        float bx[8] = {0}, by[8] = {0}, bz[8] = {0}, bo[8];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        memcpy(bz, z + i, (count - i)*sizeof(float));
+        _mm256_storeu_ps(bo, simplex3_avx2_8(tables, _mm256_loadu_ps(bx), _mm256_loadu_ps(by), _mm256_loadu_ps(bz)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+    _mm256_zeroupper();
+}
+
+static bool cpuHasSse2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+
+static bool cpuHasAvx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // AVX and OSXSAVE, and the OS saves the ymm registers
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif // x86
+
+static NoiseKernel bestNoiseKernel()
+{
+#ifdef NOISE_SIMD
+    if (cpuHasAvx2()) {
+        return NOISE_KERNEL_AVX2;
+    }
+    if (cpuHasSse2()) {
+        return NOISE_KERNEL_SSE2;
+    }
+#endif
+    return NOISE_KERNEL_SCALAR;
+}
+
+static const NoiseKernel noiseKernelSupported = bestNoiseKernel();
+static NoiseKernel noiseKernelActive = noiseKernelSupported;
+
+NoiseKernel noiseKernel()
+{
+    return noiseKernelActive;
+}
+
+NoiseKernel setNoiseKernel(NoiseKernel kernel)
+{
+    noiseKernelActive = kernel < noiseKernelSupported ? kernel : noiseKernelSupported;
+    return noiseKernelActive;
+}
+
+void Noise::Simplex( const float *x, const float *y, float *out, size_t count ) const
+{
+    switch (noiseKernelActive) {
+#ifdef NOISE_SIMD
+    case NOISE_KERNEL_AVX2: simplex2_avx2(m_tables, x, y, out, count); return;
+    case NOISE_KERNEL_SSE2: simplex2_sse2(m_tables, x, y, out, count); return;
+#endif
+    default: simplex2_scalar(*this, x, y, out, count); return;
+    }
+}
+
+void Noise::Simplex( const float *x, const float *y, const float *z, float *out, size_t count ) const
+{
+    switch (noiseKernelActive) {
+#ifdef NOISE_SIMD
+    case NOISE_KERNEL_AVX2: simplex3_avx2(m_tables, x, y, z, out, count); return;
+    case NOISE_KERNEL_SSE2: simplex3_sse2(m_tables, x, y, z, out, count); return;
+#endif
+    default: simplex3_scalar(*this, x, y, z, out, count); return;
+    }
+}
+
+void simplexnoise( const float *x, const float *y, float *out, size_t count )
+{
+    referenceNoise.Simplex(x, y, out, count);
+}
+
+void simplexnoise( const float *x, const float *y, const float *z, float *out, size_t count )
+{
+    referenceNoise.Simplex(x, y, z, out, count);
+}
+
+void noise( const float *x, const float *y, const float *z, float *out, size_t count )
+{
+    // classic noise has no vector kernel, nothing calls it in bulk
+    for (size_t i = 0; i < count; i++) {
+        out[i] = noise(x[i], y[i], z[i]);
+    }
+}
+
+void simplexnoise_row( float x, float y, float dx, float dy, float *out, size_t count )
+{
+    // coordinates are built in blocks that stay in L1
+    float bx[256], by[256];
+    for (size_t i = 0; i < count; i += 256) {
+        size_t n = count - i < 256 ? count - i : 256;
+        for (size_t k = 0; k < n; k++) {
+            bx[k] = x + (i + k)*dx;
+            by[k] = y + (i + k)*dy;
+        }
+        simplexnoise(bx, by, out + i, n);
+    }
+}
+
+// fractal noise
+
+#define FRACTAL_TILE 64
+
+FractalNoise::FractalNoise() :
+    Octaves(4),
+    Frequency(1),
+    Lacunarity(2),
+    Amplitude(1),
+    Gain(0.5F),
+    Type(FRACTAL_FBM),
+    Warp(0),
+    WarpFrequency(1)
+{
+}
+
+// where the warp fields are sampled, apart so they do not correlate
+static const float warpShift[9] = { 5.2F, 1.3F, 1.7F, 9.2F, 8.3F, 2.8F, 4.6F, 7.1F, 3.9F };
+
+static inline float fractalShape( FractalType type, float n )
+{
+    float a = n < 0 ? -n : n;
+    if (type == FRACTAL_RIDGED) {
+        return (1 - a)*(1 - a);
+    }
+    if (type == FRACTAL_BILLOW) {
+        return 2*a - 1;
+    }
+    return n;
+}
+
+float FractalNoise::Get( float x, float y ) const
+{
+    if (Warp != 0) {
+        float wx = Source.Simplex(x*WarpFrequency + warpShift[0], y*WarpFrequency + warpShift[1]);
+        float wy = Source.Simplex(x*WarpFrequency + warpShift[2], y*WarpFrequency + warpShift[3]);
+        x += Warp*wx;
+        y += Warp*wy;
+    }
+    float sum = 0, frequency = Frequency, amplitude = Amplitude;
+    for (int o = 0; o < Octaves; o++) {
+        sum += fractalShape(Type, Source.Simplex(x*frequency, y*frequency))*amplitude;
+        frequency *= Lacunarity;
+        amplitude *= Gain;
+    }
+    return sum;
+}
+
+float FractalNoise::Get( float x, float y, float z ) const
+{
+    if (Warp != 0) {
+        float wx = Source.Simplex(x*WarpFrequency + warpShift[0], y*WarpFrequency + warpShift[1], z*WarpFrequency + warpShift[2]);
+        float wy = Source.Simplex(x*WarpFrequency + warpShift[3], y*WarpFrequency + warpShift[4], z*WarpFrequency + warpShift[5]);
+        float wz = Source.Simplex(x*WarpFrequency + warpShift[6], y*WarpFrequency + warpShift[7], z*WarpFrequency + warpShift[8]);
+        x += Warp*wx;
+        y += Warp*wy;
+        z += Warp*wz;
+    }
+    float sum = 0, frequency = Frequency, amplitude = Amplitude;
+    for (int o = 0; o < Octaves; o++) {
+        sum += fractalShape(Type, Source.Simplex(x*frequency, y*frequency, z*frequency))*amplitude;
+        frequency *= Lacunarity;
+        amplitude *= Gain;
+    }
+    return sum;
+}
+
+#ifdef NOISE_SIMD
+static inline __m128 fractalShape_sse2( FractalType type, __m128 n )
+{
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    if (type == FRACTAL_RIDGED) {
+        n = _mm_sub_ps(_mm_set1_ps(1.0F), _mm_and_ps(n, abs_mask));
+        return _mm_mul_ps(n, n);
+    }
+    if (type == FRACTAL_BILLOW) {
+        return _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(2.0F), _mm_and_ps(n, abs_mask)), _mm_set1_ps(1.0F));
+    }
+    return n;
+}
+
+static inline __m128 fractal_sse2_4( const FractalNoise &f, __m128 x, __m128 y )
+{
+    const Noise::Tables &tables = f.Source.GetTables();
+    if (f.Warp != 0) {
+        __m128 wf = _mm_set1_ps(f.WarpFrequency);
+        __m128 wx = simplex2_sse2_4(tables, _mm_add_ps(_mm_mul_ps(x, wf), _mm_set1_ps(warpShift[0])),
+            _mm_add_ps(_mm_mul_ps(y, wf), _mm_set1_ps(warpShift[1])));
+        __m128 wy = simplex2_sse2_4(tables, _mm_add_ps(_mm_mul_ps(x, wf), _mm_set1_ps(warpShift[2])),
+            _mm_add_ps(_mm_mul_ps(y, wf), _mm_set1_ps(warpShift[3])));
+        x = _mm_add_ps(x, _mm_mul_ps(_mm_set1_ps(f.Warp), wx));
+        y = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(f.Warp), wy));
+    }
+    __m128 sum = _mm_setzero_ps();
+    float frequency = f.Frequency, amplitude = f.Amplitude;
+    for (int o = 0; o < f.Octaves; o++) {
+        __m128 fr = _mm_set1_ps(frequency);
+        __m128 n = fractalShape_sse2(f.Type, simplex2_sse2_4(tables, _mm_mul_ps(x, fr), _mm_mul_ps(y, fr)));
+        sum = _mm_add_ps(sum, _mm_mul_ps(n, _mm_set1_ps(amplitude)));
+        frequency *= f.Lacunarity;
+        amplitude *= f.Gain;
+    }
+    return sum;
+}
+
+static inline __m128 fractal3_sse2_4( const FractalNoise &f, __m128 x, __m128 y, __m128 z )
+{
+    const Noise::Tables &tables = f.Source.GetTables();
+    if (f.Warp != 0) {
+        __m128 wf = _mm_set1_ps(f.WarpFrequency);
+        __m128 sx = _mm_mul_ps(x, wf), sy = _mm_mul_ps(y, wf), sz = _mm_mul_ps(z, wf);
+        __m128 w[3];
+        for (int k = 0; k < 3; k++) {
+            w[k] = simplex3_sse2_4(tables, _mm_add_ps(sx, _mm_set1_ps(warpShift[3*k])),
+                _mm_add_ps(sy, _mm_set1_ps(warpShift[3*k+1])), _mm_add_ps(sz, _mm_set1_ps(warpShift[3*k+2])));
+        }
+        x = _mm_add_ps(x, _mm_mul_ps(_mm_set1_ps(f.Warp), w[0]));
+        y = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(f.Warp), w[1]));
+        z = _mm_add_ps(z, _mm_mul_ps(_mm_set1_ps(f.Warp), w[2]));
+    }
+    __m128 sum = _mm_setzero_ps();
+    float frequency = f.Frequency, amplitude = f.Amplitude;
+    for (int o = 0; o < f.Octaves; o++) {
+        __m128 fr = _mm_set1_ps(frequency);
+        __m128 n = fractalShape_sse2(f.Type, simplex3_sse2_4(tables, _mm_mul_ps(x, fr), _mm_mul_ps(y, fr), _mm_mul_ps(z, fr)));
+        sum = _mm_add_ps(sum, _mm_mul_ps(n, _mm_set1_ps(amplitude)));
+        frequency *= f.Lacunarity;
+        amplitude *= f.Gain;
+    }
+    return sum;
+}
+
+static NOISE_AVX2 inline __m256 fractalShape_avx2( FractalType type, __m256 n )
+{
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    if (type == FRACTAL_RIDGED) {
+        n = _mm256_sub_ps(_mm256_set1_ps(1.0F), _mm256_and_ps(n, abs_mask));
+        return _mm256_mul_ps(n, n);
+    }
+    if (type == FRACTAL_BILLOW) {
+        return _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(2.0F), _mm256_and_ps(n, abs_mask)), _mm256_set1_ps(1.0F));
+    }
+    return n;
+}
+
+static NOISE_AVX2 inline __m256 fractal_avx2_8( const FractalNoise &f, __m256 x, __m256 y )
+{
+    const Noise::Tables &tables = f.Source.GetTables();
+    if (f.Warp != 0) {
+        __m256 wf = _mm256_set1_ps(f.WarpFrequency);
+        __m256 wx = simplex2_avx2_8(tables, _mm256_add_ps(_mm256_mul_ps(x, wf), _mm256_set1_ps(warpShift[0])),
+            _mm256_add_ps(_mm256_mul_ps(y, wf), _mm256_set1_ps(warpShift[1])));
+        __m256 wy = simplex2_avx2_8(tables, _mm256_add_ps(_mm256_mul_ps(x, wf), _mm256_set1_ps(warpShift[2])),
+            _mm256_add_ps(_mm256_mul_ps(y, wf), _mm256_set1_ps(warpShift[3])));
+        x = _mm256_add_ps(x, _mm256_mul_ps(_mm256_set1_ps(f.Warp), wx));
+        y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(f.Warp), wy));
+    }
+    __m256 sum = _mm256_setzero_ps();
+    float frequency = f.Frequency, amplitude = f.Amplitude;
+    for (int o = 0; o < f.Octaves; o++) {
+        __m256 fr = _mm256_set1_ps(frequency);
+        __m256 n = fractalShape_avx2(f.Type, simplex2_avx2_8(tables, _mm256_mul_ps(x, fr), _mm256_mul_ps(y, fr)));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(n, _mm256_set1_ps(amplitude)));
+        frequency *= f.Lacunarity;
+        amplitude *= f.Gain;
+    }
+    return sum;
+}
+
+static NOISE_AVX2 inline __m256 fractal3_avx2_8( const FractalNoise &f, __m256 x, __m256 y, __m256 z )
+{
+    const Noise::Tables &tables = f.Source.GetTables();
+    if (f.Warp != 0) {
+        __m256 wf = _mm256_set1_ps(f.WarpFrequency);
+        __m256 sx = _mm256_mul_ps(x, wf), sy = _mm256_mul_ps(y, wf), sz = _mm256_mul_ps(z, wf);
+        __m256 w[3];
+        for (int k = 0; k < 3; k++) {
+            w[k] = simplex3_avx2_8(tables, _mm256_add_ps(sx, _mm256_set1_ps(warpShift[3*k])),
+                _mm256_add_ps(sy, _mm256_set1_ps(warpShift[3*k+1])), _mm256_add_ps(sz, _mm256_set1_ps(warpShift[3*k+2])));
+        }
+        x = _mm256_add_ps(x, _mm256_mul_ps(_mm256_set1_ps(f.Warp), w[0]));
+        y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(f.Warp), w[1]));
+        z = _mm256_add_ps(z, _mm256_mul_ps(_mm256_set1_ps(f.Warp), w[2]));
+    }
+    __m256 sum = _mm256_setzero_ps();
+    float frequency = f.Frequency, amplitude = f.Amplitude;
+    for (int o = 0; o < f.Octaves; o++) {
+        __m256 fr = _mm256_set1_ps(frequency);
+        __m256 n = fractalShape_avx2(f.Type, simplex3_avx2_8(tables, _mm256_mul_ps(x, fr), _mm256_mul_ps(y, fr), _mm256_mul_ps(z, fr)));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(n, _mm256_set1_ps(amplitude)));
+        frequency *= f.Lacunarity;
+        amplitude *= f.Gain;
+    }
+    return sum;
+}
+
+static void fractal_sse2( const FractalNoise &f, const float *x, const float *y, float *out, size_t count )
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, fractal_sse2_4(f, _mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+    if (i < count) {
+        float bx[4] = {0}, by[4] = {0}, bo[4];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        _mm_storeu_ps(bo, fractal_sse2_4(f, _mm_loadu_ps(bx), _mm_loadu_ps(by)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+}
+
+static NOISE_AVX2 void fractal_avx2( const FractalNoise &f, const float *x, const float *y, float *out, size_t count )
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, fractal_avx2_8(f, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    if (i < count) {
+        float bx[8] = {0}, by[8] = {0}, bo[8];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        _mm256_storeu_ps(bo, fractal_avx2_8(f, _mm256_loadu_ps(bx), _mm256_loadu_ps(by)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+    _mm256_zeroupper();
+}
+
+static void fractal3_sse2( const FractalNoise &f, const float *x, const float *y, const float *z, float *out, size_t count )
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, fractal3_sse2_4(f, _mm_loadu_ps(x + i), _mm_loadu_ps(y + i), _mm_loadu_ps(z + i)));
+    }
+    if (i < count) {
+        float bx[4] = {0}, by[4] = {0}, bz[4] = {0}, bo[4];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        memcpy(bz, z + i, (count - i)*sizeof(float));
+        _mm_storeu_ps(bo, fractal3_sse2_4(f, _mm_loadu_ps(bx), _mm_loadu_ps(by), _mm_loadu_ps(bz)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+}
+
+static NOISE_AVX2 void fractal3_avx2( const FractalNoise &f, const float *x, const float *y, const float *z, float *out, size_t count )
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, fractal3_avx2_8(f, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), _mm256_loadu_ps(z + i)));
+    }
+    if (i < count) {
+        float bx[8] = {0}, by[8] = {0}, bz[8] = {0}, bo[8];
+        memcpy(bx, x + i, (count - i)*sizeof(float));
+        memcpy(by, y + i, (count - i)*sizeof(float));
+        memcpy(bz, z + i, (count - i)*sizeof(float));
+        _mm256_storeu_ps(bo, fractal3_avx2_8(f, _mm256_loadu_ps(bx), _mm256_loadu_ps(by), _mm256_loadu_ps(bz)));
+        memcpy(out + i, bo, (count - i)*sizeof(float));
+    }
+    _mm256_zeroupper();
+}
+#endif // NOISE_SIMD
+
+void FractalNoise::Get( const float *x, const float *y, float *out, size_t count ) const
+{
+    switch (noiseKernelActive) {
+#ifdef NOISE_SIMD
+    case NOISE_KERNEL_AVX2: fractal_avx2(*this, x, y, out, count); return;
+    case NOISE_KERNEL_SSE2: fractal_sse2(*this, x, y, out, count); return;
+#endif
+    default:
+        for (size_t i = 0; i < count; i++) {
+            out[i] = Get(x[i], y[i]);
+        }
+        return;
+    }
+}
+
+void FractalNoise::Get( const float *x, const float *y, const float *z, float *out, size_t count ) const
+{
+    switch (noiseKernelActive) {
+#ifdef NOISE_SIMD
+    case NOISE_KERNEL_AVX2: fractal3_avx2(*this, x, y, z, out, count); return;
+    case NOISE_KERNEL_SSE2: fractal3_sse2(*this, x, y, z, out, count); return;
+#endif
+    default:
+        for (size_t i = 0; i < count; i++) {
+            out[i] = Get(x[i], y[i], z[i]);
+        }
+        return;
+    }
+}
+
+// row(r, col0, cols, out) writes cols texels of row r from col0 on. Square
+// tiles keep a worker on neighbouring rows of the map
+static void fillTiles( Heightmap *map, unsigned threads, const std::function<void(size_t, size_t, size_t, float *)> &row )
+{
+    const size_t tile = FRACTAL_TILE;
+    size_t tiles_x = (map->width + tile - 1)/tile;
+    size_t tiles_y = (map->height + tile - 1)/tile;
+    std::vector<float> low(tiles_x*tiles_y), high(tiles_x*tiles_y);
+    parallel_for(0, tiles_x*tiles_y, [&](size_t t) {
+        size_t col0 = (t % tiles_x)*tile, row0 = (t / tiles_x)*tile;
+        size_t cols = map->width - col0 < tile ? map->width - col0 : tile;
+        size_t rows = map->height - row0 < tile ? map->height - row0 : tile;
+        float lo = FLT_MAX, hi = -FLT_MAX;
+        for (size_t r = row0; r < row0 + rows; r++) {
+            float *out = map->map + r*map->width + col0;
+            row(r, col0, cols, out);
+            for (size_t c = 0; c < cols; c++) {
+                lo = out[c] < lo ? out[c] : lo;
+                hi = out[c] > hi ? out[c] : hi;
+            }
+        }
+        low[t] = lo;
+        high[t] = hi;
+    }, threads);
+    map->minZ = FLT_MAX;
+    map->maxZ = -FLT_MAX;
+    for (size_t t = 0; t < low.size(); t++) {
+        map->minZ = low[t] < map->minZ ? low[t] : map->minZ;
+        map->maxZ = high[t] > map->maxZ ? high[t] : map->maxZ;
+    }
+}
+
+void FractalNoise::Fill( Heightmap *map, float x, float y, float step, unsigned threads ) const
+{
+    fillTiles(map, threads, [&](size_t r, size_t col0, size_t cols, float *out) {
+        float bx[FRACTAL_TILE], by[FRACTAL_TILE];
+        for (size_t c = 0; c < cols; c++) {
+            bx[c] = x + (col0 + c)*step;
+            by[c] = y + r*step;
+        }
+        Get(bx, by, out, cols);
+    });
+}
+
+void FractalNoise::FillSphere( Heightmap *map, const float rotation[9], float radius, unsigned threads ) const
+{
+    fillTiles(map, threads, [&](size_t r, size_t col0, size_t cols, float *out) {
+        float bx[FRACTAL_TILE], by[FRACTAL_TILE], bz[FRACTAL_TILE];
+        float v = r/(float)(map->height - 1) - 0.5F;
+        for (size_t c = 0; c < cols; c++) {
+            float u = (col0 + c)/(float)(map->width - 1) - 0.5F;
+            float scale = radius/sqrtf(u*u + v*v + 0.25F);
+            float px = u*scale, py = v*scale, pz = -0.5F*scale;
+            bx[c] = rotation[0]*px + rotation[1]*py + rotation[2]*pz;
+            by[c] = rotation[3]*px + rotation[4]*py + rotation[5]*pz;
+            bz[c] = rotation[6]*px + rotation[7]*py + rotation[8]*pz;
+        }
+        Get(bx, by, bz, out, cols);
+    });
+}
+
+unsigned int FractalNoise::Hash() const
+{
+    unsigned int hash = 2166136261u;
+    float values[] = { (float)Octaves, Frequency, Lacunarity, Amplitude, Gain, (float)Type, Warp, WarpFrequency };
+    const unsigned char *bytes = (const unsigned char *)values;
+    for (size_t i = 0; i < sizeof(values); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    unsigned int seed = Source.Seed();
+    bytes = (const unsigned char *)&seed;
+    for (size_t i = 0; i < sizeof(seed); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
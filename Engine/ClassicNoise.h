@@ -1,5 +1,123 @@
 #pragma once
+#include <stddef.h>
 float noise( float x, float y, float z );
 float simplexnoise( float x, float y, float z, float w );
 float simplexnoise( float xin, float yin, float zin );
-float simplexnoise( float xin, float yin );
\ No newline at end of file
+float simplexnoise( float xin, float yin );
+
+// batched: out[i] = simplexnoise(x[i], y[i]) etc. for i < count, on the best
+// kernel the CPU has. Vector kernels compute in float where the scalar
+// functions mix in doubles, results differ from them by less than 1e-5
+void simplexnoise( const float *x, const float *y, float *out, size_t count );
+void simplexnoise( const float *x, const float *y, const float *z, float *out, size_t count );
+void noise( const float *x, const float *y, const float *z, float *out, size_t count );
+
+// out[i] = simplexnoise(x + i*dx, y + i*dy), a heightmap row
+void simplexnoise_row( float x, float y, float dx, float dy, float *out, size_t count );
+
+enum NoiseKernel
+{
+    NOISE_KERNEL_SCALAR,
+    NOISE_KERNEL_SSE2,
+    NOISE_KERNEL_AVX2
+};
+
+// kernel the batched functions use, the best supported one by default
+NoiseKernel noiseKernel();
+
+// picks a kernel (clamped to what the CPU supports) and returns the one in use,
+// for comparing them
+NoiseKernel setNoiseKernel( NoiseKernel kernel );
+
+//************************************
+// Simplex and classic noise over a seeded permutation, so planets or regions
+// can each have their own field. The permutation is doubled to 512 entries,
+// nested lookups like perm[ii + perm[jj]] need no & 255, and the gradient of
+// every hash is stored per axis (SoA) so the vector kernels fetch it without
+// a % 12 step. Seed 0 is the reference permutation the free functions use.
+//************************************
+class Noise
+{
+public:
+    Noise( unsigned int seed = 0 );
+
+    unsigned int Seed() const;
+
+    float Classic( float x, float y, float z ) const;
+    float Simplex( float x, float y ) const;
+    float Simplex( float x, float y, float z ) const;
+    float Simplex( float x, float y, float z, float w ) const;
+
+    // batched like the free functions
+    void Simplex( const float *x, const float *y, float *out, size_t count ) const;
+    void Simplex( const float *x, const float *y, const float *z, float *out, size_t count ) const;
+
+    // perm[i] = permutation[i & 255], grad*[i] = grad3[perm[i] % 12]
+    struct Tables
+    {
+        int perm[512];
+        float gradX[512];
+        float gradY[512];
+        float gradZ[512];
+    };
+    const Tables &GetTables() const;
+
+private:
+    unsigned int m_seed;
+    Tables m_tables;
+};
+
+struct Heightmap;
+
+enum FractalType
+{
+    FRACTAL_FBM,      // sum of octaves
+    FRACTAL_RIDGED,   // (1 - |n|)^2, sharp crests
+    FRACTAL_BILLOW    // 2|n| - 1, rounded hills
+};
+
+//************************************
+// Fractal sum of 2D simplex octaves: octave o samples the (warped) point at
+// Frequency*Lacunarity^o with weight Amplitude*Gain^o. All octaves of a point
+// are evaluated in one pass on the batched kernels, the coordinates stay in
+// registers and nothing is written between octaves.
+// Domain warp moves the point by Warp times two noise fields at WarpFrequency
+// before the octaves.
+//************************************
+struct FractalNoise
+{
+    FractalNoise();
+
+    int Octaves;
+    float Frequency;
+    float Lacunarity;
+    float Amplitude;
+    float Gain;
+    FractalType Type;
+    float Warp;
+    float WarpFrequency;
+    // the field the octaves sample, Noise(seed) for another terrain
+    Noise Source;
+
+    float Get( float x, float y ) const;
+
+    // out[i] = Get(x[i], y[i])
+    void Get( const float *x, const float *y, float *out, size_t count ) const;
+
+    // map->map[row*width + col] = Get(x + col*step, y + row*step), minZ/maxZ
+    // updated. Tiles of the map go to threads workers (0 - every core)
+    void Fill( Heightmap *map, float x, float y, float step, unsigned threads = 0 ) const;
+
+    // 3D field, for surfaces that are not planes. Warp moves all three axes
+    float Get( float x, float y, float z ) const;
+    void Get( const float *x, const float *y, const float *z, float *out, size_t count ) const;
+
+    // fills a cube-sphere face: texel (col, row) samples the point of the
+    // sphere of radius under normalize(col/(w-1) - .5, row/(h-1) - .5, -.5)
+    // turned by the row-major rotation. Faces sharing an edge sample the same
+    // points along it, so their borders match
+    void FillSphere( Heightmap *map, const float rotation[9], float radius, unsigned threads = 0 ) const;
+
+    // FNV-1a over the parameters, for caches of generated maps
+    unsigned int Hash() const;
+};
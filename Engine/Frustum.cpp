@@ -85,6 +85,41 @@ void Frustum::Build(glm::mat4 viewMatrix, float aspect, float fov, float far, fl
     NormalizePlane(m_Frustum[PLANE_BACK]);
 }
 
+void Frustum::Build(const glm::mat4 &m)
+{
+    // rows of the matrix, glm is column-major
+    glm::vec4 row[4];
+    for(int i = 0; i < 4; ++i) {
+        row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+    }
+
+    m_Frustum[PLANE_LEFT] = row[3] + row[0];
+    m_Frustum[PLANE_RIGHT] = row[3] - row[0];
+    m_Frustum[PLANE_BOTTOM] = row[3] + row[1];
+    m_Frustum[PLANE_TOP] = row[3] - row[1];
+    m_Frustum[PLANE_FRONT] = row[3] + row[2];
+    m_Frustum[PLANE_BACK] = row[3] - row[2];
+
+    for(int i = 0; i < 6; ++i) {
+        NormalizePlane(m_Frustum[i]);
+    }
+}
+
+int Frustum::ContainsSphere(const glm::vec3 &center, float radius) const
+{
+    int result = INERSECT_IN;
+    for(int i = 0; i < 6; ++i) {
+        float distance = glm::dot(glm::vec3(m_Frustum[i]), center) + m_Frustum[i].w;
+        if(distance < -radius) {
+            return INERSECT_OUT;
+        }
+        if(distance < radius) {
+            result = INERSECT_INTERSECT;
+        }
+    }
+    return result;
+}
+
 int Frustum::Contains(glm::vec3 max, glm::vec3 min) const
 {
     glm::vec4 sphCenter = glm::vec4((max + min)/2.f, 1.f);
@@ -24,6 +24,10 @@
         glm::vec4 m_Frustum[6];
 
         void Build(glm::mat4 view, float aspect, float fov, float far, float near);
+        // planes of a projection*view matrix, normals point inside.
+        // projection*view*model gives the planes in model space
+        void Build(const glm::mat4 &viewProjection);
         int Contains(glm::vec3 max, glm::vec3 min) const;
+        int ContainsSphere(const glm::vec3 &center, float radius) const;
 };
 
@@ -8,7 +8,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 #include "GameMath.h"
+#include "ParallelFor.h"
+#include "MappedFile.h"
 
 void Heightmap_print(Heightmap *map)
 {
@@ -85,14 +88,119 @@ Heightmap *Heightmap_read(const char *filename)
     return map;
 }
 
+struct HeightmapFileHeader
+{
+    char magic[4];
+    unsigned int format;
+    unsigned int width, height;
+    float minZ, maxZ;
+    unsigned int reserved[2];
+};
+
+bool Heightmap_write(const Heightmap *map, const char *filename, HeightmapFormat format)
+{
+    HeightmapFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "HMB1", 4);
+    header.format = format;
+    header.width = (unsigned int)map->width;
+    header.height = (unsigned int)map->height;
+    header.minZ = FLT_MAX;
+    header.maxZ = -FLT_MAX;
+    size_t texels = map->width*map->height;
+    size_t i;
+    // the real range, minZ/maxZ of a map are not always kept up to date
+    for (i=0; i<texels; ++i) {
+        header.minZ = MIN(header.minZ, map->map[i]);
+        header.maxZ = MAX(header.maxZ, map->map[i]);
+    }
+
+    FILE *fd = fopen(filename, "wb");
+    if (!fd) {
+        printf("Unable to open file %s : %s\n", filename, strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fd) == 1;
+    if (format == HEIGHTMAP_F32) {
+        ok = ok && fwrite(map->map, sizeof(float), texels, fd) == texels;
+    } else {
+        float range = header.maxZ > header.minZ ? header.maxZ - header.minZ : 1.0f;
+        std::vector<unsigned short> q(map->width);
+        size_t x, y;
+        for (y=0; y<map->height && ok; ++y) {
+            for (x=0; x<map->width; ++x) {
+                q[x] = (unsigned short)((map->map[y*map->width + x] - header.minZ) / range * 65535.0f + 0.5f);
+            }
+            ok = fwrite(&q[0], sizeof(unsigned short), map->width, fd) == map->width;
+        }
+    }
+    ok = fclose(fd) == 0 && ok;
+    if (!ok) {
+        remove(filename);
+    }
+    return ok;
+}
+
+Heightmap *Heightmap_load(const char *filename)
+{
+    MappedFile *file = new MappedFile();
+    if (!file->Open(filename) || file->Size() < sizeof(HeightmapFileHeader)) {
+        delete file;
+        return NULL;
+    }
+    const HeightmapFileHeader *header = (const HeightmapFileHeader *)file->Data();
+    size_t texels = (size_t)header->width*header->height;
+    size_t bytes = header->format == HEIGHTMAP_F32 ? sizeof(float) : sizeof(unsigned short);
+    if (memcmp(header->magic, "HMB1", 4) != 0 || header->format > HEIGHTMAP_U16 || texels == 0 ||
+        file->Size() != sizeof(HeightmapFileHeader) + texels*bytes) {
+        delete file;
+        return NULL;
+    }
+
+    Heightmap *map = new Heightmap();
+    map->width = header->width;
+    map->height = header->height;
+    map->minZ = header->minZ;
+    map->maxZ = header->maxZ;
+    map->normal_map = NULL;
+    if (header->format == HEIGHTMAP_F32) {
+        map->map = (float *)(header + 1);
+        map->mapping = file;
+        return map;
+    }
+
+    map->map = new float[texels];
+    const unsigned short *q = (const unsigned short *)(header + 1);
+    float scale = (header->maxZ - header->minZ) / 65535.0f;
+    size_t i;
+    for (i=0; i<texels; ++i) {
+        map->map[i] = header->minZ + q[i] * scale;
+    }
+    delete file;
+    return map;
+}
+
+bool Heightmap_convert(const char *text, const char *binary, HeightmapFormat format)
+{
+    Heightmap *map = Heightmap_read(text);
+    if (!map) {
+        return false;
+    }
+    bool ok = Heightmap_write(map, binary, format);
+    maps_delete(map);
+    return ok;
+}
+
 void maps_delete(Heightmap *map)
 {
-    if (map->map) {
+    if (map->map && !map->external && !map->mapping) {
         delete[] map->map;
     }
-    if (map->normal_map) {
+    delete map->mapping;
+    if (map->normal_map && !map->external) {
         delete[] map->normal_map;
     }
+    Heightmap_free_pyramid(map);
     delete map;
 }
 
@@ -106,100 +214,177 @@ void Heightmap_normalize(Heightmap *map)
     map->minZ /= map->maxZ;
 }
 
-void Heightmap_calculate_normals(Heightmap *map)
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define HEIGHTMAP_SIMD
+#include <emmintrin.h>
+#endif
+
+// rows handed to a worker at a time
+#define HEIGHTMAP_NORMAL_ROWS 32
+
+// trial & error value, flattens the slopes
+#define HEIGHTMAP_NORMAL_STRENGTH 32.0f
+
+// Sobel normals of row y into nx, ny, nz (width floats each). Border texels
+// point straight up
+//
+// dx: Sobel filter
+// -1  0  1
+// -2  0  2
+// -1  0  1
+//
+// dy: Sobel filter
+// -1 -2 -1
+//  0  0  0
+//  1  2  1
+static void Heightmap_normal_row(const Heightmap *map, size_t y, float *nx, float *ny, float *nz)
+{
+    size_t w = map->width;
+    nx[0] = ny[0] = nx[w-1] = ny[w-1] = 0;
+    nz[0] = nz[w-1] = 1.0f;
+    if (y == 0 || y == map->height-1) {
+        for (size_t x=0; x<w; ++x) {
+            nx[x] = ny[x] = 0;
+            nz[x] = 1.0f;
+        }
+        return;
+    }
+
+    const float *t = map->map + (y-1)*w;
+    const float *m = t + w;
+    const float *b = m + w;
+    const float bias = 1.0f/(HEIGHTMAP_NORMAL_STRENGTH*HEIGHTMAP_NORMAL_STRENGTH);
+    size_t x = 1;
+#ifdef HEIGHTMAP_SIMD
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 vbias = _mm_set1_ps(bias);
+    const __m128 strength = _mm_set1_ps(HEIGHTMAP_NORMAL_STRENGTH);
+    for (; x + 4 < w; x += 4) {
+        __m128 tl = _mm_loadu_ps(t + x-1), tc = _mm_loadu_ps(t + x), tr = _mm_loadu_ps(t + x+1);
+        __m128 ml = _mm_loadu_ps(m + x-1), mr = _mm_loadu_ps(m + x+1);
+        __m128 bl = _mm_loadu_ps(b + x-1), bc = _mm_loadu_ps(b + x), br = _mm_loadu_ps(b + x+1);
+        __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(tr, _mm_mul_ps(two, mr)), br),
+            _mm_add_ps(_mm_add_ps(tl, _mm_mul_ps(two, ml)), bl));
+        __m128 dy = _mm_sub_ps(_mm_add_ps(_mm_add_ps(bl, _mm_mul_ps(two, bc)), br),
+            _mm_add_ps(_mm_add_ps(tl, _mm_mul_ps(two, tc)), tr));
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), vbias));
+        _mm_storeu_ps(nx + x, _mm_div_ps(dx, length));
+        _mm_storeu_ps(ny + x, _mm_div_ps(dy, length));
+        _mm_storeu_ps(nz + x, _mm_div_ps(one, _mm_mul_ps(strength, length)));
+    }
+#endif
+    for (; x < w-1; ++x) {
+        // summed in the order of the lanes above, the tail gives the same bits
+        float dx = (t[x+1] + 2 * m[x+1] + b[x+1]) - (t[x-1] + 2 * m[x-1] + b[x-1]);
+        float dy = (b[x-1] + 2 * b[x] + b[x+1]) - (t[x-1] + 2 * t[x] + t[x+1]);
+        float length = sqrtf(dx*dx + dy*dy + bias);
+        nx[x] = dx / length;
+        ny[x] = dy / length;
+        nz[x] = 1.0f / (HEIGHTMAP_NORMAL_STRENGTH*length);
+    }
+}
+
+static inline unsigned int Heightmap_snorm16(float v)
+{
+    v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+    return (unsigned short)(short)(v * 32767.0f + (v < 0 ? -0.5f : 0.5f));
+}
+
+static inline unsigned int Heightmap_unorm10(float v)
+{
+    v = v*0.5f + 0.5f;
+    v = v < 0 ? 0 : (v > 1.0f ? 1.0f : v);
+    return (unsigned int)(v * 1023.0f + 0.5f);
+}
+
+static inline unsigned int Heightmap_pack_normal(float nx, float ny, float nz, HeightmapNormalFormat format)
 {
-    int x, y;
+    if (format == HEIGHTMAP_NORMALS_RGB10A2) {
+        return Heightmap_unorm10(nx) | Heightmap_unorm10(ny) << 10 | Heightmap_unorm10(nz) << 20 | 3u << 30;
+    }
+    // octahedron, the lower half folded over the diagonals
+    float l1 = fabsf(nx) + fabsf(ny) + fabsf(nz);
+    float u = nx / l1, v = ny / l1;
+    if (nz < 0) {
+        float fu = (1.0f - fabsf(v)) * (u < 0 ? -1.0f : 1.0f);
+        float fv = (1.0f - fabsf(u)) * (v < 0 ? -1.0f : 1.0f);
+        u = fu;
+        v = fv;
+    }
+    return Heightmap_snorm16(u) | Heightmap_snorm16(v) << 16;
+}
+
+// runs row(y, nx, ny, nz) over the normals of every row, blocks of rows on the workers
+template<typename Row>
+static void Heightmap_normal_rows(const Heightmap *map, unsigned threads, const Row &row)
+{
+    size_t blocks = (map->height + HEIGHTMAP_NORMAL_ROWS-1) / HEIGHTMAP_NORMAL_ROWS;
+    parallel_for(0, blocks, [&](size_t block) {
+        std::vector<float> normals(3*map->width);
+        float *nx = &normals[0], *ny = nx + map->width, *nz = ny + map->width;
+        size_t end = MIN((block+1)*HEIGHTMAP_NORMAL_ROWS, map->height);
+        for (size_t y=block*HEIGHTMAP_NORMAL_ROWS; y<end; ++y) {
+            Heightmap_normal_row(map, y, nx, ny, nz);
+            row(y, nx, ny, nz);
+        }
+    }, threads);
+}
 
+void Heightmap_calculate_normals(Heightmap *map, unsigned threads)
+{
     map->normal_map = new float[3*map->width*map->height];
-    memset(map->normal_map, 0, 3*map->width*map->height*sizeof(float));
-
-      for (y=0; y<map->height; ++y) {
-          for (x=0; x<map->width; ++x) {
-              int k = 3*(map->height*y + x);
-  
-              // corner cases
-              if (x == 0 || x == map->width-1 || y == 0 || y == map->height-1) {
-                  map->normal_map[k+0] = 0;
-                  map->normal_map[k+1] = 0;
-                  map->normal_map[k+2] = 1.0;
-                  continue;
-              }
-  
-              // dx: Sobel filter
-              // -1  0  1
-              // -2  0  2
-              // -1  0  1
-              //
-              // dy: Sobel filter
-              // -1 -2 -1
-              //  0  0  0
-              //  1  2  1
-              float tl = Heightmap_get(map, x-1, y-1);
-              float l = Heightmap_get(map, x-1, y );
-              float bl = Heightmap_get(map, x-1, y+1);
-              float b = Heightmap_get(map, x, y+1);
-              float br = Heightmap_get(map, x+1, y+1);
-              float r = Heightmap_get(map, x+1, y );
-              float tr = Heightmap_get(map, x+1, y-1);
-              float t = Heightmap_get(map, x, y-1);
-  
-              float dx = tr + 2 * r + br - tl - 2 * l - bl;
-              float dy = bl + 2 * b + br - tl - 2 * t - tr;
-  
-              // trial & error value.
-              float str = 32.0;
-  
-              float length = sqrtf(dx*dx + dy*dy + 1.0/str*1.0/str);
-  
-              map->normal_map[k+0] = dx / length;
-              map->normal_map[k+1] = dy / length;
-              map->normal_map[k+2] = 1.0 / (str*length);
-          }
-      }
-
-    //int	offs = 0;                   // offset to normalMap
-    //float scale = 10.0;
-
-    //for ( int i = 0; i < map->height; i++ )
-    //    for ( int j = 0; j < map->width; j++ )
-    //    {
-    //        int k = 3*(map->height*i + j);
-    //        if (i == 0 || i == map->width-1 || j == 0 || j == map->height-1) {
-    //                              map->normal_map[k+0] = 0;
-    //                              map->normal_map[k+1] = 0;
-    //                              map->normal_map[k+2] = 1.0;
-    //                              continue;
-    //                          }
-
-    //        // convert height values to [0,1] range
-    //        float	c  = Heightmap_get(map, i,   j);
-    //        float	cx = Heightmap_get(map, i,   j+1);
-    //        float	cy = Heightmap_get(map, i+1, j);
-
-    //        // find derivatives
-    //        float	dx = (c - cx) * scale;
-    //        float	dy = (c - cy) * scale;
-
-    //        // normalize
-    //        float	len = (float) sqrt ( dx*dx + dy*dy + 1 );
-
-    //        // get normal
-    //        float	nx = dy   / len;
-    //        float	ny = -dx  / len;
-    //        float	nz = 1.0f / len;
-
-    //        // now convert to color and store in map
-    //        map->normal_map[k+0] = nx;
-    //        map->normal_map[k+1] = ny;
-    //        map->normal_map[k+2] = nz;
-    //    }
+    Heightmap_normal_rows(map, threads, [map](size_t y, const float *nx, const float *ny, const float *nz) {
+        float *out = map->normal_map + 3*map->width*y;
+        for (size_t x=0; x<map->width; ++x) {
+            out[3*x+0] = nx[x];
+            out[3*x+1] = ny[x];
+            out[3*x+2] = nz[x];
+        }
+    });
+}
+
+void Heightmap_pack_normals(const Heightmap *map, HeightmapNormalFormat format, unsigned int *out, unsigned threads)
+{
+    Heightmap_normal_rows(map, threads, [map, format, out](size_t y, const float *nx, const float *ny, const float *nz) {
+        unsigned int *row = out + map->width*y;
+        for (size_t x=0; x<map->width; ++x) {
+            row[x] = Heightmap_pack_normal(nx[x], ny[x], nz[x], format);
+        }
+    });
+}
+
+void Heightmap_unpack_normal(unsigned int packed, HeightmapNormalFormat format, float *nx, float *ny, float *nz)
+{
+    if (format == HEIGHTMAP_NORMALS_RGB10A2) {
+        *nx = (packed & 1023) / 1023.0f * 2.0f - 1.0f;
+        *ny = (packed >> 10 & 1023) / 1023.0f * 2.0f - 1.0f;
+        *nz = (packed >> 20 & 1023) / 1023.0f * 2.0f - 1.0f;
+    } else {
+        float u = MAX((short)(packed & 0xffff) / 32767.0f, -1.0f);
+        float v = MAX((short)(packed >> 16) / 32767.0f, -1.0f);
+        float z = 1.0f - fabsf(u) - fabsf(v);
+        if (z < 0) {
+            float fu = (1.0f - fabsf(v)) * (u < 0 ? -1.0f : 1.0f);
+            float fv = (1.0f - fabsf(u)) * (v < 0 ? -1.0f : 1.0f);
+            u = fu;
+            v = fv;
+        }
+        *nx = u;
+        *ny = v;
+        *nz = z;
+    }
+    float length = sqrtf(*nx * *nx + *ny * *ny + *nz * *nz);
+    *nx /= length;
+    *ny /= length;
+    *nz /= length;
 }
 
 void Heightmap_get_normal(Heightmap *map, int x, int y, float *nx, float *ny, float *nz)
 {
-    assert(x >= 0 && x < map->width);
-    assert(y >= 0 && x < map->height);
-    int k = 3*(map->height*y + x);
+    assert(x >= 0 && (size_t)x < map->width);
+    assert(y >= 0 && (size_t)y < map->height);
+    int k = 3*(map->width*y + x);
     *nx = map->normal_map[k+0];
     *ny = map->normal_map[k+1];
     *nz = map->normal_map[k+2];
@@ -207,7 +392,507 @@ void Heightmap_get_normal(Heightmap *map, int x, int y, float *nx, float *ny, fl
 
 float Heightmap_get(Heightmap *map, int x, int y)
 {
-    assert((map->height*y + x) < (map->height*map->width));
-    assert((map->height*y + x) >= 0);
-    return (map->map[map->height*y + x]);
-}
\ No newline at end of file
+    assert(x >= 0 && (size_t)x < map->width);
+    assert(y >= 0 && (size_t)y < map->height);
+    return (map->map[map->width*y + x]);
+}
+struct HeightmapPackHeader
+{
+    unsigned int width, height;
+    float low, high;    // quantization range
+    float minZ, maxZ;
+};
+
+// left + up - up_left, the plane through the three neighbours
+static inline int Heightmap_predict(const unsigned short *q, size_t width, size_t x, size_t y)
+{
+    if (y == 0) {
+        return x == 0 ? 0 : q[x-1];
+    }
+    if (x == 0) {
+        return q[(y-1)*width];
+    }
+    int p = q[y*width + x-1] + q[(y-1)*width + x] - q[(y-1)*width + x-1];
+    return p < 0 ? 0 : (p > 65535 ? 65535 : p);
+}
+
+size_t Heightmap_compress_bound(const Heightmap *map)
+{
+    // a residual is within +-65535, 17 bits after zigzag, 3 varint bytes
+    return sizeof(HeightmapPackHeader) + map->width*map->height*3;
+}
+
+size_t Heightmap_compress(const Heightmap *map, unsigned char *out)
+{
+    size_t texels = map->width*map->height;
+    HeightmapPackHeader header;
+    header.width = (unsigned int)map->width;
+    header.height = (unsigned int)map->height;
+    header.low = FLT_MAX;
+    header.high = -FLT_MAX;
+    header.minZ = map->minZ;
+    header.maxZ = map->maxZ;
+    size_t i;
+    for (i=0; i<texels; ++i) {
+        header.low = MIN(header.low, map->map[i]);
+        header.high = MAX(header.high, map->map[i]);
+    }
+    float range = header.high > header.low ? header.high - header.low : 1.0f;
+
+    unsigned short *q = new unsigned short[texels];
+    for (i=0; i<texels; ++i) {
+        q[i] = (unsigned short)((map->map[i] - header.low) / range * 65535.0f + 0.5f);
+    }
+
+    memcpy(out, &header, sizeof(header));
+    unsigned char *ptr = out + sizeof(header);
+    size_t x, y;
+    for (y=0; y<map->height; ++y) {
+        for (x=0; x<map->width; ++x) {
+            int r = q[y*map->width + x] - Heightmap_predict(q, map->width, x, y);
+            unsigned int zigzag = ((unsigned int)r << 1) ^ (unsigned int)(r >> 31);
+            while (zigzag >= 0x80) {
+                *ptr++ = (unsigned char)(zigzag | 0x80);
+                zigzag >>= 7;
+            }
+            *ptr++ = (unsigned char)zigzag;
+        }
+    }
+    delete[] q;
+    return ptr - out;
+}
+
+Heightmap *Heightmap_decompress(const unsigned char *data, size_t size, unsigned threads)
+{
+    HeightmapPackHeader header;
+    if (size < sizeof(header)) {
+        return NULL;
+    }
+    memcpy(&header, data, sizeof(header));
+    size_t texels = (size_t)header.width*header.height;
+    if (texels == 0 || size < sizeof(header) + texels) {
+        return NULL;
+    }
+    float range = header.high > header.low ? header.high - header.low : 1.0f;
+
+    unsigned short *q = new unsigned short[texels];
+    const unsigned char *ptr = data + sizeof(header);
+    const unsigned char *end = data + size;
+    size_t x, y;
+    for (y=0; y<header.height; ++y) {
+        for (x=0; x<header.width; ++x) {
+            unsigned int zigzag = 0;
+            int shift = 0;
+            do {
+                if (ptr == end || shift > 14) {
+                    delete[] q;
+                    return NULL;
+                }
+                zigzag |= (unsigned int)(*ptr & 0x7f) << shift;
+                shift += 7;
+            } while (*ptr++ & 0x80);
+            int r = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+            q[y*header.width + x] = (unsigned short)(Heightmap_predict(q, header.width, x, y) + r);
+        }
+    }
+
+    Heightmap *map = new Heightmap();
+    map->width = header.width;
+    map->height = header.height;
+    map->minZ = header.minZ;
+    map->maxZ = header.maxZ;
+    map->map = new float[texels];
+    size_t i;
+    for (i=0; i<texels; ++i) {
+        map->map[i] = header.low + q[i] / 65535.0f * range;
+    }
+    delete[] q;
+
+    Heightmap_calculate_normals(map, threads);
+    return map;
+}
+
+struct HeightmapLevel
+{
+    size_t width, height;
+    std::vector<float> min, max, avg;
+};
+
+struct HeightmapPyramid
+{
+    std::vector<HeightmapLevel> levels;
+};
+
+void Heightmap_build_pyramid(Heightmap *map, unsigned threads)
+{
+    Heightmap_free_pyramid(map);
+    if (map->width < 2 || map->height < 2) {
+        return;
+    }
+    HeightmapPyramid *pyramid = new HeightmapPyramid();
+
+    HeightmapLevel base;
+    base.width = map->width-1;
+    base.height = map->height-1;
+    base.min.resize(base.width*base.height);
+    base.max.resize(base.width*base.height);
+    base.avg.resize(base.width*base.height);
+    parallel_for(0, base.height, [&](size_t y) {
+        for (size_t x=0; x<base.width; ++x) {
+            float a = Heightmap_get(map, (int)x, (int)y), b = Heightmap_get(map, (int)x+1, (int)y);
+            float c = Heightmap_get(map, (int)x, (int)y+1), d = Heightmap_get(map, (int)x+1, (int)y+1);
+            size_t i = y*base.width + x;
+            base.min[i] = MIN(MIN(a, b), MIN(c, d));
+            base.max[i] = MAX(MAX(a, b), MAX(c, d));
+            base.avg[i] = (a + b + c + d) * 0.25f;
+        }
+    }, threads);
+    pyramid->levels.push_back(base);
+
+    while (pyramid->levels.back().width > 1 || pyramid->levels.back().height > 1) {
+        const HeightmapLevel &fine = pyramid->levels.back();
+        HeightmapLevel coarse;
+        coarse.width = (fine.width+1)/2;
+        coarse.height = (fine.height+1)/2;
+        coarse.min.resize(coarse.width*coarse.height);
+        coarse.max.resize(coarse.width*coarse.height);
+        coarse.avg.resize(coarse.width*coarse.height);
+        parallel_for(0, coarse.height, [&](size_t y) {
+            for (size_t x=0; x<coarse.width; ++x) {
+                size_t i = y*coarse.width + x;
+                coarse.min[i] = FLT_MAX;
+                coarse.max[i] = -FLT_MAX;
+                float sum = 0;
+                int count = 0;
+                // the last column or row of an odd level has one child
+                for (size_t cy=2*y; cy<MIN(2*y+2, fine.height); ++cy) {
+                    for (size_t cx=2*x; cx<MIN(2*x+2, fine.width); ++cx) {
+                        size_t c = cy*fine.width + cx;
+                        coarse.min[i] = MIN(coarse.min[i], fine.min[c]);
+                        coarse.max[i] = MAX(coarse.max[i], fine.max[c]);
+                        sum += fine.avg[c];
+                        count++;
+                    }
+                }
+                coarse.avg[i] = sum / count;
+            }
+        }, threads);
+        pyramid->levels.push_back(coarse);
+    }
+    map->pyramid = pyramid;
+}
+
+void Heightmap_free_pyramid(Heightmap *map)
+{
+    delete map->pyramid;
+    map->pyramid = NULL;
+}
+
+int Heightmap_levels(const Heightmap *map)
+{
+    return map->pyramid ? (int)map->pyramid->levels.size() : 0;
+}
+
+void Heightmap_level_size(const Heightmap *map, int level, size_t *width, size_t *height)
+{
+    assert(level >= 0 && level < Heightmap_levels(map));
+    *width = map->pyramid->levels[level].width;
+    *height = map->pyramid->levels[level].height;
+}
+
+float Heightmap_get_level(const Heightmap *map, int level, size_t x, size_t y)
+{
+    assert(level >= 0 && level < Heightmap_levels(map));
+    const HeightmapLevel &l = map->pyramid->levels[level];
+    assert(x < l.width && y < l.height);
+    return l.avg[y*l.width + x];
+}
+
+void Heightmap_get_level_range(const Heightmap *map, int level, size_t x, size_t y, float *minZ, float *maxZ)
+{
+    assert(level >= 0 && level < Heightmap_levels(map));
+    const HeightmapLevel &l = map->pyramid->levels[level];
+    assert(x < l.width && y < l.height);
+    *minZ = l.min[y*l.width + x];
+    *maxZ = l.max[y*l.width + x];
+}
+
+// texels of cell (x, y) of a level, inclusive
+static inline void Heightmap_cell_bounds(const Heightmap *map, int level, size_t x, size_t y,
+    size_t *x0, size_t *y0, size_t *x1, size_t *y1)
+{
+    *x0 = x << level;
+    *y0 = y << level;
+    *x1 = MIN((x+1) << level, map->width-1);
+    *y1 = MIN((y+1) << level, map->height-1);
+}
+
+static void Heightmap_range_cell(const Heightmap *map, int level, size_t x, size_t y,
+    size_t x0, size_t y0, size_t x1, size_t y1, float *minZ, float *maxZ)
+{
+    size_t cx0, cy0, cx1, cy1;
+    Heightmap_cell_bounds(map, level, x, y, &cx0, &cy0, &cx1, &cy1);
+    if (cx0 > x1 || cx1 < x0 || cy0 > y1 || cy1 < y0) {
+        return;
+    }
+    const HeightmapLevel &l = map->pyramid->levels[level];
+    size_t i = y*l.width + x;
+    // nothing in the cell can change the result
+    if (l.min[i] >= *minZ && l.max[i] <= *maxZ) {
+        return;
+    }
+    if (cx0 >= x0 && cx1 <= x1 && cy0 >= y0 && cy1 <= y1) {
+        *minZ = MIN(*minZ, l.min[i]);
+        *maxZ = MAX(*maxZ, l.max[i]);
+        return;
+    }
+    if (level == 0) {
+        size_t tx, ty;
+        for (ty=MAX(cy0, y0); ty<=MIN(cy1, y1); ++ty) {
+            for (tx=MAX(cx0, x0); tx<=MIN(cx1, x1); ++tx) {
+                float z = Heightmap_get((Heightmap *)map, (int)tx, (int)ty);
+                *minZ = MIN(*minZ, z);
+                *maxZ = MAX(*maxZ, z);
+            }
+        }
+        return;
+    }
+    const HeightmapLevel &fine = map->pyramid->levels[level-1];
+    size_t cx, cy;
+    for (cy=2*y; cy<MIN(2*y+2, fine.height); ++cy) {
+        for (cx=2*x; cx<MIN(2*x+2, fine.width); ++cx) {
+            Heightmap_range_cell(map, level-1, cx, cy, x0, y0, x1, y1, minZ, maxZ);
+        }
+    }
+}
+
+void Heightmap_range(const Heightmap *map, int x0, int y0, int x1, int y1, float *minZ, float *maxZ)
+{
+    *minZ = FLT_MAX;
+    *maxZ = -FLT_MAX;
+    x0 = MAX(x0, 0);
+    y0 = MAX(y0, 0);
+    x1 = MIN(x1, (int)map->width-1);
+    y1 = MIN(y1, (int)map->height-1);
+    if (x0 > x1 || y0 > y1) {
+        return;
+    }
+    if (!map->pyramid) {
+        int x, y;
+        for (y=y0; y<=y1; ++y) {
+            for (x=x0; x<=x1; ++x) {
+                float z = Heightmap_get((Heightmap *)map, x, y);
+                *minZ = MIN(*minZ, z);
+                *maxZ = MAX(*maxZ, z);
+            }
+        }
+        return;
+    }
+    int top = Heightmap_levels(map)-1;
+    Heightmap_range_cell(map, top, 0, 0, x0, y0, x1, y1, minZ, maxZ);
+}
+
+bool Heightmap_range_bound(const Heightmap *map, int x0, int y0, int x1, int y1, float *minZ, float *maxZ)
+{
+    if (!map->pyramid) {
+        return false;
+    }
+    x0 = MIN(MAX(x0, 0), (int)map->width-1);
+    y0 = MIN(MAX(y0, 0), (int)map->height-1);
+    x1 = MIN(MAX(x1, x0), (int)map->width-1);
+    y1 = MIN(MAX(y1, y0), (int)map->height-1);
+    int level = 0, top = Heightmap_levels(map)-1;
+    while (level < top && (x1 - x0 > 1<<level || y1 - y0 > 1<<level)) {
+        level++;
+    }
+    const HeightmapLevel &l = map->pyramid->levels[level];
+    // a texel on a cell border is in both cells, the right one covers it
+    size_t cx0 = MIN((size_t)x0 >> level, l.width-1), cy0 = MIN((size_t)y0 >> level, l.height-1);
+    size_t cx1 = MIN((size_t)MAX(x1-1, x0) >> level, l.width-1), cy1 = MIN((size_t)MAX(y1-1, y0) >> level, l.height-1);
+    *minZ = FLT_MAX;
+    *maxZ = -FLT_MAX;
+    size_t cx, cy;
+    for (cy=cy0; cy<=cy1; ++cy) {
+        for (cx=cx0; cx<=cx1; ++cx) {
+            *minZ = MIN(*minZ, l.min[cy*l.width + cx]);
+            *maxZ = MAX(*maxZ, l.max[cy*l.width + cx]);
+        }
+    }
+    return true;
+}
+
+// entry and exit of the ray through a box, false if it misses within [0, limit]
+static inline bool Heightmap_slab(const float origin[3], const float inverse[3], const float low[3], const float high[3],
+    float limit, float *entry)
+{
+    float t0 = 0, t1 = limit;
+    for (int a=0; a<3; ++a) {
+        float n = (low[a] - origin[a]) * inverse[a];
+        float f = (high[a] - origin[a]) * inverse[a];
+        if (n > f) {
+            float swap = n;
+            n = f;
+            f = swap;
+        }
+        // NaN from a parallel ray on a face keeps the bounds as they are
+        t0 = n > t0 ? n : t0;
+        t1 = f < t1 ? f : t1;
+        if (t0 > t1) {
+            return false;
+        }
+    }
+    *entry = t0;
+    return true;
+}
+
+// Moller-Trumbore, t of the hit or -1, (u, v) the hit between a, b and c
+static inline float Heightmap_triangle(const float origin[3], const float dir[3], const float a[3], const float b[3], const float c[3],
+    float *u, float *v)
+{
+    float e1[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+    float e2[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+    float p[3] = { dir[1]*e2[2] - dir[2]*e2[1], dir[2]*e2[0] - dir[0]*e2[2], dir[0]*e2[1] - dir[1]*e2[0] };
+    float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+    if (fabsf(det) < 1e-20f) {
+        return -1;
+    }
+    float inv = 1.0f / det;
+    float s[3] = { origin[0]-a[0], origin[1]-a[1], origin[2]-a[2] };
+    *u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * inv;
+    if (*u < 0 || *u > 1) {
+        return -1;
+    }
+    float q[3] = { s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0] };
+    *v = (dir[0]*q[0] + dir[1]*q[1] + dir[2]*q[2]) * inv;
+    if (*v < 0 || *u + *v > 1) {
+        return -1;
+    }
+    return (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * inv;
+}
+
+// texel (x, y) of height z where surface puts it
+static inline void Heightmap_place(const Heightmap *map, const HeightmapSurface *surface, size_t x, size_t y, float z,
+    float out[3])
+{
+    if (surface) {
+        surface->position(map, x, y, z, surface->user, out);
+    } else {
+        out[0] = (float)x;
+        out[1] = (float)y;
+        out[2] = z;
+    }
+}
+
+// box around cell (x, y) of a level
+static inline void Heightmap_cell_box(const Heightmap *map, const HeightmapSurface *surface, int level, size_t x, size_t y,
+    float low[3], float high[3])
+{
+    const HeightmapLevel &l = map->pyramid->levels[level];
+    size_t x0, y0, x1, y1;
+    Heightmap_cell_bounds(map, level, x, y, &x0, &y0, &x1, &y1);
+    size_t i = y*l.width + x;
+    if (surface) {
+        surface->bounds(map, x0, y0, x1, y1, l.min[i], l.max[i], surface->user, low, high);
+        return;
+    }
+    low[0] = (float)x0;
+    low[1] = (float)y0;
+    low[2] = l.min[i];
+    high[0] = (float)x1;
+    high[1] = (float)y1;
+    high[2] = l.max[i];
+}
+
+bool Heightmap_intersect(const Heightmap *map, const float origin[3], const float dir[3], float *t)
+{
+    return Heightmap_intersect_surface(map, NULL, origin, dir, t, NULL);
+}
+
+bool Heightmap_intersect_surface(const Heightmap *map, const HeightmapSurface *surface,
+    const float origin[3], const float dir[3], float *t, float texel[2])
+{
+    if (!map->pyramid) {
+        return false;
+    }
+    float inverse[3] = { 1.0f/dir[0], 1.0f/dir[1], 1.0f/dir[2] };
+    float best = FLT_MAX;
+    float hit[2] = { 0, 0 };
+
+    struct Cell {
+        int level;
+        size_t x, y;
+        float entry;
+    };
+    std::vector<Cell> stack;
+    Cell top = { Heightmap_levels(map)-1, 0, 0, 0 };
+    float low[3], high[3];
+    Heightmap_cell_box(map, surface, top.level, 0, 0, low, high);
+    if (Heightmap_slab(origin, inverse, low, high, best, &top.entry)) {
+        stack.push_back(top);
+    }
+    while (!stack.empty()) {
+        Cell cell = stack.back();
+        stack.pop_back();
+        if (cell.entry >= best) {
+            continue;
+        }
+
+        if (cell.level == 0) {
+            Heightmap *m = (Heightmap *)map;
+            size_t x0, y0, x1, y1;
+            Heightmap_cell_bounds(map, 0, cell.x, cell.y, &x0, &y0, &x1, &y1);
+            float a[3], b[3], c[3], d[3];
+            Heightmap_place(map, surface, x0, y0, Heightmap_get(m, (int)x0, (int)y0), a);
+            Heightmap_place(map, surface, x1, y0, Heightmap_get(m, (int)x1, (int)y0), b);
+            Heightmap_place(map, surface, x1, y1, Heightmap_get(m, (int)x1, (int)y1), c);
+            Heightmap_place(map, surface, x0, y1, Heightmap_get(m, (int)x0, (int)y1), d);
+            float u, v;
+            float at = Heightmap_triangle(origin, dir, a, b, c, &u, &v);
+            if (at >= 0 && at < best) {
+                best = at;
+                hit[0] = x0 + u + v;
+                hit[1] = y0 + v;
+            }
+            at = Heightmap_triangle(origin, dir, a, c, d, &u, &v);
+            if (at >= 0 && at < best) {
+                best = at;
+                hit[0] = x0 + u;
+                hit[1] = y0 + u + v;
+            }
+            continue;
+        }
+
+        // children nearest last, they come off the stack first
+        const HeightmapLevel &fine = map->pyramid->levels[cell.level-1];
+        Cell children[4];
+        int count = 0;
+        size_t cx, cy;
+        for (cy=2*cell.y; cy<MIN(2*cell.y+2, fine.height); ++cy) {
+            for (cx=2*cell.x; cx<MIN(2*cell.x+2, fine.width); ++cx) {
+                Heightmap_cell_box(map, surface, cell.level-1, cx, cy, low, high);
+                Cell child = { cell.level-1, cx, cy, 0 };
+                if (Heightmap_slab(origin, inverse, low, high, best, &child.entry)) {
+                    int k = count++;
+                    while (k > 0 && children[k-1].entry < child.entry) {
+                        children[k] = children[k-1];
+                        k--;
+                    }
+                    children[k] = child;
+                }
+            }
+        }
+        for (int k=0; k<count; ++k) {
+            stack.push_back(children[k]);
+        }
+    }
+
+    if (best == FLT_MAX) {
+        return false;
+    }
+    *t = best;
+    if (texel) {
+        texel[0] = hit[0];
+        texel[1] = hit[1];
+    }
+    return true;
+}
@@ -3,6 +3,9 @@
 
 #include <stddef.h>
 
+class MappedFile;
+struct HeightmapPyramid;
+
 struct Heightmap
 {
     float *map;
@@ -13,20 +16,130 @@ struct Heightmap
 
     float minZ, maxZ;
 
+    /* map and normal_map belong to someone else (e.g. a mapped cache file),
+       maps_delete leaves them alone */
+    bool external;
+
+    /* set by Heightmap_load: map points into this read-only mapping, which
+       maps_delete closes */
+    MappedFile *mapping;
+
+    /* Heightmap_build_pyramid, NULL until then */
+    HeightmapPyramid *pyramid;
+
 };
 
 void Heightmap_print(Heightmap *map);
 
 Heightmap *Heightmap_read(const char *filename);
 
+/* binary heightmaps: a 32 byte header (magic "HMB1", format, width, height,
+   minZ, maxZ) and the heights row by row, in the writer's byte order */
+enum HeightmapFormat
+{
+    HEIGHTMAP_F32,
+    HEIGHTMAP_U16   // quantized between minZ and maxZ
+};
+
+/* false if the file cannot be written */
+bool Heightmap_write(const Heightmap *map, const char *filename, HeightmapFormat format);
+
+/* maps the file read-only. F32 heights are used in place, map points into
+   the mapping and must not be written; U16 heights are expanded to floats.
+   Normals are not calculated. NULL if the file is missing or not a binary map */
+Heightmap *Heightmap_load(const char *filename);
+
+/* text map (Heightmap_read) to a binary one */
+bool Heightmap_convert(const char *text, const char *binary, HeightmapFormat format);
+
 void maps_delete(Heightmap *map);
 
 void Heightmap_normalize(Heightmap *map);
 
-void Heightmap_calculate_normals(Heightmap *map);
+/* Sobel normals, 3 floats per texel. Blocks of rows go to threads workers
+   (0 - every core) */
+void Heightmap_calculate_normals(Heightmap *map, unsigned threads = 0);
+
+/* one 32 bit word per texel, uploads as a texture as it is:
+   OCT16 - octahedral x, y as two snorm16 (GL_RG16_SNORM, GL_RG, GL_SHORT),
+   RGB10A2 - x, y, z * 0.5 + 0.5 as unorm10 (GL_RGB10_A2, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV) */
+enum HeightmapNormalFormat
+{
+    HEIGHTMAP_NORMALS_OCT16,
+    HEIGHTMAP_NORMALS_RGB10A2
+};
+
+/* the normals of Heightmap_calculate_normals packed into out (width*height
+   words), normal_map is neither needed nor touched */
+void Heightmap_pack_normals(const Heightmap *map, HeightmapNormalFormat format, unsigned int *out, unsigned threads = 0);
+
+void Heightmap_unpack_normal(unsigned int packed, HeightmapNormalFormat format, float *nx, float *ny, float *nz);
 
 void Heightmap_get_normal(Heightmap *map, int x, int y, float *nx, float *ny, float *nz);
 
 float Heightmap_get(Heightmap *map, int x, int y);
 
+/* lossy packing for maps kept in memory: heights quantized to 16 bits, predicted
+   from the left, upper and upper-left neighbours, residuals zigzag varint coded.
+   Normals are not stored, Heightmap_decompress recalculates them with threads
+   (0 uses every core, see Heightmap_calculate_normals) */
+size_t Heightmap_compress_bound(const Heightmap *map);
+
+/* returns the number of bytes written to out (Heightmap_compress_bound bytes) */
+size_t Heightmap_compress(const Heightmap *map, unsigned char *out);
+
+/* NULL if data is not a compressed map */
+Heightmap *Heightmap_decompress(const unsigned char *data, size_t size, unsigned threads = 0);
+
+/* min/max/average pyramid for coarse queries. Level 0 has a cell per quad
+   between four texels, cell (x, y) of level k covers the texels from
+   (x*2^k, y*2^k) to ((x+1)*2^k, (y+1)*2^k), borders included, clamped to the
+   map. The top level is a single cell. Rebuild after changing the heights */
+void Heightmap_build_pyramid(Heightmap *map, unsigned threads = 0);
+
+void Heightmap_free_pyramid(Heightmap *map);
+
+/* 0 without a pyramid */
+int Heightmap_levels(const Heightmap *map);
+
+void Heightmap_level_size(const Heightmap *map, int level, size_t *width, size_t *height);
+
+/* average height of a cell of a level */
+float Heightmap_get_level(const Heightmap *map, int level, size_t x, size_t y);
+
+/* lowest and highest height of a cell of a level */
+void Heightmap_get_level_range(const Heightmap *map, int level, size_t x, size_t y, float *minZ, float *maxZ);
+
+/* lowest and highest texel in [x0, x1] x [y0, y1] (inclusive, clamped to the
+   map). Whole cells of the pyramid stand in for their texels, without one
+   every texel is read */
+void Heightmap_range(const Heightmap *map, int x0, int y0, int x1, int y1, float *minZ, float *maxZ);
+
+/* a range around Heightmap_range's in constant time: the 2x2 cells of the
+   finest level whose cells are as large as the rectangle. false without a pyramid */
+bool Heightmap_range_bound(const Heightmap *map, int x0, int y0, int x1, int y1, float *minZ, float *maxZ);
+
+/* first hit of origin + t*dir (t >= 0) with the surface, x and y in texels,
+   z in heights. A quad is the triangles (x, y) (x+1, y) (x+1, y+1) and
+   (x, y) (x+1, y+1) (x, y+1). Descends the pyramid nearest cells first,
+   skipping cells whose min/max box the ray misses. false on a miss or
+   without a pyramid */
+bool Heightmap_intersect(const Heightmap *map, const float origin[3], const float dir[3], float *t);
+
+/* where a heightmap lies in space: position places texel (x, y) of height z,
+   bounds gives a box around the surface over texels [x0, x1] x [y0, y1] with
+   heights in [minZ, maxZ] */
+struct HeightmapSurface
+{
+    void (*position)(const Heightmap *map, size_t x, size_t y, float z, void *user, float out[3]);
+    void (*bounds)(const Heightmap *map, size_t x0, size_t y0, size_t x1, size_t y1, float minZ, float maxZ,
+        void *user, float low[3], float high[3]);
+    void *user;
+};
+
+/* Heightmap_intersect with the quads placed by surface (NULL - x, y, z as
+   above). texel (may be NULL) is the hit on the heightmap */
+bool Heightmap_intersect_surface(const Heightmap *map, const HeightmapSurface *surface,
+    const float origin[3], const float dir[3], float *t, float texel[2]);
+
 #endif // HEIGHTMAP_H
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+#ifndef MappedFile_h__
+#define MappedFile_h__
+
+#include <stddef.h>
+#include <string>
+
+//************************************
+// Read-only memory mapping of a whole file. Pages are faulted in on first
+// access, so opening a large file costs next to nothing until it is read.
+//************************************
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool Open(const std::string &path);
+    void Close();
+
+    const void *Data() const;
+    size_t Size() const;
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    void *m_data;
+    size_t m_size;
+};
+
+#endif // MappedFile_h__
@@ -3,6 +3,7 @@
 #include "VertexPositionTexture.h"
 #include <glew.h>
 #include <math.h>
+#include <string.h>
 #include "SpriteBatch.h"
 #include "Frustum.h"
 #include "JHelpers_inl.h"
@@ -14,8 +15,17 @@ Mesh::Mesh(void) :
     m_vao(0),
     m_vbo(nullptr),
     minBound(0),
-    maxBound(0)
+    maxBound(0),
+    m_streamFront(-1)
 {
+    for(int i=0; i<2; i++) {
+        m_streamVao[i] = 0;
+        m_streamCount[i] = 0;
+    }
+    for(int i=0; i<4; i++) {
+        m_streamVbo[i] = 0;
+        m_streamCapacity[i] = 0;
+    }
 }
 
 
@@ -30,6 +40,12 @@ Mesh::~Mesh(void)
         m_vbo = nullptr;
         OPENGL_CHECK_ERRORS();
     }
+    if(m_streamFront >= 0) {
+        glBindVertexArray(0);
+        glDeleteBuffers(4, m_streamVbo);
+        glDeleteVertexArrays(2, m_streamVao);
+        OPENGL_CHECK_ERRORS();
+    }
 }
 
 void Mesh::Unindex()
@@ -161,9 +177,22 @@ bool Mesh::loadOBJ(std::string path)
 
 void Mesh::Bind(int type /* = 0 */)
 {
+    if(type == 2) {
+        BindStream();
+        return;
+    }
     if(Verteces.size() == 0){
         return;
     }
+    if(m_streamFront >= 0) {
+        glBindVertexArray(0);
+        glDeleteBuffers(4, m_streamVbo);
+        glDeleteVertexArrays(2, m_streamVao);
+        for(int i=0; i<4; i++) {
+            m_streamCapacity[i] = 0;
+        }
+        m_streamFront = -1;
+    }
     auto bindtype = type == 0 ? GL_STATIC_DRAW : GL_STREAM_DRAW;
 
     if(m_vbo) {
@@ -205,6 +234,99 @@ void Mesh::Bind(int type /* = 0 */)
     OPENGL_CHECK_ERRORS();
 }
 
+//************************************
+// Buffers of a set are created once and only grow (by half again) when the
+// mesh outgrows them, every upload replaces their whole content.
+// GL 3.0 / ARB_map_buffer_range: map with invalidate, the driver orphans the
+// old storage if the GPU still reads it. Older contexts: orphan with
+// glBufferData(NULL) and fill with glBufferSubData.
+//************************************
+void Mesh::StreamUpload(GLenum target, GLuint buffer, size_t &capacity, size_t size, const void *data)
+{
+    glBindBuffer(target, buffer);
+    if(size > capacity) {
+        capacity = size + size/2;
+        glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+    }
+    if(GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range) {
+        void *mapped = glMapBufferRange(target, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if(mapped) {
+            memcpy(mapped, data, size);
+            if(glUnmapBuffer(target) == GL_TRUE) {
+                return;
+            }
+        }
+    } else {
+        glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+    }
+    // unmap failure means the store got corrupted, write it again
+    glBufferSubData(target, 0, size, data);
+}
+
+void Mesh::BindStream()
+{
+    if(Verteces.size() == 0){
+        if(m_streamFront >= 0) {
+            m_streamCount[m_streamFront] = 0;
+        }
+        return;
+    }
+    if(m_vbo) {
+        glBindVertexArray(0);
+        glDeleteBuffers(2, m_vbo);
+        glDeleteVertexArrays(1, &m_vao);
+        delete[] m_vbo;
+        m_vbo = nullptr;
+        m_vao = 0;
+    }
+
+    int back;
+    if(m_streamFront < 0) {
+        glGenVertexArrays(2, m_streamVao);
+        glGenBuffers(4, m_streamVbo);
+        for(int i=0; i<2; i++) {
+            glBindVertexArray(m_streamVao[i]);
+            GLuint stride = sizeof(VertexPositionNormalTexture);
+            GLuint offset = 0;
+            glBindBuffer(GL_ARRAY_BUFFER, m_streamVbo[i*2]);
+            glEnableVertexAttribArray(BUFFER_TYPE_VERTEX);
+            glVertexAttribPointer(BUFFER_TYPE_VERTEX, 3, GL_FLOAT, GL_FALSE, stride, (void*)(offset)); offset += sizeof(glm::vec3);
+            glEnableVertexAttribArray(BUFFER_TYPE_TEXTCOORD);
+            glVertexAttribPointer(BUFFER_TYPE_TEXTCOORD, 2, GL_FLOAT, GL_FALSE, stride, (void*)(offset));  offset += sizeof(glm::vec2);
+            glEnableVertexAttribArray(BUFFER_TYPE_NORMALE);
+            glVertexAttribPointer(BUFFER_TYPE_NORMALE, 3, GL_FLOAT, GL_FALSE, stride, (void*)(offset));
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_streamVbo[i*2+1]);
+        }
+        back = 0;
+    } else {
+        back = m_streamFront ^ 1;
+    }
+
+    // element array binding is vao state, keep the vao bound while uploading indices
+    glBindVertexArray(m_streamVao[back]);
+    StreamUpload(GL_ARRAY_BUFFER, m_streamVbo[back*2], m_streamCapacity[back*2],
+        sizeof(VertexPositionNormalTexture)*Verteces.size(), &Verteces[0]);
+    StreamUpload(GL_ELEMENT_ARRAY_BUFFER, m_streamVbo[back*2+1], m_streamCapacity[back*2+1],
+        sizeof(GLuint)*Indeces.size(), &Indeces[0]);
+    glBindVertexArray(0);
+
+    m_streamCount[back] = Indeces.size();
+    m_streamFront = back;
+
+    OPENGL_CHECK_ERRORS();
+}
+
+// vao and index count of the last upload, Indeces may already hold the next frame
+GLuint Mesh::RenderVao(GLsizei &count) const
+{
+    if(m_streamFront >= 0) {
+        count = m_streamCount[m_streamFront];
+        return m_streamVao[m_streamFront];
+    }
+    count = Indeces.size();
+    return m_vao;
+}
+
 void Mesh::Render(const Frustum &frust)
 {
     Render(mat4(1), frust);
@@ -278,8 +400,9 @@ inline void Mesh::Render(mat4 Model, const Frustum &frust)
                 glUniform1i(glGetUniformLocation(shader->program, "NoTangent"), 0);
             }
         }
-        glBindVertexArray(m_vao);
-        glDrawElements(GL_TRIANGLES, Indeces.size(), GL_UNSIGNED_INT, NULL);
+        GLsizei count;
+        glBindVertexArray(RenderVao(count));
+        glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, NULL);
     }
 }
 
@@ -327,13 +450,14 @@ inline void Mesh::Render(mat4 Model, bool patches /* = false*/)
             }
         }
     }
-    glBindVertexArray(m_vao);
+    GLsizei count;
+    glBindVertexArray(RenderVao(count));
     if(!patches) {
-        glDrawElements(GL_TRIANGLES, Indeces.size(), GL_UNSIGNED_INT, NULL);
+        glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, NULL);
     } else
     {
         glPatchParameteri(GL_PATCH_VERTICES, 4);
-        glDrawElements(GL_PATCHES, Indeces.size(), GL_UNSIGNED_INT, NULL);
+        glDrawElements(GL_PATCHES, count, GL_UNSIGNED_INT, NULL);
     }
 }
 
@@ -20,6 +20,8 @@ public:
     Mesh(void);
     ~Mesh(void);
     void Create(std::vector<VertexPositionNormalTexture> verteces, std::vector<GLuint> indeces);
+    // type 0 - static, 1 - stream (buffers recreated every call),
+    // 2 - persistent double-buffered stream for meshes rebuilt every few frames
     void Bind(int type = 0);
     void Render( bool patches = false);
     void Render(mat4 Model, bool patches = false);
@@ -41,8 +43,20 @@ public:
     mat4 World;
     std::string id;
 private:
+    void BindStream();
+    void StreamUpload(GLenum target, GLuint buffer, size_t &capacity, size_t size, const void *data);
+    GLuint RenderVao(GLsizei &count) const;
+
     GLuint m_vao;
     GLuint* m_vbo;
+
+    // Bind(2): two vao/vbo sets, Bind writes the back one and flips,
+    // Render draws the front one the GPU may still be reading
+    GLuint m_streamVao[2];
+    GLuint m_streamVbo[4];
+    size_t m_streamCapacity[4];
+    GLsizei m_streamCount[2];
+    int m_streamFront;
 };
 #endif // Mesh_h__
 
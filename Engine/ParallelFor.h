@@ -0,0 +1,54 @@
+#pragma once
+#ifndef ParallelFor_h__
+#define ParallelFor_h__
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <functional>
+
+//************************************
+// Runs body(i) for every i in [begin, end) on a pool of worker threads and
+// returns when all iterations are done. Items are handed out one at a time,
+// so uneven work (e.g. faces with different leaf counts) balances itself.
+// threads == 0 means "one per hardware core".
+//************************************
+inline void parallel_for(size_t begin, size_t end, const std::function<void(size_t)> &body, unsigned threads = 0)
+{
+    if(end <= begin) {
+        return;
+    }
+    if(threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if(threads > end - begin) {
+        threads = (unsigned)(end - begin);
+    }
+    if(threads <= 1) {
+        for (size_t i = begin; i < end; i++)
+        {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(begin);
+    auto worker = [&]() {
+        for(size_t i = next++; i < end; i = next++) {
+            body(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+    {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        pool[i].join();
+    }
+}
+
+#endif // ParallelFor_h__
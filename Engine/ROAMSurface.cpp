@@ -5,25 +5,71 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include "BasicJargShader.h"
+#include "ParallelFor.h"
 
-ROAMSurface::ROAMSurface(void) :
-    Loaded(false)
+// world transform of the cube face i
+static glm::mat4 faceWorld(int face)
+{
+    glm::mat4 Identity = glm::mat4(1);
+    Identity = scale(Identity, vec3(500,500,500));
+    switch(face) {
+    case 1: return rotate(Identity, (float)M_PI, vec3(1,0,0));
+    case 2: return rotate(Identity, (float)M_PI_2, vec3(1,0,0));
+    case 3: return rotate(Identity, (float)-M_PI_2, vec3(1,0,0));
+    case 4: return rotate(Identity, (float)M_PI_2, vec3(0,1,0));
+    case 5: return rotate(Identity, (float)-M_PI_2, vec3(0,1,0));
+    }
+    return Identity;
+}
+
+ROAMSurface::ROAMSurface(const std::string &cacheDir, int varianceBits, int resolution, unsigned int seed) :
+    Loaded(false),
+    Parallel(true),
+    Indexed(true),
+    Incremental(false),
+    TriangleBudget(0),
+    TimeBudget(0),
+    Async(false),
+    FrustumCulling(false),
+    HorizonCulling(false),
+    LinkFaces(false),
+    PixelError(0),
+    FieldOfView(45),
+    ViewportHeight(600),
+    LeafBudget(0),
+    TargetFrameTime(0),
+    MorphTime(0),
+    m_async(nullptr),
+    m_dirty(false),
+    m_linked(false),
+    m_frameTime(0),
+    m_errorScale(1)
 {
     for (int i=0;i<6;i++)
     {
-        auto a = new ROAMSurfaceCell();
+        // each face samples its own part of the sphere's noise
+        glm::mat4 world = faceWorld(i);
+        TerrainSettings settings;
+        settings.cacheDir = cacheDir;
+        settings.resolution = resolution;
+        settings.seed = seed;
+        settings.face = &world;
+        auto a = new ROAMSurfaceCell(0, 0, settings, varianceBits);
         auto m = std::shared_ptr<Material>(new Material());
         //m->normal = a.
         //a->tp->m->material = m;
         a->offset = glm::vec3(0,0,0);
+        // linking and the patch space views need the faces in place before the first Render
+        a->tp->m->World = world;
         cells.push_back(a);
     }
-    i = 0;
     Loaded = true;
 }
 
 ROAMSurface::~ROAMSurface(void)
 {
+    // joins the worker before the patches go away
+    delete m_async;
     if(cells.size() > 0){
         for (int i=0;i<cells.size();i++)
         {
@@ -34,67 +80,268 @@ ROAMSurface::~ROAMSurface(void)
 
 void ROAMSurface::UpdateCells(glm::vec3 cam)
 {
-    if(cells.size() > 0){
-        for (int i=0;i<cells.size();i++)
+    UpdateCells(cam, nullptr);
+}
+
+void ROAMSurface::UpdateCells(glm::vec3 cam, const glm::mat4 &viewProjection)
+{
+    UpdateCells(cam, &viewProjection);
+}
+
+void ROAMSurface::Link()
+{
+    if(m_async) {
+        // the worker owns the trees while a job is in flight
+        m_async->Wait();
+    }
+    std::vector<TerrainPatch*> patches;
+    for (int i=0;i<cells.size();i++)
+    {
+        patches.push_back(cells[i]->tp);
+    }
+    if(LinkFaces) {
+        TerrainPatch::linkPatches(patches);
+    } else {
+        TerrainPatch::unlinkPatches(patches);
+    }
+    m_linked = LinkFaces;
+}
+
+void ROAMSurface::FrameTime(float ms)
+{
+    m_frameTime = ms;
+}
+
+float ROAMSurface::ErrorTolerance() const
+{
+    return (PixelError > 0 ? PixelError : 0.001f) * m_errorScale;
+}
+
+bool ROAMSurface::Pick(const glm::vec3 &origin, const glm::vec3 &dir, float *t, int *face, glm::vec2 *texel)
+{
+    bool hit = false;
+    for (int i=0;i<cells.size();i++)
+    {
+        float cell_t;
+        glm::vec2 cell_texel;
+        if(cells[i]->tp->intersect(origin - cells[i]->offset, dir, &cell_t, &cell_texel) && (!hit || cell_t < *t)) {
+            hit = true;
+            *t = cell_t;
+            if(face) {
+                *face = i;
+            }
+            if(texel) {
+                *texel = cell_texel;
+            }
+        }
+    }
+    return hit;
+}
+
+void ROAMSurface::Pick(const glm::vec3 *origins, const glm::vec3 *dirs, size_t count, float *t, unsigned threads)
+{
+    if(count == 0) {
+        return;
+    }
+    std::vector<glm::vec3> local(origins, origins + count);
+    std::vector<float> cell_t(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        t[k] = -1;
+    }
+    for (int i=0;i<cells.size();i++)
+    {
+        for (size_t k = 0; k < count; k++)
+        {
+            local[k] = origins[k] - cells[i]->offset;
+        }
+        cells[i]->tp->intersect(&local[0], dirs, count, &cell_t[0], threads);
+        for (size_t k = 0; k < count; k++)
         {
-            auto patch = cells[i];
-            patch->tp->reset();
-            auto transp = transpose(mat3(inverse(cells[i]->tp->m->World)));
-            patch->tp->tessellate((cam - patch->offset)*transp);
-            patch->tp->getTessellation(patch->triPool, patch->colorPool, patch->normalTexelPool);
+            if(cell_t[k] >= 0 && (t[k] < 0 || cell_t[k] < t[k])) {
+                t[k] = cell_t[k];
+            }
         }
     }
 }
 
-void ROAMSurface::Bind()
+void ROAMSurface::CursorRay(const glm::mat4 &viewProjection, glm::vec2 cursor, glm::vec2 viewport,
+    glm::vec3 *origin, glm::vec3 *dir)
 {
-    if(cells.size() > 0){
+    glm::mat4 unproject = inverse(viewProjection);
+    float x = 2 * cursor.x / viewport.x - 1;
+    float y = 1 - 2 * cursor.y / viewport.y;
+    glm::vec4 near_point = unproject * glm::vec4(x, y, -1, 1);
+    glm::vec4 far_point = unproject * glm::vec4(x, y, 1, 1);
+    *origin = glm::vec3(near_point) / near_point.w;
+    *dir = glm::vec3(far_point) / far_point.w - *origin;
+}
+
+void ROAMSurface::Adapt()
+{
+    // meshes on this thread are the latest finished tessellation
+    size_t leaves = 0;
+    for (int i=0;i<cells.size();i++)
+    {
+        leaves += cells[i]->tp->m->Indeces.size() / 3;
+    }
+    float load = 0;
+    if(LeafBudget > 0) {
+        load = leaves / (float)LeafBudget;
+    }
+    if(TargetFrameTime > 0 && m_frameTime > 0) {
+        load = glm::max(load, m_frameTime / TargetFrameTime);
+    }
+    if(load == 0) {
+        m_errorScale = 1;
+        return;
+    }
+    // leaf count goes roughly with 1/tolerance^2, steps are clamped so a
+    // single slow frame does not throw the detail away
+    if(load > 1) {
+        m_errorScale *= glm::min(sqrtf(load), 2.0f);
+    } else if(load < 0.8f) {
+        m_errorScale = glm::max(1.0f, m_errorScale * glm::max(sqrtf(load / 0.8f), 0.5f));
+    }
+}
+
+void ROAMSurface::UpdateCells(glm::vec3 cam, const glm::mat4 *viewProjection)
+{
+    if(LinkFaces != m_linked) {
+        Link();
+    }
+    float errorMargin = ErrorTolerance();
+    float projectionScale = PixelError > 0 ? TerrainPatch::projectionScale(FieldOfView, ViewportHeight) : 0;
+
+    std::vector<Frustum> frusta;
+    if(viewProjection && FrustumCulling) {
         for (int i=0;i<cells.size();i++)
         {
-            cells[i]->Bind();
+            frusta.push_back(cells[i]->Culling(*viewProjection));
+        }
+    }
+
+    if(cells.size() > 0 && Async) {
+        if(m_async == nullptr) {
+            std::vector<TerrainPatch*> patches;
+            for (int i=0;i<cells.size();i++)
+            {
+                patches.push_back(cells[i]->tp);
+            }
+            m_async = new AsyncTessellator(patches);
+        }
+        std::vector<glm::vec3> views;
+        for (int i=0;i<cells.size();i++)
+        {
+            views.push_back(cells[i]->View(cam));
+        }
+        m_async->Indexed = Indexed;
+        m_async->Incremental = Incremental;
+        m_async->TriangleBudget = TriangleBudget;
+        m_async->TimeBudget = TimeBudget;
+        m_async->HorizonCulling = HorizonCulling;
+        m_async->Linked = m_linked;
+        m_async->Morph = MorphTime > 0;
+        m_async->ErrorMargin = errorMargin;
+        m_async->ProjectionScale = projectionScale;
+        m_async->Post(views, frusta);
+        return;
+    }
+    if(m_async) {
+        // switching back to synchronous updates, the trees must be ours again
+        m_async->Wait();
+        m_async->Swap();
+    }
+    if(cells.size() > 0 && m_linked) {
+        m_dirty = true;
+        std::vector<TerrainPatch*> patches;
+        std::vector<glm::vec3> views;
+        for (int i=0;i<cells.size();i++)
+        {
+            patches.push_back(cells[i]->tp);
+            views.push_back(cells[i]->View(cam));
+        }
+        TerrainPatch::tessellateLinked(patches, views, errorMargin, frusta, HorizonCulling, projectionScale);
+        // mesh output only reads the trees, faces can still go in parallel
+        parallel_for(0, cells.size(), [&](size_t i) {
+            TerrainPatch *tp = cells[i]->tp;
+            tp->getMesh(tp->m->Verteces, tp->m->Indeces, Indexed, MorphTime > 0 ? &tp->Morphs : nullptr);
+        }, Parallel ? 0 : 1);
+        Adapt();
+        return;
+    }
+    if(cells.size() > 0){
+        m_dirty = true;
+        if(Parallel) {
+            // every cell owns its node pool, variance trees and output pools,
+            // so faces can be tessellated independently
+            parallel_for(0, cells.size(), [&](size_t i) {
+                cells[i]->indexed = Indexed;
+                cells[i]->morph = MorphTime > 0;
+                cells[i]->Update(cam, Incremental, TriangleBudget, TimeBudget,
+                    frusta.empty() ? nullptr : &frusta[i], HorizonCulling, errorMargin, projectionScale);
+            });
+        } else {
+            for (int i=0;i<cells.size();i++)
+            {
+                cells[i]->indexed = Indexed;
+                cells[i]->morph = MorphTime > 0;
+                cells[i]->Update(cam, Incremental, TriangleBudget, TimeBudget,
+                    frusta.empty() ? nullptr : &frusta[i], HorizonCulling, errorMargin, projectionScale);
+            }
         }
+        Adapt();
     }
 }
 
-void ROAMSurface::Render(std::shared_ptr<BasicJargShader> active)
+void ROAMSurface::Bind()
 {
-    glm::mat4 Identity = glm::mat4(1);
-    Identity = scale(Identity, vec3(500,500,500));
-    cells[0]->tp->m->World = Identity;
-    cells[0]->Render(active);
-    cells[1]->tp->m->World = rotate(Identity, (float)M_PI, vec3(1,0,0));
-    cells[1]->Render(active);
-    cells[2]->tp->m->World = rotate(Identity, (float)M_PI_2, vec3(1,0,0));
-    cells[2]->Render(active);
-    cells[3]->tp->m->World = rotate(Identity, (float)-M_PI_2, vec3(1,0,0));
-    cells[3]->Render(active);
-    cells[4]->tp->m->World = rotate(Identity, (float)M_PI_2, vec3(0,1,0));
-    cells[4]->Render(active);
-    cells[5]->tp->m->World = rotate(Identity, (float)-M_PI_2, vec3(0,1,0));
-    cells[5]->Render(active);
+    if(m_async && m_async->Swap()) {
+        m_dirty = true;
+        Adapt();
+    }
+    auto now = std::chrono::high_resolution_clock::now();
+    if(m_dirty) {
+        // a new tessellation, its vertices start morphing now
+        m_morphStart = now;
+    }
+    float t = 1;
+    if(MorphTime > 0) {
+        t = std::chrono::duration_cast<std::chrono::microseconds>(now - m_morphStart).count() / (MorphTime * 1e6f);
+    }
+    bool dirty = m_dirty;
+    m_dirty = false;
+    for (int i=0;i<cells.size();i++)
+    {
+        TerrainPatch *tp = cells[i]->tp;
+        bool morphing = !tp->Morphs.empty();
+        tp->morph(t);
+        if(dirty || morphing) {
+            cells[i]->Bind();
+        }
+    }
 }
 
-void ROAMSurface::Test()
+void ROAMSurface::Render(std::shared_ptr<BasicJargShader> active)
 {
-    delete cells[0];
-    i++;
-    auto a = new ROAMSurfaceCell();
-    a->offset = glm::vec3(i,i,0);
-    cells.push_back(a);
+    for (int i=0;i<6;i++)
+    {
+        cells[i]->tp->m->World = faceWorld(i);
+        cells[i]->Render(active);
+    }
 }
 
-ROAMSurfaceCell::ROAMSurfaceCell(float x, float y)
+ROAMSurfaceCell::ROAMSurfaceCell(float x, float y, const TerrainSettings &settings, int varianceBits) :
+    indexed(false),
+    morph(false)
 {
-    tp = new TerrainPatch(x, y);
+    TerrainSettings quantized = settings;
+    quantized.varianceBits = varianceBits;
+    tp = new TerrainPatch(x, y, quantized);
 
     tp->computeVariance(20);
-    tp->m->World = glm::mat4(1.0f);
+    tp->m->World = settings.face ? *settings.face : glm::mat4(1.0f);
     //patch->m->Shader = BasicShader.get();
-    auto m_poolSize = tp->poolSize();
-
-    triPool = new float[m_poolSize*9];
-    colorPool = new  float[m_poolSize*9];
-    normalTexelPool = new float[m_poolSize*6]; 
 
     Heightmap *map = tp->getHeightmap();
     GLuint normalTexture = -1;
@@ -102,7 +349,10 @@ ROAMSurfaceCell::ROAMSurfaceCell(float x, float y)
     glBindTexture(GL_TEXTURE_2D, normalTexture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, map->width, map->height, 0, GL_RGB, GL_FLOAT, map->normal_map);
+    // a third of the float normals, the shader unpacks them
+    std::vector<unsigned int> normals(map->width*map->height);
+    Heightmap_pack_normals(map, HEIGHTMAP_NORMALS_RGB10A2, &normals[0]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB10_A2, map->width, map->height, 0, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, &normals[0]);
     auto tempt = std::shared_ptr<Texture>(new Texture());
     tempt->textureId = normalTexture;
     tempt->width = map->width;
@@ -115,18 +365,46 @@ ROAMSurfaceCell::ROAMSurfaceCell(float x, float y)
 ROAMSurfaceCell::~ROAMSurfaceCell()
 {
     delete tp;
-    delete[] triPool;
-    delete[] colorPool;
-    delete[] normalTexelPool;
+}
+
+glm::vec3 ROAMSurfaceCell::View(glm::vec3 cam)
+{
+    auto transp = transpose(mat3(inverse(tp->m->World)));
+    return (cam - offset)*transp;
+}
+
+Frustum ROAMSurfaceCell::Culling(const glm::mat4 &viewProjection)
+{
+    Frustum frustum;
+    frustum.Build(viewProjection * tp->m->World);
+    return frustum;
+}
+
+void ROAMSurfaceCell::Update(glm::vec3 cam, bool incremental, size_t maxTriangles, float maxMilliseconds,
+    const Frustum *frustum, bool horizon, float errorMargin, float projectionScale)
+{
+    if(incremental) {
+        tp->update(View(cam), errorMargin, maxTriangles, maxMilliseconds, frustum, horizon, projectionScale);
+    } else {
+        tp->reset();
+        tp->tessellate(View(cam), errorMargin, frustum, horizon, projectionScale);
+    }
+    tp->getMesh(tp->m->Verteces, tp->m->Indeces, indexed, morph ? &tp->Morphs : nullptr);
 }
 
 void ROAMSurfaceCell::Bind()
 {
-    tp->Bind(triPool, colorPool, normalTexelPool);
+    tp->Bind();
 }
 
 void ROAMSurfaceCell::Render(std::shared_ptr<BasicJargShader> active)
 {	
     tp->m->shader = active;
+    // the normal texture is RGB10A2, the shader unpacks it for terrain only.
+    // glUniform sets the bound program, Render binds it too late for this
+    active->Use();
+    GLint packed = glGetUniformLocation(active->program, "PackedNormals");
+    glUniform1i(packed, 1);
     tp->Render();
+    glUniform1i(packed, 0);
 }
@@ -1,32 +1,120 @@
 #pragma once
 #include <vector>
+#include <chrono>
 #include <ROAMgrid.h>
 #include <JargShader.h>
 #include "BasicJargShader.h"
+#include "AsyncTessellator.h"
 class ROAMSurfaceCell {
 public:
     TerrainPatch* tp;
     glm::vec3 offset;
-    ROAMSurfaceCell(float x = 0, float y = 0);
+    ROAMSurfaceCell(float x = 0, float y = 0, const TerrainSettings &settings = TerrainSettings(), int varianceBits = 32);
     ~ROAMSurfaceCell();
+    void Update(glm::vec3 cam, bool incremental = false, size_t maxTriangles = 0, float maxMilliseconds = 0,
+        const Frustum *frustum = nullptr, bool horizon = false, float errorMargin = 0.001, float projectionScale = 0);
+    // camera in the patch space
+    glm::vec3 View(glm::vec3 cam);
+    // view frustum in the patch space
+    Frustum Culling(const glm::mat4 &viewProjection);
     void Bind();
     void Render(std::shared_ptr<BasicJargShader> active);
 
-    float *triPool;
-    float *colorPool;
-    float *normalTexelPool;
+    // shared vertices + index buffer instead of 3 vertices per leaf
+    bool indexed;
+    // fill tp->Morphs for geomorphing
+    bool morph;
 };
 
 class ROAMSurface {
 public:
-    ROAMSurface(void);
+    // cacheDir keeps generated heightmaps and variance trees between launches,
+    // varianceBits 8 or 16 quantizes the variance trees, and caches them quantized (see TerrainSettings::varianceBits),
+    // resolution is the heightmap size of a face (2^n+1, e.g. 257 on a server, 4097 for close-ups),
+    // seed gives every planet its own terrain
+    ROAMSurface(const std::string &cacheDir = "", int varianceBits = 32, int resolution = TerrainPatch::DefaultResolution,
+        unsigned int seed = 0);
     ~ROAMSurface(void);
     void UpdateCells(glm::vec3 cam);
+    // same, with frustum culling against the camera projection*view
+    void UpdateCells(glm::vec3 cam, const glm::mat4 &viewProjection);
     std::vector<ROAMSurfaceCell*> cells;
 
     void Bind();
     void Render(std::shared_ptr<BasicJargShader> active);
-    void Test();
-    int i;
     bool Loaded;
+
+    // tessellate cells on worker threads in UpdateCells, Bind stays on the GL thread
+    bool Parallel;
+
+    // emit unique vertices and an index buffer
+    bool Indexed;
+
+    // keep the previous tessellation and split/merge it instead of rebuilding,
+    // budgets are per cell and per UpdateCells call, 0 means unlimited.
+    // Only cheaper with PixelError and small camera steps, without PixelError
+    // and after jumps it is slower than rebuilding
+    bool Incremental;
+    size_t TriangleBudget;
+    float TimeBudget;
+
+    // UpdateCells only posts the camera to a worker thread, Bind swaps in and
+    // uploads the finished meshes, so it can be called every frame
+    bool Async;
+
+    // stop refining faces outside the frustum (UpdateCells with a projection*view)
+    // and behind the planet horizon
+    bool FrustumCulling;
+    bool HorizonCulling;
+
+    // cube-sphere mode: the roots of adjacent faces are linked, forced splits cross
+    // the seams so the faces meet without T-junctions. Faces are tessellated one
+    // after another and Incremental is ignored
+    bool LinkFaces;
+
+    // screen-space error: with PixelError > 0 a triangle splits while its projected
+    // error is above PixelError pixels for FieldOfView (vertical, degrees) and
+    // ViewportHeight, otherwise the old distance weighted variance metric is used
+    float PixelError;
+    float FieldOfView;
+    float ViewportHeight;
+
+    // leaves over all faces and frame time (ms) to stay under, 0 - off. The error
+    // tolerance is raised while either is exceeded and lowered back towards
+    // PixelError when there is room again, see FrameTime
+    size_t LeafBudget;
+    float TargetFrameTime;
+
+    // seconds new vertices take to move from the coarser surface to their place
+    // after a retessellation (uploads the morphing faces every frame meanwhile),
+    // 0 - they pop in. Only splits morph, merges still pop
+    float MorphTime;
+
+    // the last frame time in ms, for TargetFrameTime
+    void FrameTime(float ms);
+    // tolerance the next UpdateCells uses, pixels or the variance margin
+    float ErrorTolerance() const;
+
+    // nearest hit of origin + t*dir (world space) with the faces' full
+    // resolution surface, see TerrainPatch::intersect. face and texel name the
+    // heightmap texel under the hit
+    bool Pick(const glm::vec3 &origin, const glm::vec3 &dir, float *t, int *face = nullptr, glm::vec2 *texel = nullptr);
+    // t[i] of ray i or -1, e.g. for placing objects
+    void Pick(const glm::vec3 *origins, const glm::vec3 *dirs, size_t count, float *t, unsigned threads = 0);
+    // ray through a cursor position in pixels (Mouse::GetCursorPos, top left
+    // origin), from the near plane (t = 0) to the far plane (t = 1)
+    static void CursorRay(const glm::mat4 &viewProjection, glm::vec2 cursor, glm::vec2 viewport,
+        glm::vec3 *origin, glm::vec3 *dir);
+
+private:
+    void UpdateCells(glm::vec3 cam, const glm::mat4 *viewProjection);
+    void Link();
+    void Adapt();
+
+    AsyncTessellator *m_async;
+    bool m_dirty;
+    bool m_linked;
+    float m_frameTime;
+    float m_errorScale;
+    std::chrono::high_resolution_clock::time_point m_morphStart;
 };
\ No newline at end of file
@@ -6,12 +6,132 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
 #include "ClassicNoise.h"
+#include "ParallelFor.h"
 
-#define tempres 1024
+// noise texels a patch spans, a finer resolution samples them more densely
+#define TERRAIN_EXTENT 1024.0F
 
-TerrainPatch::TerrainPatch(int offset_x, int offset_y)
-    : m_map(nullptr)
+// bump when the generator below or the cache layout changes
+#define TERRAIN_CACHE_VERSION 5
+
+static FractalNoise terrainNoise(unsigned int seed)
+{
+    FractalNoise noise;
+    noise.Source = Noise(seed);
+    noise.Octaves = 3;
+    noise.Frequency = 1/64.0F;
+    noise.Lacunarity = 2;
+    noise.Amplitude = 1;
+    noise.Gain = 0.5F;
+    return noise;
+}
+
+// flattens the valleys and the peaks of the raw noise
+static float terrainShape(float t)
+{
+    if(t < 0) {
+        t = -t;
+        t /= 30.0F;
+    }
+    if( t < 0.1) {
+        t+= 0.1;
+    }
+    if(t > .6) {
+        t /= 10.0F;
+        t += .6;
+    } 
+    return t;
+}
+
+static Heightmap *generateHeightmap(int offset_x, int offset_y, int resolution, unsigned int seed, const float *face,
+    unsigned threads)
+{
+    Heightmap *heightmap = new Heightmap();
+    heightmap->height = resolution;
+    heightmap->width = resolution;
+    heightmap->map = new float[resolution*resolution];
+    FractalNoise noise = terrainNoise(seed);
+    if (face) {
+        // a face spans a quarter of the sphere's circumference, as wide as a planar patch
+        noise.FillSphere(heightmap, face, TERRAIN_EXTENT*2/3.14159265F, threads);
+    } else {
+        // offsets are in noise units of the first octave
+        noise.Fill(heightmap, offset_x/noise.Frequency, offset_y/noise.Frequency, TERRAIN_EXTENT/(resolution - 1), threads);
+    }
+
+    auto map = heightmap->map;
+    heightmap->minZ = heightmap->maxZ = 0;
+    for (int i =0; i<resolution*resolution;i++)
+    {
+        float t = terrainShape(*map);
+        *map = t;
+        heightmap->maxZ = glm::max(t, heightmap->maxZ);
+        heightmap->minZ = glm::min(t, heightmap->minZ);
+        ++map;
+    }
+
+    if (face) {
+        // every face divides by the same bound, the highest the noise can go,
+        // so heights still agree along the edges they share
+        float amplitude = 0, octave = noise.Amplitude;
+        for (int o = 0; o < noise.Octaves; o++) {
+            amplitude += octave;
+            octave *= noise.Gain;
+        }
+        heightmap->maxZ = terrainShape(amplitude);
+    }
+    Heightmap_normalize(heightmap);
+    Heightmap_calculate_normals(heightmap, threads);
+    return heightmap;
+}
+
+// FNV-1a over everything that changes the generated heightmap
+static uint32_t terrainParamsHash(unsigned int seed, const float *face)
+{
+    uint32_t hash = terrainNoise(seed).Hash();
+    if (face) {
+        const unsigned char *bytes = (const unsigned char *)face;
+        for (size_t i = 0; i < 9*sizeof(float); i++) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+    }
+    return (hash ^ TERRAIN_CACHE_VERSION) * 16777619u;
+}
+
+/* cache file: header, map, normal_map (3 floats per texel), left and right
+   variance trees of varianceBits each, with their scales when quantized.
+   64 byte header keeps the arrays aligned */
+struct TerrainCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    int32_t offset_x, offset_y;
+    uint32_t params;
+    int32_t width, height;
+    int32_t varianceLevels;
+    float minZ, maxZ;
+    int32_t varianceBits;
+    float leftScale, rightScale;
+    uint32_t reserved[3];
+};
+
+TerrainSettings::TerrainSettings()
+    : resolution(TerrainPatch::DefaultResolution)
+    , seed(0)
+    , face(nullptr)
+    , threads(0)
+    , varianceBits(32)
+{
+}
+
+TerrainPatch::TerrainPatch(int offset_x, int offset_y, const TerrainSettings &settings, Heightmap *map)
+    : m_map(map)
     , m_worldX(offset_x)
     , m_worldY(offset_y)
     , m_leftVariance(nullptr)
@@ -24,251 +144,1956 @@ TerrainPatch::TerrainPatch(int offset_x, int offset_y)
     , m_triPool(0)
     , m_poolSize(500000)
     , m_poolNext(0)
+    , m_nodeInfo(nullptr)
+    , m_errorMargin(0)
+    , m_refreshBucket(0)
+    , m_refreshEntries(0)
+    , m_travel(0)
+    , m_refreshAll(true)
+    , m_updating(false)
+    , m_stamp(0)
+    , m_compactPool(nullptr)
+    , m_compactNext(0)
+    , m_cullFrustum(nullptr)
+    , m_cullHorizon(false)
+    , m_projectionScale(0)
+    , m_offsetX(offset_x)
+    , m_offsetY(offset_y)
+    , m_resolution(map ? (int)map->width : MAX(settings.resolution, 3))
+    , m_seed(settings.seed)
+    , m_varianceBits(settings.varianceBits)
+    , m_sphere(settings.face != nullptr)
+    , m_cacheDir(settings.cacheDir)
+    , m_cache(nullptr)
+    , m_varianceMapped(false)
+    , m_pyramidThreads(0)
 {
-    //m_map = Heightmap_read(fn);
-    m_map = new Heightmap();
-    m_map->height = tempres;
-    m_map->width = tempres;
-    m_map->map = new float[tempres*tempres];
-    auto map = m_map->map;
-    auto a = rand()%1000/100.0f;
-    for (int i =0; i<tempres;i++)
-    {
-        for (int j =0; j<tempres;j++)
-        {
-            float t = simplexnoise(offset_x + i/64.0F, offset_y + j/64.0F) + simplexnoise(offset_x + i/32.0F, offset_y + j/32.0F)/2.0F + simplexnoise(offset_x + i/16.0F, offset_y + j/16.0F)/4.0F;
-            if(t < 0) {
-                t = -t;
-                t /= 30.0F;
-            }
-            if( t < 0.1) {
-                t+= 0.1;
+    memset(&m_leftTree, 0, sizeof(VarianceTree));
+    memset(&m_rightTree, 0, sizeof(VarianceTree));
+    for (int i = 0; i < 4; i++) {
+        m_linkPatch[i] = nullptr;
+        m_linkEdge[i] = 0;
+    }
+    // rotation only, the surface's scale does not change where the noise is sampled
+    for (int i = 0; i < 9; i++) {
+        m_face[i] = i%4 == 0 ? 1.0F : 0.0F;
+    }
+    if (settings.face) {
+        for (int c = 0; c < 3; c++) {
+            const glm::vec4 &axis = (*settings.face)[c];
+            float length = sqrtf(axis.x*axis.x + axis.y*axis.y + axis.z*axis.z);
+            for (int r = 0; r < 3; r++) {
+                m_face[r*3 + c] = axis[r]/length;
             }
-            if(t > .6) {
-                t /= 10.0F;
-                t += .6;
-            } 
-
-
-            *map = t;
-            m_map->maxZ = glm::max(t, m_map->maxZ);
-            m_map->minZ = glm::min(t, m_map->minZ);
-            ++map;
         }
     }
 
+    //m_map = Heightmap_read(fn);
+    if (m_map == nullptr && !m_cacheDir.empty()) {
+        m_map = loadCache();
+    }
     if (m_map == nullptr) {
-        return;
+        m_map = generateHeightmap(offset_x, offset_y, m_resolution, m_seed, m_sphere ? m_face : nullptr, settings.threads);
     }
 
-    Heightmap_normalize(m_map);
-    Heightmap_calculate_normals(m_map);
-
     m_triPool = new BTTNode[m_poolSize];
     //memset(m_triPool, 0, sizeof(BTTNode)*m_poolSize);
 
     m_leftRoot = allocateNode();
     m_rightRoot = allocateNode();
     m = new Mesh();
+    if (settings.face) {
+        m->World = *settings.face;
+    }
 }
 
 TerrainPatch::~TerrainPatch()
 {
     delete m;
     delete [] m_triPool;
-    delete [] m_leftVariance;
-    delete [] m_rightVariance;
+    delete [] m_nodeInfo;
+    delete [] m_compactPool;
+    freeVariance();
     if(m_map) {
         maps_delete(m_map);
     }
+    delete m_cache;
+}
+
+void TerrainPatch::freeVariance()
+{
+    if (!m_varianceMapped) {
+        delete [] m_leftVariance;
+        delete [] m_rightVariance;
+    }
+    m_leftVariance = m_rightVariance = nullptr;
+
+    VarianceTree *trees[] = { &m_leftTree, &m_rightTree };
+    for (int i = 0; i < 2; i++) {
+        if (!m_varianceMapped) {
+            delete [] trees[i]->values16;
+            delete [] trees[i]->values8;
+        }
+        memset(trees[i], 0, sizeof(VarianceTree));
+    }
+    m_varianceMapped = false;
+}
+
+static void quantizeTree(const float *values, size_t size, int bits, VarianceTree &tree)
+{
+    float maxValue = 0;
+    for (size_t i = 0; i < size; i++) {
+        maxValue = MAX(maxValue, values[i]);
+    }
+    unsigned int steps = bits == 8 ? UCHAR_MAX : USHRT_MAX;
+    tree.scale = maxValue > 0 ? maxValue / steps : 1.0f;
+    while (steps*tree.scale < maxValue) {
+        tree.scale = nextafterf(tree.scale, FLT_MAX);
+    }
+
+    unsigned char *values8 = bits == 8 ? new unsigned char[size] : nullptr;
+    unsigned short *values16 = bits == 8 ? nullptr : new unsigned short[size];
+    for (size_t i = 0; i < size; i++) {
+        unsigned int q = (unsigned int)ceilf(values[i] / tree.scale);
+        // division rounding can still land one step low
+        if (q < steps && q*tree.scale < values[i]) {
+            q++;
+        }
+        q = MIN(q, steps);
+        if (bits == 8) {
+            values8[i] = (unsigned char)q;
+        } else {
+            values16[i] = (unsigned short)q;
+        }
+    }
+    tree.values = nullptr;
+    tree.values8 = values8;
+    tree.values16 = values16;
+}
+
+void TerrainPatch::quantizeVariance(int bits)
+{
+    if ((bits != 8 && bits != 16) || m_leftVariance == nullptr) {
+        return;
+    }
+    quantizeTree(m_leftVariance, m_varianceSize, bits, m_leftTree);
+    quantizeTree(m_rightVariance, m_varianceSize, bits, m_rightTree);
+
+    // the float trees are not needed any more
+    if (!m_varianceMapped) {
+        delete [] m_leftVariance;
+        delete [] m_rightVariance;
+    }
+    m_leftVariance = m_rightVariance = nullptr;
+    m_varianceMapped = false;
+}
+
+size_t TerrainPatch::varianceBytes() const
+{
+    size_t bytes = 0;
+    const VarianceTree *trees[] = { &m_leftTree, &m_rightTree };
+    for (int i = 0; i < 2; i++) {
+        if (trees[i]->values) {
+            bytes += m_varianceSize*sizeof(float);
+        } else if (trees[i]->values16) {
+            bytes += m_varianceSize*sizeof(unsigned short);
+        } else if (trees[i]->values8) {
+            bytes += m_varianceSize;
+        }
+    }
+    return bytes;
+}
+
+std::string TerrainPatch::cachePath() const
+{
+    if (m_cacheDir.empty()) {
+        return std::string();
+    }
+    char name[96];
+    sprintf(name, "terrain_%d_%d_%d_%08x.cache", m_offsetX, m_offsetY, m_resolution, terrainParamsHash(m_seed, m_sphere ? m_face : nullptr));
+    std::string path = m_cacheDir;
+    if (path[path.size()-1] != '/' && path[path.size()-1] != '\\') {
+        path += '/';
+    }
+    return path + name;
+}
+
+bool TerrainPatch::cached() const
+{
+    return m_cache != nullptr;
 }
 
+Heightmap *TerrainPatch::loadCache()
+{
+    m_cache = new MappedFile();
+    if (!m_cache->Open(cachePath()) || m_cache->Size() < sizeof(TerrainCacheHeader)) {
+        delete m_cache;
+        m_cache = nullptr;
+        return nullptr;
+    }
+
+    const TerrainCacheHeader *header = (const TerrainCacheHeader *)m_cache->Data();
+    size_t texels = (size_t)header->width*header->height;
+    size_t varianceSize = header->varianceLevels > 0 ? (size_t)2<<header->varianceLevels : 0;
+    size_t expected = sizeof(TerrainCacheHeader) + sizeof(float)*texels*4 + varianceSize*2*(header->varianceBits/8);
+    if (memcmp(header->magic, "RTC1", 4) != 0 || header->version != TERRAIN_CACHE_VERSION ||
+        (header->varianceBits != 8 && header->varianceBits != 16 && header->varianceBits != 32) ||
+        header->offset_x != m_offsetX || header->offset_y != m_offsetY ||
+        header->params != terrainParamsHash(m_seed, m_sphere ? m_face : nullptr) || header->width != m_resolution || header->height != m_resolution ||
+        m_cache->Size() != expected) {
+        delete m_cache;
+        m_cache = nullptr;
+        return nullptr;
+    }
+
+    Heightmap *map = new Heightmap();
+    map->width = header->width;
+    map->height = header->height;
+    map->minZ = header->minZ;
+    map->maxZ = header->maxZ;
+    map->map = (float *)(header + 1);
+    map->normal_map = map->map + texels;
+    map->external = true;
+    return map;
+}
 
-void TerrainPatch::computeVariance(int maxTessellationLevels)
+bool TerrainPatch::loadCachedVariance(int maxTessellationLevels)
 {
+    if (m_cache == nullptr) {
+        return false;
+    }
+    const TerrainCacheHeader *header = (const TerrainCacheHeader *)m_cache->Data();
+    int bits = m_varianceBits == 8 || m_varianceBits == 16 ? m_varianceBits : 32;
+    if (header->varianceLevels != maxTessellationLevels || header->varianceBits != bits) {
+        return false;
+    }
+    freeVariance();
     m_varianceSize = 2<<maxTessellationLevels;
+    m_varianceMapped = true;
+    const float *trees = m_map->normal_map + m_map->width*m_map->height*3;
+    if (bits == 32) {
+        m_leftVariance = (float *)trees;
+        m_rightVariance = m_leftVariance + m_varianceSize;
+        m_leftTree.values = m_leftVariance;
+        m_rightTree.values = m_rightVariance;
+    } else if (bits == 16) {
+        m_leftTree.values16 = (const unsigned short *)trees;
+        m_rightTree.values16 = m_leftTree.values16 + m_varianceSize;
+    } else {
+        m_leftTree.values8 = (const unsigned char *)trees;
+        m_rightTree.values8 = m_leftTree.values8 + m_varianceSize;
+    }
+    m_leftTree.scale = header->leftScale;
+    m_rightTree.scale = header->rightScale;
+    return true;
+}
+
+void TerrainPatch::saveCache(int maxTessellationLevels)
+{
+    if (m_cache) {
+        // the open mapping still backs m_map, keep the file as it is
+        return;
+    }
+
+    TerrainCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "RTC1", 4);
+    header.version = TERRAIN_CACHE_VERSION;
+    header.offset_x = m_offsetX;
+    header.offset_y = m_offsetY;
+    header.params = terrainParamsHash(m_seed, m_sphere ? m_face : nullptr);
+    header.width = m_map->width;
+    header.height = m_map->height;
+    header.varianceLevels = maxTessellationLevels;
+    header.minZ = m_map->minZ;
+    header.maxZ = m_map->maxZ;
+    header.varianceBits = m_leftTree.values16 ? 16 : m_leftTree.values8 ? 8 : 32;
+    header.leftScale = m_leftTree.scale;
+    header.rightScale = m_rightTree.scale;
+
+    // write aside and rename, a crash never leaves a half written cache behind
+    std::string path = cachePath();
+    std::string temp = path + ".tmp";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    size_t texels = m_map->width*m_map->height;
+    size_t bytes = header.varianceBits/8;
+    const void *left = m_leftTree.values16 ? (const void *)m_leftTree.values16 :
+        m_leftTree.values8 ? (const void *)m_leftTree.values8 : (const void *)m_leftTree.values;
+    const void *right = m_rightTree.values16 ? (const void *)m_rightTree.values16 :
+        m_rightTree.values8 ? (const void *)m_rightTree.values8 : (const void *)m_rightTree.values;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(m_map->map, sizeof(float), texels, file) == texels &&
+        fwrite(m_map->normal_map, sizeof(float), texels*3, file) == texels*3 &&
+        fwrite(left, bytes, m_varianceSize, file) == m_varianceSize &&
+        fwrite(right, bytes, m_varianceSize, file) == m_varianceSize;
+    ok = fclose(file) == 0 && ok;
+    remove(path.c_str());
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+    }
+}
+
+
+int TerrainPatch::maxLevels() const
+{
+    // every second level halves each axis
+    int levels = 0;
+    while (((size_t)1 << levels) + 1 < m_map->width) {
+        levels++;
+    }
+    int levels_y = 0;
+    while (((size_t)1 << levels_y) + 1 < m_map->height) {
+        levels_y++;
+    }
+    return levels + levels_y;
+}
+
+void TerrainPatch::computeVariance(int maxTessellationLevels, unsigned threads)
+{
+    maxTessellationLevels = MIN(maxTessellationLevels, maxLevels());
+    m_pyramidThreads = threads;
+    if (loadCachedVariance(maxTessellationLevels)) {
+        return;
+    }
 
+    freeVariance();
+    m_varianceSize = 2<<maxTessellationLevels;
     m_leftVariance = new float[m_varianceSize];
     m_rightVariance = new float[m_varianceSize];
     //memset(m_leftVariance, 0, sizeof(float)*m_varianceSize);
     //memset(m_rightVariance, 0, sizeof(float)*m_varianceSize);
+    // the trees start at index 1, keep the unused slot defined for quantization and the cache
+    m_leftVariance[0] = m_rightVariance[0] = 0;
+
+    if (threads != 1) {
+        // 2^taskLevel subtrees per root. Every subtree covers a compact block of
+        // the heightmap that stays in cache while its worker walks it
+        int taskLevel = MIN(maxTessellationLevels, 7);
+        std::vector<VarianceTask> tasks;
+        collectVarianceTasks(
+            tasks, 0, taskLevel, m_leftVariance, 1,
+            0, m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
+            m_map->width-1, 0, Heightmap_get(m_map, m_map->width-1, 0),
+            0, 0, Heightmap_get(m_map, 0, 0));
+        collectVarianceTasks(
+            tasks, 0, taskLevel, m_rightVariance, 1,
+            m_map->width-1, 0, Heightmap_get(m_map, m_map->width-1, 0),
+            0, m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
+            m_map->width-1, m_map->height-1, Heightmap_get(m_map, m_map->width-1, m_map->height-1));
+
+        parallel_for(0, tasks.size(), [&](size_t i) {
+            const VarianceTask &t = tasks[i];
+            computeVarianceRecursive(
+                maxTessellationLevels, taskLevel, t.varianceTree, t.idx, m_map,
+                t.left_x, t.left_y, t.left_z,
+                t.right_x, t.right_y, t.right_z,
+                t.apex_x, t.apex_y, t.apex_z);
+        }, threads);
+
+        // levels above the subtrees, bottom-up
+        for (int idx = (1<<taskLevel) - 1; idx >= 1; idx--) {
+            m_leftVariance[idx] = MAX(m_leftVariance[(idx<<1)], m_leftVariance[(idx<<1)+1]);
+            m_rightVariance[idx] = MAX(m_rightVariance[(idx<<1)], m_rightVariance[(idx<<1)+1]);
+        }
+    } else {
+        computeVarianceRecursive(
+            maxTessellationLevels, 0, m_leftVariance, 1, m_map,
+            0, m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
+            m_map->width-1, 0, Heightmap_get(m_map, m_map->width-1, 0),
+            0, 0, Heightmap_get(m_map, 0, 0));
+        computeVarianceRecursive(
+            maxTessellationLevels, 0, m_rightVariance, 1, m_map,
+            m_map->width-1, 0, Heightmap_get(m_map, m_map->width-1, 0),
+            0, m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
+            m_map->width-1, m_map->height-1, Heightmap_get(m_map, m_map->width-1, m_map->height-1));
+    }
 
-    computeVarianceRecursive(
-        maxTessellationLevels, 0, m_leftVariance, 1, m_map,
-        0, m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
-        m_map->width-1, 0, Heightmap_get(m_map, m_map->width-1, 0),
-        0, 0, Heightmap_get(m_map, 0, 0));
-    computeVarianceRecursive(
-        maxTessellationLevels, 0, m_rightVariance, 1, m_map,
-        m_map->width-1, 0, Heightmap_get(m_map, m_map->width-1, 0),
-        0, m_map->height-1, Heightmap_get(m_map, 0, m_map->height-1),
-        m_map->width-1, m_map->height-1, Heightmap_get(m_map, m_map->width-1, m_map->height-1));
+    m_leftTree.values = m_leftVariance;
+    m_rightTree.values = m_rightVariance;
+    quantizeVariance(m_varianceBits);
+
+    if (!m_cacheDir.empty()) {
+        saveCache(maxTessellationLevels);
+    }
 }
 
 void TerrainPatch::reset()
 {
+    if (m_compactPool) {
+        // slot 0 is the null handle, roots live in 1 and 2
+        memset(&m_compactPool[1], 0, 2*sizeof(BTTCompactNode));
+        m_compactPool[1].base_neighbor = 2;
+        m_compactPool[2].base_neighbor = 1;
+        m_compactNext = 3;
+        return;
+    }
+
     m_leftRoot->left_child = m_leftRoot->right_child = nullptr;
     m_rightRoot->left_child = m_rightRoot->right_child = nullptr;
 
-    m_leftRoot->right_neighbor = m_leftRoot->left_neighbor = nullptr;
-    m_rightRoot->right_neighbor = m_rightRoot->left_neighbor = nullptr;
+    // even edges are the left legs of the roots, odd ones the right legs
+    m_leftRoot->left_neighbor = m_linkPatch[PATCH_EDGE_X0] ? m_linkPatch[PATCH_EDGE_X0]->edgeRoot(m_linkEdge[PATCH_EDGE_X0]) : nullptr;
+    m_leftRoot->right_neighbor = m_linkPatch[PATCH_EDGE_Y0] ? m_linkPatch[PATCH_EDGE_Y0]->edgeRoot(m_linkEdge[PATCH_EDGE_Y0]) : nullptr;
+    m_rightRoot->left_neighbor = m_linkPatch[PATCH_EDGE_X1] ? m_linkPatch[PATCH_EDGE_X1]->edgeRoot(m_linkEdge[PATCH_EDGE_X1]) : nullptr;
+    m_rightRoot->right_neighbor = m_linkPatch[PATCH_EDGE_Y1] ? m_linkPatch[PATCH_EDGE_Y1]->edgeRoot(m_linkEdge[PATCH_EDGE_Y1]) : nullptr;
 
     m_leftRoot->base_neighbor = m_rightRoot;
     m_rightRoot->base_neighbor = m_leftRoot;
 
     m_poolNext = 2;
+    m_freeNodes.clear();
+    m_refreshAll = true;
 }
 
-void TerrainPatch::tessellate(const glm::vec3 &view, float errorMargin)
+void TerrainPatch::tessellate(const glm::vec3 &view, float errorMargin, const Frustum *frustum, bool horizon,
+    float projectionScale)
 {
+    m_view = view;
+    m_cullFrustum = frustum;
+    m_cullHorizon = horizon;
+    if (frustum || horizon) {
+        buildPyramid();
+    }
+    m_projectionScale = projectionScale;
+    // the tree no longer matches the priorities update() kept
+    m_refreshAll = true;
+    int cull = cullRoot();
+
+    if (m_compactPool) {
+        tessellateCompactRecursive(
+            1, view, errorMargin,
+            0, m_map->height-1,
+            m_map->width-1, 0,
+            0, 0,
+            m_leftTree, 1, cull, 0);
+        tessellateCompactRecursive(
+            2, view, errorMargin,
+            m_map->width-1, 0,
+            0, m_map->height-1,
+            m_map->width-1, m_map->height-1,
+            m_rightTree, 1, cull, 0);
+
+        m_leftLeaves = BTTCompactNode_number_of_leaves(m_compactPool, 1);
+        m_rightLeaves = BTTCompactNode_number_of_leaves(m_compactPool, 2);
+        return;
+    }
+
     tessellateRecursive(
         m_leftRoot, view, errorMargin,
         0, m_map->height-1,
         m_map->width-1, 0,
         0, 0,
-        m_leftVariance, 1, m_map);
+        m_leftTree, 1, m_map, cull, 0);
     tessellateRecursive(
         m_rightRoot, view, errorMargin,
         m_map->width-1, 0,
         0, m_map->height-1,
         m_map->width-1, m_map->height-1,
-        m_rightVariance, 1, m_map);
+        m_rightTree, 1, m_map, cull, 0);
 
     m_leftLeaves = BTTNode_number_of_leaves(m_leftRoot);
     m_rightLeaves = BTTNode_number_of_leaves(m_rightRoot);
 }
 
-void TerrainPatch::getTessellation(float *vertices, float *colors, float *normalTexels)
+template <typename LeafFunc, typename SplitFunc>
+void TerrainPatch::forEachLeafRecursive(
+    BTTNode *node, LeafFunc &emit, SplitFunc &split,
+    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
 {
-    int idx = 0;
-    getTessellationRecursive(
-        m_leftRoot, m_map, vertices, colors, normalTexels, &idx,
-        0, m_map->height-1,
-        m_map->width-1, 0,
-        0, 0);
-    getTessellationRecursive(
-        m_rightRoot, m_map, vertices, colors, normalTexels, &idx,
-        m_map->width-1, 0,
-        0, m_map->height-1,
-        m_map->width-1, m_map->height-1);
+    if (node->left_child) {
+        int center_x = (left_x + right_x) / 2;
+        int center_y = (left_y + right_y) / 2;
+
+        split(left_x, left_y, right_x, right_y);
+        forEachLeafRecursive(
+            node->left_child, emit, split,
+            apex_x, apex_y, left_x, left_y, center_x, center_y);
+        forEachLeafRecursive(
+            node->right_child, emit, split,
+            right_x, right_y, apex_x, apex_y, center_x, center_y);
+    } else {
+        emit(left_x, left_y, right_x, right_y, apex_x, apex_y);
+    }
 }
 
-BTTNode *TerrainPatch::allocateNode()
+template <typename LeafFunc, typename SplitFunc>
+void TerrainPatch::forEachLeafCompact(
+    uint32_t node, LeafFunc &emit, SplitFunc &split,
+    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
 {
-    BTTNode *tri;
+    uint32_t children = m_compactPool[node].children;
+    if (children) {
+        int center_x = (left_x + right_x) / 2;
+        int center_y = (left_y + right_y) / 2;
 
-    if (m_poolNext >= m_poolSize) {
-        return nullptr;
+        split(left_x, left_y, right_x, right_y);
+        forEachLeafCompact(
+            children, emit, split,
+            apex_x, apex_y, left_x, left_y, center_x, center_y);
+        forEachLeafCompact(
+            children+1, emit, split,
+            right_x, right_y, apex_x, apex_y, center_x, center_y);
+    } else {
+        emit(left_x, left_y, right_x, right_y, apex_x, apex_y);
     }
+}
 
-    tri = &m_triPool[m_poolNext++];
-    tri->left_child = tri->right_child = nullptr;
+template <typename LeafFunc, typename SplitFunc>
+void TerrainPatch::forEachNode(LeafFunc &emit, SplitFunc &split)
+{
+    if (m_compactPool) {
+        forEachLeafCompact(
+            1, emit, split,
+            0, m_map->height-1,
+            m_map->width-1, 0,
+            0, 0);
+        forEachLeafCompact(
+            2, emit, split,
+            m_map->width-1, 0,
+            0, m_map->height-1,
+            m_map->width-1, m_map->height-1);
+    } else {
+        forEachLeafRecursive(
+            m_leftRoot, emit, split,
+            0, m_map->height-1,
+            m_map->width-1, 0,
+            0, 0);
+        forEachLeafRecursive(
+            m_rightRoot, emit, split,
+            m_map->width-1, 0,
+            0, m_map->height-1,
+            m_map->width-1, m_map->height-1);
+    }
+}
 
-    return tri;
+template <typename LeafFunc>
+void TerrainPatch::forEachLeaf(LeafFunc &emit)
+{
+    auto none = [](int, int, int, int) {};
+    forEachNode(emit, none);
 }
 
-void TerrainPatch::split(BTTNode *node)
+void TerrainPatch::getTessellation(float *vertices, float *normalTexels)
 {
-    if (node->left_child)
-        return;
+    Heightmap *map = m_map;
+    int idx = 0;
+    auto emit = [&](int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) {
+        vertices[idx+0] =  left_x /(float) (map->width - 1);
+        vertices[idx+1] =  left_y /(float) (map->height - 1);
+        vertices[idx+2] = Heightmap_get(map, left_x, left_y);
+        vertices[idx+3] =  right_x /(float) (map->width - 1);
+        vertices[idx+4] =  right_y /(float) (map->height - 1);
+        vertices[idx+5] = Heightmap_get(map, right_x, right_y);
+        vertices[idx+6] =  apex_x /(float) (map->width - 1);
+        vertices[idx+7] =  apex_y /(float) (map->height - 1);
+        vertices[idx+8] = Heightmap_get(map, apex_x, apex_y);
 
-    if (node->base_neighbor && node->base_neighbor->base_neighbor != node) {
-        split(node->base_neighbor);
-    }
+        normalTexels[(idx/9)*6+0] =  left_x  /(float) (map->width - 1);
+        normalTexels[(idx/9)*6+1] =  left_y  /(float) (map->height - 1);
+        normalTexels[(idx/9)*6+2] =  right_x /(float) (map->width - 1);
+        normalTexels[(idx/9)*6+3] =  right_y /(float) (map->height - 1);
+        normalTexels[(idx/9)*6+4] =  apex_x  /(float) (map->width - 1);
+        normalTexels[(idx/9)*6+5] =  apex_y  /(float) (map->height - 1);
 
-    node->left_child = allocateNode();
-    node->right_child = allocateNode();
+        idx += 9;
+    };
+    forEachLeaf(emit);
+}
 
-    if (!node->left_child || !node->right_child) {
-        return;
-    }
+template <typename VertexFunc, typename LeafFunc>
+void TerrainPatch::forEachIndexedRecursive(
+    BTTNode *node, VertexFunc &vertex, LeafFunc &emit,
+    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
+    GLuint left, GLuint right, GLuint apex)
+{
+    if (node->left_child) {
+        int center_x = (left_x + right_x) / 2;
+        int center_y = (left_y + right_y) / 2;
+        GLuint center = vertex(center_x, center_y, node->base_neighbor && node->base_neighbor->left_child);
 
-    node->left_child->base_neighbor = node->left_neighbor;
-    node->left_child->left_neighbor = node->right_child;
+        forEachIndexedRecursive(
+            node->left_child, vertex, emit,
+            apex_x, apex_y, left_x, left_y, center_x, center_y,
+            apex, left, center);
+        forEachIndexedRecursive(
+            node->right_child, vertex, emit,
+            right_x, right_y, apex_x, apex_y, center_x, center_y,
+            right, apex, center);
+    } else {
+        emit(left, right, apex);
+    }
+}
 
-    node->right_child->base_neighbor = node->right_neighbor;
-    node->right_child->right_neighbor = node->left_child;
+template <typename VertexFunc, typename LeafFunc>
+void TerrainPatch::forEachIndexedCompact(
+    uint32_t node, VertexFunc &vertex, LeafFunc &emit,
+    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
+    GLuint left, GLuint right, GLuint apex)
+{
+    uint32_t children = m_compactPool[node].children;
+    if (children) {
+        int center_x = (left_x + right_x) / 2;
+        int center_y = (left_y + right_y) / 2;
+        uint32_t base = m_compactPool[node].base_neighbor;
+        GLuint center = vertex(center_x, center_y, base != BTT_COMPACT_NULL && m_compactPool[base].children);
 
-    // link left neighbor to the new children
-    if (node->left_neighbor) {
-        if (node->left_neighbor->base_neighbor == node)
-            node->left_neighbor->base_neighbor = node->left_child;
-        else if (node->left_neighbor->left_neighbor == node)
-            node->left_neighbor->left_neighbor = node->left_child;
-        else if (node->left_neighbor->right_neighbor == node)
-            node->left_neighbor->right_neighbor = node->left_child;
+        forEachIndexedCompact(
+            children, vertex, emit,
+            apex_x, apex_y, left_x, left_y, center_x, center_y,
+            apex, left, center);
+        forEachIndexedCompact(
+            children+1, vertex, emit,
+            right_x, right_y, apex_x, apex_y, center_x, center_y,
+            right, apex, center);
+    } else {
+        emit(left, right, apex);
     }
+}
 
-    // link right neighbor to the new children
-    if (node->right_neighbor) {
-        if (node->right_neighbor->base_neighbor == node)
-            node->right_neighbor->base_neighbor = node->right_child;
-        else if (node->right_neighbor->right_neighbor == node)
-            node->right_neighbor->right_neighbor = node->right_child;
-        else if (node->right_neighbor->left_neighbor == node)
-            node->right_neighbor->left_neighbor = node->right_child;
+template <typename VertexFunc>
+size_t TerrainPatch::forEachIndexedLeaf(GLuint *indices, VertexFunc &newVertex)
+{
+    Heightmap *map = m_map;
+    // slots are carried down the walk: a split center is a new vertex unless the
+    // base neighbour split too, only those shared ones are looked up. The table
+    // holds (texel, slot) pairs with open addressing, at most one per inner node,
+    // so it is sized by the tessellation rather than the map
+    int bits = 6;
+    while (((size_t)1 << bits) < 2*(m_leftLeaves + m_rightLeaves + 2)) {
+        bits++;
     }
+    m_vertexLookup.assign((size_t)2 << bits, UINT_MAX);
 
-    // link base neighbor to the new children
-    if (node->base_neighbor) {
-        if (node->base_neighbor->left_child) {
-            node->base_neighbor->left_child->right_neighbor = node->right_child;
-            node->base_neighbor->right_child->left_neighbor = node->left_child;
-            node->left_child->right_neighbor = node->base_neighbor->right_child;
-            node->right_child->left_neighbor = node->base_neighbor->left_child;
-        } else {
-            split(node->base_neighbor);
+    GLuint count = 0;
+    auto vertex = [&](int x, int y, bool shared) -> GLuint {
+        if (shared) {
+            GLuint key = (GLuint)(map->width*y + x);
+            size_t mask = ((size_t)1 << bits) - 1;
+            size_t i = (key * 2654435761u) >> (32 - bits);
+            for (; m_vertexLookup[2*i] != UINT_MAX; i = (i + 1) & mask) {
+                if (m_vertexLookup[2*i] == key) {
+                    return m_vertexLookup[2*i + 1];
+                }
+            }
+            m_vertexLookup[2*i] = key;
+            m_vertexLookup[2*i + 1] = count;
         }
+        newVertex(count, x, y);
+        return count++;
+    };
+    size_t idx = 0;
+    auto emit = [&](GLuint left, GLuint right, GLuint apex) {
+        indices[idx+0] = left;
+        indices[idx+1] = right;
+        indices[idx+2] = apex;
+        idx += 3;
+    };
+
+    int w = map->width-1, h = map->height-1;
+    GLuint bottom_left = vertex(0, h, false);
+    GLuint top_right = vertex(w, 0, false);
+    GLuint top_left = vertex(0, 0, false);
+    GLuint bottom_right = vertex(w, h, false);
+    if (m_compactPool) {
+        forEachIndexedCompact(1, vertex, emit, 0, h, w, 0, 0, 0, bottom_left, top_right, top_left);
+        forEachIndexedCompact(2, vertex, emit, w, 0, 0, h, w, h, top_right, bottom_left, bottom_right);
     } else {
-        // edge triangle
-        node->left_child->right_neighbor = nullptr;
-        node->right_child->left_neighbor = nullptr;
+        forEachIndexedRecursive(m_leftRoot, vertex, emit, 0, h, w, 0, 0, 0, bottom_left, top_right, top_left);
+        forEachIndexedRecursive(m_rightRoot, vertex, emit, w, 0, 0, h, w, h, top_right, bottom_left, bottom_right);
     }
+    return count;
 }
 
-void TerrainPatch::tessellateRecursive(
-    BTTNode *node, const glm::vec3 &view, float errorMargin,
-    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
-    float *variance_tree, int variance_idx, Heightmap *map)
+size_t TerrainPatch::getIndexedTessellation(float *vertices, GLuint *indices)
+{
+    Heightmap *map = m_map;
+    auto vertex = [&](GLuint slot, int x, int y) {
+        float *v = &vertices[slot*3];
+        v[0] = x /(float) (map->width - 1);
+        v[1] = y /(float) (map->height - 1);
+        v[2] = Heightmap_get(map, x, y);
+    };
+    return forEachIndexedLeaf(indices, vertex);
+}
+
+// heightmap texel -> vertex on the unit sphere, pushed out radially by the height,
+// so faces sharing an edge put its vertices on the same points
+static VertexPositionNormalTexture meshVertex(const Heightmap *map, int x, int y, float z)
 {
-    if (variance_idx < m_varianceSize) {
-        float center_x = (left_x + right_x) * 0.5f;
-        float center_y = (left_y + right_y) * 0.5f;
+    VertexPositionNormalTexture v;
+    v.Uv = glm::vec2(x /(float) (map->width - 1), y /(float) (map->height - 1));
+    v.Normal = normalize(glm::vec3(v.Uv.x - 0.5, v.Uv.y - 0.5, -0.5));
+    v.Position = v.Normal * ((99+z)/100.0f);
+    return v;
+}
 
-        auto point = normalize(glm::vec3(center_x/m_map->width-0.5, center_y/m_map->height-0.5, -0.5));
-        float distance = 1 + glm::distance(point, view);
-        float variance = variance_tree[variance_idx]/distance;
-        
-        //if(view.z > 1) {
-        //	variance /= view.z;
-        //}
+static VertexPositionNormalTexture meshVertex(Heightmap *map, int x, int y)
+{
+    return meshVertex(map, x, y, Heightmap_get(map, x, y));
+}
 
-        if (variance > errorMargin || variance_idx < 32) {
-            split(node);
-            if (node->left_child && ((abs(left_x - right_x) >= 3) || (abs(left_y - right_y) >= 3)))
-            {
-                tessellateRecursive(
-                    node->left_child, view, errorMargin*distance,
-                    apex_x, apex_y, left_x, left_y, center_x, center_y,
-                    variance_tree, (variance_idx<<1), map);
-                tessellateRecursive(
-                    node->right_child, view, errorMargin*distance,
-                    right_x, right_y, apex_x, apex_y, center_x, center_y,
-                    variance_tree, (variance_idx<<1)+1, map);
-            }
+void TerrainPatch::getMesh(std::vector<VertexPositionNormalTexture> &verteces, std::vector<GLuint> &indeces, bool indexed,
+    std::vector<MorphTarget> *morphs)
+{
+    Heightmap *map = m_map;
+    size_t leaves = m_leftLeaves + m_rightLeaves;
+    indeces.resize(leaves*3);
+    if (leaves == 0) {
+        verteces.clear();
+        if (morphs) {
+            morphs->clear();
         }
+        return;
+    }
+
+    if (indexed) {
+        // a conforming tessellation never has more vertices than leaves + 2,
+        // slots come in order so a patch that does not conform only reallocates
+        verteces.clear();
+        verteces.reserve(leaves + 2);
+        auto vertex = [&](GLuint slot, int x, int y) {
+            assert(slot == verteces.size());
+            verteces.push_back(meshVertex(map, x, y));
+        };
+        forEachIndexedLeaf(&indeces[0], vertex);
+    } else {
+        verteces.resize(leaves*3);
+        size_t idx = 0;
+        auto emit = [&](int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) {
+            verteces[idx+0] = meshVertex(map, left_x, left_y);
+            verteces[idx+1] = meshVertex(map, right_x, right_y);
+            verteces[idx+2] = meshVertex(map, apex_x, apex_y);
+            indeces[idx+0] = (GLuint)(idx+0);
+            indeces[idx+1] = (GLuint)(idx+1);
+            indeces[idx+2] = (GLuint)(idx+2);
+            idx += 3;
+        };
+        forEachLeaf(emit);
+    }
+
+    if (morphs) {
+        morphTargets(verteces, *morphs);
     }
 }
 
-void TerrainPatch::computeVarianceRecursive(
-    int maxTessellationLevels, int level, float *varianceTree, int idx, Heightmap *map,
-    int left_x, int left_y, float left_z,
-    int right_x, int right_y, float right_z,
-    int apex_x, int apex_y, float apex_z)
+glm::vec3 TerrainPatch::morphFrom(GLuint key, const std::unordered_map<GLuint, std::pair<GLuint, GLuint>> &parents,
+    std::unordered_map<GLuint, glm::vec3> &from)
 {
-    int center_x = (left_x + right_x) / 2;
-    int center_y = (left_y + right_y) / 2;
-    float center_z = Heightmap_get(map, center_x, center_y);
+    auto known = from.find(key);
+    if (known != from.end()) {
+        return known->second;
+    }
+    glm::vec3 position;
+    auto parent = parents.find(key);
+    if (parent == parents.end()) {
+        // in the previous mesh too, it is where it was
+        position = meshVertex(m_map, key % m_map->width, key / m_map->width).Position;
+    } else {
+        // the endpoints may be new as well, they start on the coarser surface too
+        position = (morphFrom(parent->second.first, parents, from) + morphFrom(parent->second.second, parents, from)) * 0.5f;
+    }
+    from[key] = position;
+    return position;
+}
+
+void TerrainPatch::morphTargets(const std::vector<VertexPositionNormalTexture> &verteces, std::vector<MorphTarget> &morphs)
+{
+    // 1 - texel is a vertex of the previous mesh, 2 - of this one
+    size_t width = m_map->width;
+    bool first = m_morphTexels.size() != width*m_map->height;
+    if (first) {
+        m_morphTexels.assign(width*m_map->height, 0);
+        m_morphKeys.clear();
+    }
+    std::vector<GLuint> keys(verteces.size());
+    for (size_t i = 0; i < verteces.size(); i++) {
+        int x = (int)(verteces[i].Uv.x * (width - 1) + 0.5f);
+        int y = (int)(verteces[i].Uv.y * (m_map->height - 1) + 0.5f);
+        keys[i] = (GLuint)(width*y + x);
+        m_morphTexels[keys[i]] |= 2;
+    }
+
+    morphs.clear();
+    if (!first) {
+        // the edge every new vertex split
+        std::unordered_map<GLuint, std::pair<GLuint, GLuint>> parents;
+        auto leaf = [](int, int, int, int, int, int) {};
+        auto split = [&](int left_x, int left_y, int right_x, int right_y) {
+            GLuint center = (GLuint)(width*((left_y + right_y) / 2) + (left_x + right_x) / 2);
+            if (m_morphTexels[center] == 2) {
+                parents[center] = std::make_pair((GLuint)(width*left_y + left_x), (GLuint)(width*right_y + right_x));
+            }
+        };
+        forEachNode(leaf, split);
+
+        std::unordered_map<GLuint, glm::vec3> from;
+        for (size_t i = 0; i < verteces.size(); i++) {
+            if (m_morphTexels[keys[i]] == 2) {
+                MorphTarget target;
+                target.index = (GLuint)i;
+                target.from = morphFrom(keys[i], parents, from);
+                target.to = verteces[i].Position;
+                morphs.push_back(target);
+            }
+        }
+    }
+
+    // this mesh is the previous one for the next call
+    for (size_t i = 0; i < m_morphKeys.size(); i++) {
+        m_morphTexels[m_morphKeys[i]] = 0;
+    }
+    m_morphKeys.swap(keys);
+    for (size_t i = 0; i < m_morphKeys.size(); i++) {
+        m_morphTexels[m_morphKeys[i]] = 1;
+    }
+}
+
+void TerrainPatch::morph(float t)
+{
+    if (Morphs.empty()) {
+        return;
+    }
+    t = glm::clamp(t, 0.0f, 1.0f);
+    std::vector<VertexPositionNormalTexture> &verteces = m->Verteces;
+    for (size_t i = 0; i < Morphs.size(); i++) {
+        const MorphTarget &target = Morphs[i];
+        if (target.index < verteces.size()) {
+            verteces[target.index].Position = target.from + (target.to - target.from) * t;
+            verteces[target.index].Normal = normalize(verteces[target.index].Position);
+        }
+    }
+    if (t >= 1) {
+        Morphs.clear();
+    }
+}
+
+void TerrainPatch::setCompactPool(bool compact)
+{
+    if (compact == compactPool()) {
+        return;
+    }
+
+    delete [] m_nodeInfo;
+    m_nodeInfo = nullptr;
+    m_freeNodes.clear();
+
+    if (compact) {
+        delete [] m_triPool;
+        m_triPool = nullptr;
+        m_leftRoot = m_rightRoot = nullptr;
+        m_compactPool = new BTTCompactNode[m_poolSize];
+    } else {
+        delete [] m_compactPool;
+        m_compactPool = nullptr;
+        m_triPool = new BTTNode[m_poolSize];
+        m_poolNext = 0;
+        m_leftRoot = allocateNode();
+        m_rightRoot = allocateNode();
+    }
+    reset();
+    m_leftLeaves = m_rightLeaves = 0;
+}
+
+size_t TerrainPatch::poolBytes() const
+{
+    return m_poolSize * (m_compactPool ? sizeof(BTTCompactNode) : sizeof(BTTNode));
+}
+
+BTTNode *TerrainPatch::allocateNode()
+{
+    BTTNode *tri;
+
+    if (!m_freeNodes.empty()) {
+        tri = m_freeNodes.back();
+        m_freeNodes.pop_back();
+    } else {
+        if (m_poolNext >= m_poolSize) {
+            return nullptr;
+        }
+        tri = &m_triPool[m_poolNext++];
+    }
+    tri->left_child = tri->right_child = nullptr;
+
+    return tri;
+}
+
+TerrainPatch *TerrainPatch::nodeOwner(BTTNode *node)
+{
+    if (ownsNode(node)) {
+        return this;
+    }
+    // a neighbour of a node is always in this patch or across one of its borders
+    for (int i = 0; i < 4; i++) {
+        if (m_linkPatch[i] && m_linkPatch[i]->ownsNode(node)) {
+            return m_linkPatch[i];
+        }
+    }
+    return nullptr;
+}
+
+BTTNode *TerrainPatch::edgeRoot(int edge) const
+{
+    return edge == PATCH_EDGE_X0 || edge == PATCH_EDGE_Y0 ? m_leftRoot : m_rightRoot;
+}
+
+// end of a patch border on the unit sphere, in the space m->World maps to
+static glm::vec3 edgePoint(const TerrainPatch *patch, int edge, int end)
+{
+    // PatchEdge order: x == 0, y == 0, x == 1, y == 1
+    static const float corners[4][4] = {
+        {0, 0, 0, 1},
+        {0, 0, 1, 0},
+        {1, 0, 1, 1},
+        {0, 1, 1, 1}
+    };
+    glm::vec3 local = normalize(glm::vec3(corners[edge][end*2] - 0.5f, corners[edge][end*2+1] - 0.5f, -0.5f));
+    return normalize(glm::mat3(patch->m->World) * local);
+}
+
+void TerrainPatch::linkPatches(const std::vector<TerrainPatch*> &patches)
+{
+    for (size_t i = 0; i < patches.size(); i++) {
+        // handles of the compact pool can not point into another pool
+        patches[i]->setCompactPool(false);
+        for (int e = 0; e < 4; e++) {
+            patches[i]->m_linkPatch[e] = nullptr;
+        }
+    }
+
+    const float eps = 1e-4f;
+    for (size_t i = 0; i < patches.size(); i++) {
+        for (int e = 0; e < 4; e++) {
+            glm::vec3 a0 = edgePoint(patches[i], e, 0), a1 = edgePoint(patches[i], e, 1);
+            for (size_t j = 0; j < patches.size() && !patches[i]->m_linkPatch[e]; j++) {
+                // splits only meet across the border on maps of the same size
+                if (j == i || patches[j]->m_map->width != patches[i]->m_map->width ||
+                    patches[j]->m_map->height != patches[i]->m_map->height) {
+                    continue;
+                }
+                for (int f = 0; f < 4; f++) {
+                    glm::vec3 b0 = edgePoint(patches[j], f, 0), b1 = edgePoint(patches[j], f, 1);
+                    // corner order in edgePoint is arbitrary; the children line up across
+                    // the border as long as no World mirrors the patch (same winding)
+                    if ((glm::distance(a0, b0) < eps && glm::distance(a1, b1) < eps) ||
+                        (glm::distance(a0, b1) < eps && glm::distance(a1, b0) < eps)) {
+                        patches[i]->m_linkPatch[e] = patches[j];
+                        patches[i]->m_linkEdge[e] = f;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < patches.size(); i++) {
+        patches[i]->reset();
+    }
+}
+
+void TerrainPatch::unlinkPatches(const std::vector<TerrainPatch*> &patches)
+{
+    for (size_t i = 0; i < patches.size(); i++) {
+        for (int e = 0; e < 4; e++) {
+            patches[i]->m_linkPatch[e] = nullptr;
+        }
+    }
+    for (size_t i = 0; i < patches.size(); i++) {
+        patches[i]->reset();
+    }
+}
+
+int TerrainPatch::linkedEdges() const
+{
+    int count = 0;
+    for (int e = 0; e < 4; e++) {
+        if (m_linkPatch[e]) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void TerrainPatch::tessellateLinked(const std::vector<TerrainPatch*> &patches, const std::vector<glm::vec3> &views,
+    float errorMargin, const std::vector<Frustum> &frusta, bool horizon, float projectionScale)
+{
+    // forced splits reach into the neighbours, so every tree is reset before any is refined
+    for (size_t i = 0; i < patches.size(); i++) {
+        patches[i]->reset();
+    }
+    for (size_t i = 0; i < patches.size() && i < views.size(); i++) {
+        patches[i]->tessellate(views[i], errorMargin, i < frusta.size() ? &frusta[i] : nullptr, horizon, projectionScale);
+    }
+    // later patches split leaves of the earlier ones
+    for (size_t i = 0; i < patches.size(); i++) {
+        patches[i]->m_leftLeaves = BTTNode_number_of_leaves(patches[i]->m_leftRoot);
+        patches[i]->m_rightLeaves = BTTNode_number_of_leaves(patches[i]->m_rightRoot);
+    }
+}
+
+uint32_t TerrainPatch::allocateCompactPair()
+{
+    if (m_compactNext + 2 > m_poolSize) {
+        return BTT_COMPACT_NULL;
+    }
+
+    uint32_t children = m_compactNext;
+    m_compactNext += 2;
+    memset(&m_compactPool[children], 0, 2*sizeof(BTTCompactNode));
+
+    return children;
+}
+
+void TerrainPatch::freeNode(BTTNode *node)
+{
+    if (!node) {
+        return;
+    }
+    if (m_nodeInfo) {
+        // variance_idx 0 marks dead nodes, live ones start at 1
+        m_nodeInfo[node - m_triPool].variance_idx = 0;
+    }
+    m_freeNodes.push_back(node);
+}
+
+void TerrainPatch::split(BTTNode *node)
+{
+    if (node->left_child)
+        return;
+
+    if (!ownsNode(node)) {
+        // forced split across a linked border, the neighbour allocates from its own pool
+        TerrainPatch *owner = nodeOwner(node);
+        if (owner) {
+            owner->split(node);
+        }
+        return;
+    }
+
+    if (node->base_neighbor && node->base_neighbor->base_neighbor != node) {
+        split(node->base_neighbor);
+    }
+
+    node->left_child = allocateNode();
+    node->right_child = allocateNode();
+
+    if (!node->left_child || !node->right_child) {
+        freeNode(node->left_child);
+        freeNode(node->right_child);
+        node->left_child = node->right_child = nullptr;
+        return;
+    }
+
+    if (m_updating) {
+        onSplit(node);
+    }
+
+    node->left_child->base_neighbor = node->left_neighbor;
+    node->left_child->left_neighbor = node->right_child;
+
+    node->right_child->base_neighbor = node->right_neighbor;
+    node->right_child->right_neighbor = node->left_child;
+
+    // link left neighbor to the new children
+    if (node->left_neighbor) {
+        if (node->left_neighbor->base_neighbor == node)
+            node->left_neighbor->base_neighbor = node->left_child;
+        else if (node->left_neighbor->left_neighbor == node)
+            node->left_neighbor->left_neighbor = node->left_child;
+        else if (node->left_neighbor->right_neighbor == node)
+            node->left_neighbor->right_neighbor = node->left_child;
+    }
+
+    // link right neighbor to the new children
+    if (node->right_neighbor) {
+        if (node->right_neighbor->base_neighbor == node)
+            node->right_neighbor->base_neighbor = node->right_child;
+        else if (node->right_neighbor->right_neighbor == node)
+            node->right_neighbor->right_neighbor = node->right_child;
+        else if (node->right_neighbor->left_neighbor == node)
+            node->right_neighbor->left_neighbor = node->right_child;
+    }
+
+    // link base neighbor to the new children
+    if (node->base_neighbor) {
+        if (node->base_neighbor->left_child) {
+            node->base_neighbor->left_child->right_neighbor = node->right_child;
+            node->base_neighbor->right_child->left_neighbor = node->left_child;
+            node->left_child->right_neighbor = node->base_neighbor->right_child;
+            node->right_child->left_neighbor = node->base_neighbor->left_child;
+        } else {
+            split(node->base_neighbor);
+        }
+    } else {
+        // edge triangle
+        node->left_child->right_neighbor = nullptr;
+        node->right_child->left_neighbor = nullptr;
+    }
+}
+
+void TerrainPatch::splitCompact(uint32_t n)
+{
+    BTTCompactNode *pool = m_compactPool;
+    BTTCompactNode *node = &pool[n];
+
+    if (node->children)
+        return;
+
+    if (node->base_neighbor && pool[node->base_neighbor].base_neighbor != n) {
+        splitCompact(node->base_neighbor);
+    }
+
+    uint32_t l = allocateCompactPair();
+    if (!l) {
+        return;
+    }
+    uint32_t r = l + 1;
+    node->children = l;
+
+    pool[l].base_neighbor = node->left_neighbor;
+    pool[l].left_neighbor = r;
+
+    pool[r].base_neighbor = node->right_neighbor;
+    pool[r].right_neighbor = l;
+
+    // link left neighbor to the new children
+    if (node->left_neighbor) {
+        BTTCompactNode *neighbor = &pool[node->left_neighbor];
+        if (neighbor->base_neighbor == n)
+            neighbor->base_neighbor = l;
+        else if (neighbor->left_neighbor == n)
+            neighbor->left_neighbor = l;
+        else if (neighbor->right_neighbor == n)
+            neighbor->right_neighbor = l;
+    }
+
+    // link right neighbor to the new children
+    if (node->right_neighbor) {
+        BTTCompactNode *neighbor = &pool[node->right_neighbor];
+        if (neighbor->base_neighbor == n)
+            neighbor->base_neighbor = r;
+        else if (neighbor->right_neighbor == n)
+            neighbor->right_neighbor = r;
+        else if (neighbor->left_neighbor == n)
+            neighbor->left_neighbor = r;
+    }
+
+    // link base neighbor to the new children
+    if (node->base_neighbor) {
+        uint32_t base_children = pool[node->base_neighbor].children;
+        if (base_children) {
+            pool[base_children].right_neighbor = r;
+            pool[base_children+1].left_neighbor = l;
+            pool[l].right_neighbor = base_children+1;
+            pool[r].left_neighbor = base_children;
+        } else {
+            splitCompact(node->base_neighbor);
+        }
+    } else {
+        // edge triangle
+        pool[l].right_neighbor = BTT_COMPACT_NULL;
+        pool[r].left_neighbor = BTT_COMPACT_NULL;
+    }
+}
+
+static inline float viewDistance(float center_x, float center_y, const glm::vec3 &view, const Heightmap *map)
+{
+    auto point = normalize(glm::vec3(center_x/map->width-0.5, center_y/map->height-0.5, -0.5));
+    return 1 + glm::distance(point, view);
+}
+
+// surface points stay between these radii in patch space: vertices are pushed
+// out radially to (99+height)/100, coarse chords sag a little below that.
+// The planet is taken to occlude up to TERRAIN_MIN_RADIUS, triangles without
+// a heightmap pyramid are bounded by both
+#define TERRAIN_MIN_RADIUS 0.98f
+#define TERRAIN_MAX_RADIUS 1.0f
+// vertex displacement per unit of height
+#define TERRAIN_HEIGHT_SCALE 0.01f
+// views closer than this to a triangle bound count as this close
+#define TERRAIN_NEAR_DISTANCE 1e-4f
+
+int TerrainPatch::cullRoot() const
+{
+    return (m_cullFrustum || m_cullHorizon) ? INERSECT_INTERSECT : INERSECT_IN;
+}
+
+int TerrainPatch::cullTest(int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const
+{
+    // the triangle covers a spherical triangle, bound it by a cap around d
+    float w = (float)(m_map->width - 1), h = (float)(m_map->height - 1);
+    glm::vec3 a = normalize(glm::vec3(left_x/w - 0.5f, left_y/h - 0.5f, -0.5f));
+    glm::vec3 b = normalize(glm::vec3(right_x/w - 0.5f, right_y/h - 0.5f, -0.5f));
+    glm::vec3 c = normalize(glm::vec3(apex_x/w - 0.5f, apex_y/h - 0.5f, -0.5f));
+    glm::vec3 d = normalize(a + b + c);
+    float cos_cap = MIN(dot(d, a), MIN(dot(d, b), dot(d, c)));
+    float cap = acosf(MIN(cos_cap, 1.0f));
+
+    // radii of the heights under the triangle, its flat descendants lie
+    // inside the cap no deeper than cos_cap below the lowest one
+    float min_radius = TERRAIN_MIN_RADIUS, max_radius = TERRAIN_MAX_RADIUS;
+    float low_z, high_z;
+    if (Heightmap_range_bound(m_map, MIN(left_x, MIN(right_x, apex_x)), MIN(left_y, MIN(right_y, apex_y)),
+        MAX(left_x, MAX(right_x, apex_x)), MAX(left_y, MAX(right_y, apex_y)), &low_z, &high_z)) {
+        min_radius = (99 + low_z) / 100.0f * cos_cap;
+        max_radius = (99 + high_z) / 100.0f;
+    }
+
+    int result = INERSECT_IN;
+    if (m_cullHorizon) {
+        float view_distance = length(m_view);
+        if (view_distance > TERRAIN_MIN_RADIUS) {
+            // a point is hidden by the occluding sphere once its angle from the view
+            // direction is above the sum of both tangent angles
+            float angle = acosf(glm::clamp(dot(d, m_view) / view_distance, -1.0f, 1.0f));
+            float horizon = acosf(TERRAIN_MIN_RADIUS / view_distance) +
+                acosf(MIN(TERRAIN_MIN_RADIUS / max_radius, 1.0f));
+            if (angle - cap > horizon) {
+                return INERSECT_OUT;
+            }
+            if (angle + cap > horizon) {
+                result = INERSECT_INTERSECT;
+            }
+        }
+    }
+    if (m_cullFrustum) {
+        // sphere around the cap shell between the two radii
+        float sin_cap = sqrtf(MAX(0.0f, 1 - cos_cap*cos_cap));
+        float half_depth = (max_radius - min_radius*cos_cap) * 0.5f;
+        glm::vec3 center = d * (max_radius - half_depth);
+        float radius = sqrtf(half_depth*half_depth + sin_cap*sin_cap*max_radius*max_radius);
+        int frustum = m_cullFrustum->ContainsSphere(center, radius);
+        if (frustum == INERSECT_OUT) {
+            return INERSECT_OUT;
+        }
+        if (frustum == INERSECT_INTERSECT) {
+            result = INERSECT_INTERSECT;
+        }
+    }
+    return result;
+}
+
+static inline float nodeDistance(const BTTNodeInfo &info, const glm::vec3 &view, const Heightmap *map)
+{
+    return viewDistance((info.left_x + info.right_x) * 0.5f, (info.left_y + info.right_y) * 0.5f, view, map);
+}
+
+// camera travel a refresh bucket spans and the buckets in the wheel, a lap is 8
+// planet radii; deadlines further ahead share slots with nearer ones
+#define TERRAIN_REFRESH_STEP (1.0/512)
+#define TERRAIN_REFRESH_BUCKETS 4096
+
+float TerrainPatch::childScale(const BTTNodeInfo &info, float scale) const
+{
+    if (m_projectionScale > 0) {
+        return MAX(scale, screenDistance(m_view, info.left_x, info.left_y, info.right_x, info.right_y));
+    }
+    return scale * nodeDistance(info, m_view, m_map);
+}
+
+void TerrainPatch::invalidatePriorities()
+{
+    m_refreshAll = true;
+}
+
+void TerrainPatch::update(const glm::vec3 &view, float errorMargin, size_t maxTriangles, float maxMilliseconds,
+    const Frustum *frustum, bool horizon, float projectionScale)
+{
+    if (m_compactPool) {
+        reset();
+        tessellate(view, errorMargin, frustum, horizon, projectionScale);
+        return;
+    }
+    if (m_nodeInfo == nullptr) {
+        initIncremental();
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    auto overBudget = [&]() -> bool {
+        auto now = std::chrono::high_resolution_clock::now();
+        return maxMilliseconds > 0 &&
+            std::chrono::duration_cast<std::chrono::microseconds>(now - start).count() > maxMilliseconds*1000;
+    };
+
+    // kept priorities are only known to be on the right side of this margin in this metric
+    if (errorMargin != m_errorMargin || projectionScale != m_projectionScale ||
+        (frustum != nullptr) != (m_cullFrustum != nullptr) || horizon != m_cullHorizon) {
+        m_refreshAll = true;
+    }
+    m_cullFrustum = frustum;
+    m_cullHorizon = horizon;
+    if (frustum || horizon) {
+        buildPyramid();
+    }
+    m_projectionScale = projectionScale;
+    m_errorMargin = errorMargin;
+    m_touched.clear();
+    // splits keep the node state from here on
+    m_updating = true;
+    m_stamp++;
+
+    if (m_refreshAll) {
+        // every priority for the new view, leaves are recounted on the way
+        m_view = view;
+        m_travel = 0;
+        m_splitQueue.clear();
+        m_mergeQueue.clear();
+        for (size_t i = 0; i < m_refreshWheel.size(); i++) {
+            m_refreshWheel[i].clear();
+        }
+        m_refreshBucket = 0;
+        m_refreshEntries = 0;
+        m_leftLeaves = m_rightLeaves = 0;
+
+        m_nodeInfo[m_leftRoot - m_triPool].scale = m_nodeInfo[m_rightRoot - m_triPool].scale = m_projectionScale > 0 ? 0 : 1;
+        m_nodeInfo[m_leftRoot - m_triPool].stamp = m_nodeInfo[m_rightRoot - m_triPool].stamp = m_stamp;
+        std::vector<BTTNode*> diamonds;
+        refreshRecursive(m_leftRoot, view, diamonds, cullRoot());
+        refreshRecursive(m_rightRoot, view, diamonds, cullRoot());
+        std::make_heap(m_splitQueue.begin(), m_splitQueue.end());
+
+        // diamond priority needs both halves refreshed, so they are queued after the walk
+        for (size_t i = 0; i < diamonds.size(); i++) {
+            m_mergeQueue.push_back(std::make_pair(diamondPriority(diamonds[i]), diamonds[i]));
+        }
+        std::make_heap(m_mergeQueue.begin(), m_mergeQueue.end(), std::greater<std::pair<float, BTTNode*>>());
+        m_refreshAll = false;
+    } else {
+        // a distance in the metric changes by at most as much as the view, a node is
+        // due once the travel since its refresh could have taken it across the margin
+        m_travel += glm::distance(view, m_view);
+        m_view = view;
+        compactQueues();
+
+        if (cullRoot() == INERSECT_INTERSECT) {
+            refreshVisibility(m_leftRoot, INERSECT_INTERSECT);
+            refreshVisibility(m_rightRoot, INERSECT_INTERSECT);
+        }
+        pushTouched();
+
+        // buckets up to the one m_travel is in, a slot can also hold buckets a lap
+        // ahead, every entry is checked against its own deadline. Refreshed nodes
+        // get deadlines at or past m_travel, they are not due again
+        uint64_t current = (uint64_t)(m_travel / TERRAIN_REFRESH_STEP);
+        uint64_t last = MIN(current, m_refreshBucket + TERRAIN_REFRESH_BUCKETS - 1);
+        for (uint64_t bucket = m_refreshBucket; bucket <= last && !overBudget(); bucket++) {
+            std::vector<std::pair<double, BTTNode*>> &slot = m_refreshWheel[bucket % TERRAIN_REFRESH_BUCKETS];
+            size_t kept = 0;
+            for (size_t i = 0; i < slot.size(); i++) {
+                BTTNode *node = slot[i].second;
+                const BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+                if (info.variance_idx == 0 || info.deadline != slot[i].first || !onFrontier(node)) {
+                    continue;
+                }
+                if (slot[i].first < m_travel) {
+                    m_touched.push_back(node);
+                } else {
+                    slot[kept++] = slot[i];
+                }
+            }
+            m_refreshEntries -= slot.size() - kept;
+            slot.resize(kept);
+            pushTouched();
+            m_refreshBucket = bucket == last ? current : bucket + 1;
+        }
+    }
+
+    bool coarsening = false;
+    for (int ops = 0; ; ops++) {
+        if ((ops & 31) == 0 && overBudget()) {
+            break;
+        }
+
+        // drop entries that went stale after earlier splits, merges and refreshes
+        while (!m_splitQueue.empty()) {
+            BTTNode *top = m_splitQueue.front().second;
+            const BTTNodeInfo &info = m_nodeInfo[top - m_triPool];
+            if (info.variance_idx != 0 && !top->left_child && info.priority == m_splitQueue.front().first) {
+                break;
+            }
+            std::pop_heap(m_splitQueue.begin(), m_splitQueue.end());
+            m_splitQueue.pop_back();
+        }
+        while (!m_mergeQueue.empty()) {
+            BTTNode *top = m_mergeQueue.front().second;
+            if (m_nodeInfo[top - m_triPool].variance_idx != 0 && isMergeable(top) &&
+                diamondPriority(top) == m_mergeQueue.front().first) {
+                break;
+            }
+            std::pop_heap(m_mergeQueue.begin(), m_mergeQueue.end(), std::greater<std::pair<float, BTTNode*>>());
+            m_mergeQueue.pop_back();
+        }
+
+        size_t triangles = m_leftLeaves + m_rightLeaves;
+        if (maxTriangles > 0 && triangles > maxTriangles) {
+            // over budget, coarsen the least important diamonds and stop refining
+            if (m_mergeQueue.empty() || m_mergeQueue.front().first == FLT_MAX) {
+                break;
+            }
+            coarsening = true;
+            BTTNode *node = m_mergeQueue.front().second;
+            std::pop_heap(m_mergeQueue.begin(), m_mergeQueue.end(), std::greater<std::pair<float, BTTNode*>>());
+            m_mergeQueue.pop_back();
+            merge(node);
+        } else if (!coarsening && !m_splitQueue.empty() && m_splitQueue.front().first > errorMargin
+            && (maxTriangles == 0 || triangles + 2 <= maxTriangles)) {
+            BTTNode *node = m_splitQueue.front().second;
+            std::pop_heap(m_splitQueue.begin(), m_splitQueue.end());
+            m_splitQueue.pop_back();
+            split(node);
+            if (!node->left_child) {
+                // pool exhausted
+                break;
+            }
+        } else if (!m_mergeQueue.empty() && m_mergeQueue.front().first < errorMargin) {
+            BTTNode *node = m_mergeQueue.front().second;
+            std::pop_heap(m_mergeQueue.begin(), m_mergeQueue.end(), std::greater<std::pair<float, BTTNode*>>());
+            m_mergeQueue.pop_back();
+            merge(node);
+        } else {
+            break;
+        }
+        pushTouched();
+    }
+    m_updating = false;
+}
+
+void TerrainPatch::compactQueues()
+{
+    // stale entries only leave a queue when they come to its top, rebuild
+    // the queues before they outgrow the tree
+    size_t leaves = m_leftLeaves + m_rightLeaves;
+    if (m_splitQueue.size() > 2*leaves + 256) {
+        auto stale = [&](const std::pair<float, BTTNode*> &entry) {
+            const BTTNodeInfo &info = m_nodeInfo[entry.second - m_triPool];
+            return info.variance_idx == 0 || entry.second->left_child || info.priority != entry.first;
+        };
+        m_splitQueue.erase(std::remove_if(m_splitQueue.begin(), m_splitQueue.end(), stale), m_splitQueue.end());
+        std::make_heap(m_splitQueue.begin(), m_splitQueue.end());
+    }
+    if (m_mergeQueue.size() > 2*leaves + 256) {
+        auto stale = [&](const std::pair<float, BTTNode*> &entry) {
+            return m_nodeInfo[entry.second - m_triPool].variance_idx == 0 || !isMergeable(entry.second) ||
+                diamondPriority(entry.second) != entry.first;
+        };
+        m_mergeQueue.erase(std::remove_if(m_mergeQueue.begin(), m_mergeQueue.end(), stale), m_mergeQueue.end());
+        std::make_heap(m_mergeQueue.begin(), m_mergeQueue.end(), std::greater<std::pair<float, BTTNode*>>());
+    }
+    if (m_refreshEntries > 4*leaves + 256) {
+        auto stale = [&](const std::pair<double, BTTNode*> &entry) {
+            const BTTNodeInfo &info = m_nodeInfo[entry.second - m_triPool];
+            return info.variance_idx == 0 || info.deadline != entry.first || !onFrontier(entry.second);
+        };
+        m_refreshEntries = 0;
+        for (size_t i = 0; i < m_refreshWheel.size(); i++) {
+            std::vector<std::pair<double, BTTNode*>> &slot = m_refreshWheel[i];
+            slot.erase(std::remove_if(slot.begin(), slot.end(), stale), slot.end());
+            m_refreshEntries += slot.size();
+        }
+    }
+}
+
+void TerrainPatch::initIncremental()
+{
+    m_nodeInfo = new BTTNodeInfo[m_poolSize];
+    m_refreshWheel.resize(TERRAIN_REFRESH_BUCKETS);
+    reset();
+
+    BTTNodeInfo &left = m_nodeInfo[m_leftRoot - m_triPool];
+    left.parent = nullptr;
+    left.variance_idx = 1;
+    left.tree = 0;
+    left.scale = 1;
+    left.visible = INERSECT_IN;
+    left.deadline = DBL_MAX;
+    left.left_x = 0;                left.left_y = m_map->height-1;
+    left.right_x = m_map->width-1;  left.right_y = 0;
+    left.apex_x = 0;                left.apex_y = 0;
+
+    BTTNodeInfo &right = m_nodeInfo[m_rightRoot - m_triPool];
+    right.parent = nullptr;
+    right.variance_idx = 1;
+    right.tree = 1;
+    right.scale = 1;
+    right.visible = INERSECT_IN;
+    right.deadline = DBL_MAX;
+    right.left_x = m_map->width-1;  right.left_y = 0;
+    right.right_x = 0;              right.right_y = m_map->height-1;
+    right.apex_x = m_map->width-1;  right.apex_y = m_map->height-1;
+}
+
+void TerrainPatch::initChildren(BTTNode *node)
+{
+    const BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+    BTTNodeInfo &left = m_nodeInfo[node->left_child - m_triPool];
+    BTTNodeInfo &right = m_nodeInfo[node->right_child - m_triPool];
+    unsigned short center_x = (info.left_x + info.right_x) / 2;
+    unsigned short center_y = (info.left_y + info.right_y) / 2;
+
+    left.parent = right.parent = node;
+    left.tree = right.tree = info.tree;
+    left.visible = right.visible = info.visible;
+    left.deadline = right.deadline = DBL_MAX;
+    // for the current view refreshNode or refreshRecursive sets it
+    left.scale = right.scale = info.scale;
+    left.stamp = right.stamp = 0;
+    left.priority = right.priority = 0;
+
+    left.variance_idx = info.variance_idx<<1;
+    left.left_x = info.apex_x;   left.left_y = info.apex_y;
+    left.right_x = info.left_x;  left.right_y = info.left_y;
+    left.apex_x = center_x;      left.apex_y = center_y;
+
+    right.variance_idx = (info.variance_idx<<1)+1;
+    right.left_x = info.right_x; right.left_y = info.right_y;
+    right.right_x = info.apex_x; right.right_y = info.apex_y;
+    right.apex_x = center_x;     right.apex_y = center_y;
+}
+
+void TerrainPatch::onSplit(BTTNode *node)
+{
+    initChildren(node);
+    if (m_nodeInfo[node - m_triPool].tree == 0) {
+        m_leftLeaves++;
+    } else {
+        m_rightLeaves++;
+    }
+
+    m_touched.push_back(node);
+    m_touched.push_back(node->left_child);
+    m_touched.push_back(node->right_child);
+}
+
+void TerrainPatch::merge(BTTNode *node)
+{
+    BTTNode *base = node->base_neighbor;
+
+    mergeChildren(node);
+    m_touched.push_back(node);
+    if (m_nodeInfo[node - m_triPool].parent) {
+        m_touched.push_back(m_nodeInfo[node - m_triPool].parent);
+    }
+
+    if (base && base->left_child) {
+        mergeChildren(base);
+        m_touched.push_back(base);
+        if (m_nodeInfo[base - m_triPool].parent) {
+            m_touched.push_back(m_nodeInfo[base - m_triPool].parent);
+        }
+    }
+}
+
+static inline void relinkNeighbor(BTTNode *neighbor, BTTNode *from, BTTNode *to)
+{
+    if (!neighbor) {
+        return;
+    }
+    if (neighbor->base_neighbor == from)
+        neighbor->base_neighbor = to;
+    else if (neighbor->left_neighbor == from)
+        neighbor->left_neighbor = to;
+    else if (neighbor->right_neighbor == from)
+        neighbor->right_neighbor = to;
+}
+
+void TerrainPatch::mergeChildren(BTTNode *node)
+{
+    BTTNode *left = node->left_child;
+    BTTNode *right = node->right_child;
+
+    // children's bases are the only links leaving the diamond
+    node->left_neighbor = left->base_neighbor;
+    node->right_neighbor = right->base_neighbor;
+    relinkNeighbor(left->base_neighbor, left, node);
+    relinkNeighbor(right->base_neighbor, right, node);
+
+    node->left_child = node->right_child = nullptr;
+    freeNode(left);
+    freeNode(right);
+
+    if (m_nodeInfo[node - m_triPool].tree == 0) {
+        m_leftLeaves--;
+    } else {
+        m_rightLeaves--;
+    }
+}
+
+bool TerrainPatch::canSplit(BTTNode *node) const
+{
+    const BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+    if (info.variance_idx >= m_varianceSize) {
+        return false;
+    }
+    if (info.parent) {
+        // same size limit tessellateRecursive applies before descending
+        const BTTNodeInfo &parent = m_nodeInfo[info.parent - m_triPool];
+        return abs(parent.left_x - parent.right_x) >= 3 || abs(parent.left_y - parent.right_y) >= 3;
+    }
+    return true;
+}
+
+bool TerrainPatch::isMergeable(BTTNode *node) const
+{
+    if (!node->left_child || node->left_child->left_child || node->right_child->left_child) {
+        return false;
+    }
+    BTTNode *base = node->base_neighbor;
+    if (base && base->left_child) {
+        if (base->base_neighbor != node || base->left_child->left_child || base->right_child->left_child) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TerrainPatch::onFrontier(BTTNode *node) const
+{
+    // leaves and diamond halves, the nodes whose priority decides a split or a merge
+    return !node->left_child || (!node->left_child->left_child && !node->right_child->left_child);
+}
+
+float TerrainPatch::diamondPriority(BTTNode *node) const
+{
+    float priority = m_nodeInfo[node - m_triPool].priority;
+    if (node->base_neighbor) {
+        priority = MAX(priority, m_nodeInfo[node->base_neighbor - m_triPool].priority);
+    }
+    return priority;
+}
+
+float TerrainPatch::updatePriority(BTTNode *node, const glm::vec3 &view, int *cull)
+{
+    BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+    const VarianceTree &variance_tree = info.tree == 0 ? m_leftTree : m_rightTree;
+    float margin_scale;
+    float nearest = m_projectionScale > 0 ? info.scale : 0;
+    float error = nodeError(view, info.left_x, info.left_y, info.right_x, info.right_y,
+        variance_tree, info.variance_idx, &margin_scale, &nearest);
+
+    int visible = cull ? *cull : info.parent ? m_nodeInfo[info.parent - m_triPool].visible : cullRoot();
+    if (visible == INERSECT_INTERSECT) {
+        visible = cullTest(info.left_x, info.left_y, info.right_x, info.right_y, info.apex_x, info.apex_y);
+    }
+    if (cull) {
+        *cull = visible;
+    }
+    info.visible = (unsigned char)visible;
+
+    // tessellateRecursive refines the base levels of culled subtrees too
+    if (error == FLT_MAX) {
+        info.priority = FLT_MAX;
+    } else if (visible == INERSECT_OUT && info.variance_idx >= 32) {
+        info.priority = 0;
+    } else {
+        // the screen-space margin does not grow with depth, scale only bounds the distance
+        info.priority = m_projectionScale > 0 ? error : error/info.scale;
+    }
+    return m_projectionScale > 0 ? nearest : info.scale * margin_scale;
+}
+
+double TerrainPatch::refreshDistance(const BTTNodeInfo &info, float nearest) const
+{
+    // forced, flat and culled nodes keep their priority wherever the camera goes,
+    // refreshVisibility finds the culled ones that come into view
+    if (info.priority == FLT_MAX || info.priority == 0 || (info.visible == INERSECT_OUT && info.variance_idx >= 32)) {
+        return DBL_MAX;
+    }
+    double ratio = info.priority / (double)m_errorMargin;
+    double travel;
+    if (m_projectionScale > 0) {
+        // error over one distance D (a maximum of distances, each changing no faster
+        // than the view): D +- t keeps it on its side while t < D*|ratio - 1|
+        travel = nearest * fabs(ratio - 1);
+    } else {
+        // variance over the distances of the node and its ancestors, each at least 1:
+        // (1 +- t)^levels keeps it on its side while t < |ratio^(1/levels) - 1|
+        int levels = 1;
+        for (unsigned int idx = info.variance_idx; idx > 1; idx >>= 1) {
+            levels++;
+        }
+        travel = fabs(pow(ratio, 1.0 / levels) - 1);
+    }
+    // rounding of the priorities themselves
+    return travel * 0.99;
+}
+
+void TerrainPatch::schedule(BTTNode *node, float nearest)
+{
+    BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+    double travel = refreshDistance(info, nearest);
+    info.deadline = travel == DBL_MAX ? DBL_MAX : m_travel + travel;
+    if (info.deadline != DBL_MAX) {
+        uint64_t bucket = (uint64_t)(info.deadline / TERRAIN_REFRESH_STEP);
+        m_refreshWheel[bucket % TERRAIN_REFRESH_BUCKETS].push_back(std::make_pair(info.deadline, node));
+        m_refreshEntries++;
+    }
+}
+
+float TerrainPatch::currentScale(BTTNode *node)
+{
+    // ancestors' distances for the current view, combined from the root down in the
+    // order refreshRecursive uses. Nodes refreshed in this update() keep theirs, so
+    // the walk stops at the first of them and siblings and cousins share the work
+    BTTNode *path[64];
+    int count = 0;
+    while (m_nodeInfo[node - m_triPool].stamp != m_stamp) {
+        BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+        if (!info.parent || count == 64) {
+            info.scale = m_projectionScale > 0 ? 0 : 1;
+            info.stamp = m_stamp;
+            break;
+        }
+        path[count++] = node;
+        node = info.parent;
+    }
+    float scale = m_nodeInfo[node - m_triPool].scale;
+    while (count > 0) {
+        scale = childScale(m_nodeInfo[node - m_triPool], scale);
+        node = path[--count];
+        m_nodeInfo[node - m_triPool].scale = scale;
+        m_nodeInfo[node - m_triPool].stamp = m_stamp;
+    }
+    return scale;
+}
+
+void TerrainPatch::refreshNode(BTTNode *node)
+{
+    currentScale(node);
+    schedule(node, updatePriority(node, m_view));
+}
+
+void TerrainPatch::pushTouched()
+{
+    // leaves first, diamond priority needs both halves up to date
+    for (size_t i = 0; i < m_touched.size(); i++) {
+        BTTNode *node = m_touched[i];
+        if (!node->left_child && m_nodeInfo[node - m_triPool].variance_idx != 0) {
+            refreshNode(node);
+            if (m_nodeInfo[node - m_triPool].priority > m_errorMargin && canSplit(node)) {
+                m_splitQueue.push_back(std::make_pair(m_nodeInfo[node - m_triPool].priority, node));
+                std::push_heap(m_splitQueue.begin(), m_splitQueue.end());
+            }
+        }
+    }
+    for (size_t i = 0; i < m_touched.size(); i++) {
+        BTTNode *node = m_touched[i];
+        if (node->left_child && m_nodeInfo[node - m_triPool].variance_idx != 0 && onFrontier(node)) {
+            refreshNode(node);
+        }
+    }
+    for (size_t i = 0; i < m_touched.size(); i++) {
+        BTTNode *node = m_touched[i];
+        if (node->left_child && m_nodeInfo[node - m_triPool].variance_idx != 0 && isMergeable(node)) {
+            m_mergeQueue.push_back(std::make_pair(diamondPriority(node), node));
+            std::push_heap(m_mergeQueue.begin(), m_mergeQueue.end(), std::greater<std::pair<float, BTTNode*>>());
+        }
+    }
+    m_touched.clear();
+}
+
+void TerrainPatch::refreshRecursive(BTTNode *node, const glm::vec3 &view, std::vector<BTTNode*> &diamonds, int cull)
+{
+    float scale = updatePriority(node, view, &cull);
+    BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+
+    if (node->left_child) {
+        // the tree may come from tessellate(), which keeps no node state
+        initChildren(node);
+        m_nodeInfo[node->left_child - m_triPool].scale = scale;
+        m_nodeInfo[node->right_child - m_triPool].scale = scale;
+        m_nodeInfo[node->left_child - m_triPool].stamp = m_stamp;
+        m_nodeInfo[node->right_child - m_triPool].stamp = m_stamp;
+        refreshRecursive(node->left_child, view, diamonds, cull);
+        refreshRecursive(node->right_child, view, diamonds, cull);
+        if (isMergeable(node) && (!node->base_neighbor || !node->base_neighbor->left_child || node < node->base_neighbor)) {
+            diamonds.push_back(node);
+        }
+    } else {
+        if (info.tree == 0) {
+            m_leftLeaves++;
+        } else {
+            m_rightLeaves++;
+        }
+        if (info.priority > m_errorMargin && canSplit(node)) {
+            m_splitQueue.push_back(std::make_pair(info.priority, node));
+        }
+    }
+    if (onFrontier(node)) {
+        schedule(node, scale);
+    }
+}
+
+void TerrainPatch::refreshVisibility(BTTNode *node, int cull)
+{
+    BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+    if (cull == INERSECT_INTERSECT) {
+        cull = cullTest(info.left_x, info.left_y, info.right_x, info.right_y, info.apex_x, info.apex_y);
+    }
+    if (cull != INERSECT_INTERSECT) {
+        setVisibility(node, cull);
+        return;
+    }
+    // only culled nodes have a priority that depends on visibility
+    if (info.visible == INERSECT_OUT && onFrontier(node)) {
+        m_touched.push_back(node);
+    }
+    info.visible = INERSECT_INTERSECT;
+    if (node->left_child) {
+        refreshVisibility(node->left_child, cull);
+        refreshVisibility(node->right_child, cull);
+    }
+}
+
+void TerrainPatch::setVisibility(BTTNode *node, int cull)
+{
+    BTTNodeInfo &info = m_nodeInfo[node - m_triPool];
+    if (info.visible == cull) {
+        // the subtree was all in or all out already
+        return;
+    }
+    if ((info.visible == INERSECT_OUT) != (cull == INERSECT_OUT) && onFrontier(node)) {
+        m_touched.push_back(node);
+    }
+    info.visible = (unsigned char)cull;
+    if (node->left_child) {
+        setVisibility(node->left_child, cull);
+        setVisibility(node->right_child, cull);
+    }
+}
+
+float TerrainPatch::projectionScale(float fieldOfView, float viewportHeight)
+{
+    return viewportHeight / (2 * tanf(fieldOfView * 3.14159265f / 360.0f));
+}
+
+float TerrainPatch::screenDistance(const glm::vec3 &view, int left_x, int left_y, int right_x, int right_y) const
+{
+    // from the view to the nearest point of the triangle, its centre less the hypotenuse
+    float w = (float)(m_map->width - 1), h = (float)(m_map->height - 1);
+    float hyp_x = (right_x - left_x) / w, hyp_y = (right_y - left_y) / h;
+    glm::vec3 point = normalize(glm::vec3((left_x + right_x) * 0.5f / w - 0.5f, (left_y + right_y) * 0.5f / h - 0.5f, -0.5f));
+    return MAX(glm::distance(point, view) - sqrtf(hyp_x*hyp_x + hyp_y*hyp_y), TERRAIN_NEAR_DISTANCE);
+}
+
+float TerrainPatch::nodeError(
+    const glm::vec3 &view,
+    int left_x, int left_y, int right_x, int right_y,
+    const VarianceTree &variance_tree, unsigned int variance_idx, float *marginScale, float *nearest) const
+{
+    if (m_projectionScale > 0) {
+        // the margin is a fixed pixel count, it does not grow with depth
+        *marginScale = 1;
+        // the triangle lies inside its parent, so the parent's bound holds for it too.
+        // With the larger of the two the error never grows from a parent to its
+        // children, and update() ends on the same tree whatever order it splits in
+        *nearest = MAX(*nearest, screenDistance(view, left_x, left_y, right_x, right_y));
+        if (variance_idx >= m_varianceSize) {
+            return 0;
+        }
+        // an arc on the sphere is at most twice as long as its span on the face,
+        // so the hypotenuse h bounds the triangle radius by h and the sag by h^2/2
+        float w = (float)(m_map->width - 1), h = (float)(m_map->height - 1);
+        float hyp_x = (right_x - left_x) / w, hyp_y = (right_y - left_y) / h;
+        float hyp2 = hyp_x*hyp_x + hyp_y*hyp_y;
+        float error = MAX(variance_tree.get(variance_idx) * TERRAIN_HEIGHT_SCALE, 0.5f * hyp2);
+        return error * m_projectionScale / *nearest;
+    }
+
+    *marginScale = viewDistance((left_x + right_x) * 0.5f, (left_y + right_y) * 0.5f, view, m_map);
+    if (variance_idx >= m_varianceSize) {
+        return 0;
+    }
+    if (variance_idx < 32) {
+        return FLT_MAX;
+    }
+    return variance_tree.get(variance_idx) / *marginScale;
+}
+
+bool TerrainPatch::splitTest(
+    const glm::vec3 &view, float errorMargin,
+    int left_x, int left_y, int right_x, int right_y,
+    const VarianceTree &variance_tree, unsigned int variance_idx, float *distance, float *nearest)
+{
+    if (variance_idx >= m_varianceSize) {
+        return false;
+    }
+
+    //if(view.z > 1) {
+    //	variance /= view.z;
+    //}
+
+    return nodeError(view, left_x, left_y, right_x, right_y, variance_tree, variance_idx, distance, nearest) > errorMargin;
+}
+
+void TerrainPatch::tessellateRecursive(
+    BTTNode *node, const glm::vec3 &view, float errorMargin,
+    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
+    const VarianceTree &variance_tree, unsigned int variance_idx, Heightmap *map, int cull, float nearest)
+{
+    if (cull == INERSECT_INTERSECT) {
+        cull = cullTest(left_x, left_y, right_x, right_y, apex_x, apex_y);
+    }
+    float distance;
+    if (splitTest(view, errorMargin, left_x, left_y, right_x, right_y, variance_tree, variance_idx, &distance, &nearest) &&
+        (cull != INERSECT_OUT || variance_idx < 32)) {
+        int center_x = (left_x + right_x) / 2;
+        int center_y = (left_y + right_y) / 2;
+
+        split(node);
+        if (node->left_child && ((abs(left_x - right_x) >= 3) || (abs(left_y - right_y) >= 3)))
+        {
+            tessellateRecursive(
+                node->left_child, view, errorMargin*distance,
+                apex_x, apex_y, left_x, left_y, center_x, center_y,
+                variance_tree, (variance_idx<<1), map, cull, nearest);
+            tessellateRecursive(
+                node->right_child, view, errorMargin*distance,
+                right_x, right_y, apex_x, apex_y, center_x, center_y,
+                variance_tree, (variance_idx<<1)+1, map, cull, nearest);
+        }
+    }
+}
+
+void TerrainPatch::tessellateCompactRecursive(
+    uint32_t node, const glm::vec3 &view, float errorMargin,
+    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
+    const VarianceTree &variance_tree, unsigned int variance_idx, int cull, float nearest)
+{
+    if (cull == INERSECT_INTERSECT) {
+        cull = cullTest(left_x, left_y, right_x, right_y, apex_x, apex_y);
+    }
+    float distance;
+    if (splitTest(view, errorMargin, left_x, left_y, right_x, right_y, variance_tree, variance_idx, &distance, &nearest) &&
+        (cull != INERSECT_OUT || variance_idx < 32)) {
+        int center_x = (left_x + right_x) / 2;
+        int center_y = (left_y + right_y) / 2;
+
+        splitCompact(node);
+        uint32_t children = m_compactPool[node].children;
+        if (children && ((abs(left_x - right_x) >= 3) || (abs(left_y - right_y) >= 3)))
+        {
+            tessellateCompactRecursive(
+                children, view, errorMargin*distance,
+                apex_x, apex_y, left_x, left_y, center_x, center_y,
+                variance_tree, (variance_idx<<1), cull, nearest);
+            tessellateCompactRecursive(
+                children+1, view, errorMargin*distance,
+                right_x, right_y, apex_x, apex_y, center_x, center_y,
+                variance_tree, (variance_idx<<1)+1, cull, nearest);
+        }
+    }
+}
+
+void TerrainPatch::computeVarianceRecursive(
+    int maxTessellationLevels, int level, float *varianceTree, int idx, Heightmap *map,
+    int left_x, int left_y, float left_z,
+    int right_x, int right_y, float right_z,
+    int apex_x, int apex_y, float apex_z)
+{
+    int center_x = (left_x + right_x) / 2;
+    int center_y = (left_y + right_y) / 2;
+    float center_z = Heightmap_get(map, center_x, center_y);
 
     if (level < maxTessellationLevels) {
         computeVarianceRecursive(
@@ -289,69 +2114,42 @@ void TerrainPatch::computeVarianceRecursive(
     }
 }
 
-void TerrainPatch::getTessellationRecursive(
-    BTTNode *node, Heightmap *map,
-    float *vertices, float *colors, float *normalTexels, int *idx,
-    int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y)
+void TerrainPatch::collectVarianceTasks(
+    std::vector<VarianceTask> &tasks, int level, int taskLevel, float *varianceTree, int idx,
+    int left_x, int left_y, float left_z,
+    int right_x, int right_y, float right_z,
+    int apex_x, int apex_y, float apex_z)
 {
-    if (node->left_child) {
-        int center_x = (left_x + right_x) / 2;
-        int center_y = (left_y + right_y) / 2;
-
-        getTessellationRecursive(
-            node->left_child, map, vertices, colors, normalTexels, idx,
-            apex_x, apex_y, left_x, left_y, center_x, center_y);
-        getTessellationRecursive(
-            node->right_child, map, vertices, colors, normalTexels, idx,
-            right_x, right_y, apex_x, apex_y, center_x, center_y);
-    } else {
-        // we're at leaf
-        vertices[*idx+0] =  left_x /(float) (map->width - 1);
-        vertices[*idx+1] =  left_y /(float) (map->height - 1);
-        vertices[*idx+2] = Heightmap_get(map, left_x, left_y);
-        vertices[*idx+3] =  right_x /(float) (map->width - 1);
-        vertices[*idx+4] =  right_y /(float) (map->height - 1);
-        vertices[*idx+5] = Heightmap_get(map, right_x, right_y);
-        vertices[*idx+6] =  apex_x /(float) (map->width - 1);
-        vertices[*idx+7] =  apex_y /(float) (map->height - 1);
-         vertices[*idx+8] = Heightmap_get(map, apex_x, apex_y);
-
-        colors[*idx+0] = 1;
-        colors[*idx+1] = 1;
-        colors[*idx+2] = 1;
-        colors[*idx+3] = 1;
-        colors[*idx+4] = 1;
-        colors[*idx+5] = 1;
-        colors[*idx+6] = 1;
-        colors[*idx+7] = 1;
-        colors[*idx+8] = 1;
-
-        normalTexels[(*idx/9)*6+0] =  left_x  /(float) (map->width - 1);
-        normalTexels[(*idx/9)*6+1] =  left_y  /(float) (map->height - 1);
-        normalTexels[(*idx/9)*6+2] =  right_x /(float) (map->width - 1);
-        normalTexels[(*idx/9)*6+3] =  right_y /(float) (map->height - 1);
-        normalTexels[(*idx/9)*6+4] =  apex_x  /(float) (map->width - 1);
-        normalTexels[(*idx/9)*6+5] =  apex_y  /(float) (map->height - 1);
-
-        *idx += 9;
-    }
-}
-
-void TerrainPatch::Bind(float *vertices, float *colors, float *normalTexels)
-{
-    auto leaves = m_leftLeaves + m_rightLeaves;
-    m->Verteces.resize(leaves*3);
-    m->Indeces.resize(leaves*3);
-
-    for (int i=0; i<leaves*3; i++)
-    {
-        m->Verteces[i].Position = normalize(glm::vec3(vertices[i*3]-0.5, vertices[i*3+1]-0.5, -0.5));
-        m->Verteces[i].Position.z *= ((99+vertices[i*3+2])/100.0f);
-        m->Verteces[i].Normal = normalize(m->Verteces[i].Position);
-        m->Indeces[i] = i;
-        m->Verteces[i].Uv = glm::vec2(normalTexels[i*2], normalTexels[i*2+1]);
+    if (level == taskLevel) {
+        VarianceTask t;
+        t.varianceTree = varianceTree;
+        t.idx = idx;
+        t.left_x = left_x; t.left_y = left_y; t.left_z = left_z;
+        t.right_x = right_x; t.right_y = right_y; t.right_z = right_z;
+        t.apex_x = apex_x; t.apex_y = apex_y; t.apex_z = apex_z;
+        tasks.push_back(t);
+        return;
     }
-    m->Bind(1);
+
+    int center_x = (left_x + right_x) / 2;
+    int center_y = (left_y + right_y) / 2;
+    float center_z = Heightmap_get(m_map, center_x, center_y);
+
+    collectVarianceTasks(
+        tasks, level+1, taskLevel, varianceTree, (idx<<1),
+        apex_x, apex_y, apex_z,
+        left_x, left_y, left_z,
+        center_x, center_y, center_z);
+    collectVarianceTasks(
+        tasks, level+1, taskLevel, varianceTree, (idx<<1)+1,
+        right_x, right_y, right_z,
+        apex_x, apex_y, apex_z,
+        center_x, center_y, center_z);
+}
+
+void TerrainPatch::Bind()
+{
+    m->Bind(2);
 }
 
 void TerrainPatch::Render()
@@ -363,3 +2161,88 @@ void TerrainPatch::FreeMaps()
 {
     maps_delete(m_map);
 }
+
+void TerrainPatch::buildPyramid()
+{
+    std::call_once(m_pyramidOnce, [this]() {
+        if (!m_map->pyramid) {
+            Heightmap_build_pyramid(m_map, m_pyramidThreads);
+        }
+    });
+}
+
+// box around the surface over texels [x0, x1] x [y0, y1] with heights in [low_z, high_z],
+// in the patch space of meshVertex
+static void surfaceBounds(const Heightmap *map, size_t x0, size_t y0, size_t x1, size_t y1, float low_z, float high_z,
+    void *, float low[3], float high[3])
+{
+    float w = (float)(map->width - 1), h = (float)(map->height - 1);
+    float u0 = x0/w - 0.5f, u1 = x1/w - 0.5f, v0 = y0/h - 0.5f, v1 = y1/h - 0.5f;
+    float uc = MIN(MAX(0.0f, u0), u1), vc = MIN(MAX(0.0f, v0), v1);
+    // u/|p| grows with u and shrinks with |v| (and the other way round), |p| is
+    // smallest nearest the face centre: the extremes are among these points
+    const float us[9] = { u0, u1, u0, u1, u0, u1, uc, uc, uc };
+    const float vs[9] = { v0, v0, v1, v1, vc, vc, v0, v1, vc };
+    // every direction is scaled by a radius between these two
+    float radius[2] = { (99 + low_z) / 100.0f, (99 + high_z) / 100.0f };
+    for (int a = 0; a < 3; a++) {
+        low[a] = FLT_MAX;
+        high[a] = -FLT_MAX;
+    }
+    for (int i = 0; i < 9; i++) {
+        float inv = 1.0f / sqrtf(us[i]*us[i] + vs[i]*vs[i] + 0.25f);
+        const float p[3] = { us[i]*inv, vs[i]*inv, -0.5f*inv };
+        for (int a = 0; a < 3; a++) {
+            for (int r = 0; r < 2; r++) {
+                low[a] = MIN(low[a], p[a]*radius[r]);
+                high[a] = MAX(high[a], p[a]*radius[r]);
+            }
+        }
+    }
+    // rounding of meshVertex
+    for (int a = 0; a < 3; a++) {
+        low[a] -= 1e-5f;
+        high[a] += 1e-5f;
+    }
+}
+
+// the point meshVertex puts texel (x, y) of height z on
+static void surfacePosition(const Heightmap *map, size_t x, size_t y, float z, void *, float out[3])
+{
+    glm::vec3 p = meshVertex(map, (int)x, (int)y, z).Position;
+    out[0] = p.x;
+    out[1] = p.y;
+    out[2] = p.z;
+}
+
+bool TerrainPatch::intersect(const glm::vec3 &worldOrigin, const glm::vec3 &worldDir, float *t, glm::vec2 *texel)
+{
+    glm::mat4 toPatch = glm::inverse(m->World);
+    glm::vec4 o4 = toPatch * glm::vec4(worldOrigin, 1), d4 = toPatch * glm::vec4(worldDir, 0);
+    // affine, t along the patch space ray is t along the world one
+    const float origin[3] = { o4.x, o4.y, o4.z }, dir[3] = { d4.x, d4.y, d4.z };
+    buildPyramid();
+    HeightmapSurface sphere = { surfacePosition, surfaceBounds, nullptr };
+    float hit[2];
+    if (!Heightmap_intersect_surface(m_map, &sphere, origin, dir, t, hit)) {
+        return false;
+    }
+    if (texel) {
+        *texel = glm::vec2(hit[0], hit[1]);
+    }
+    return true;
+}
+
+void TerrainPatch::intersect(const glm::vec3 *origins, const glm::vec3 *dirs, size_t count, float *t, unsigned threads)
+{
+    const size_t block = 64;
+    // before the workers, they would all wait on the first one's build
+    buildPyramid();
+    parallel_for(0, (count + block - 1) / block, [&](size_t b) {
+        for (size_t i = b*block; i < MIN((b+1)*block, count); i++) {
+            if (!intersect(origins[i], dirs[i], &t[i])) {
+                t[i] = -1;
+            }
+        }
+    }, threads);
+}
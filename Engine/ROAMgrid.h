@@ -6,6 +6,95 @@
 
 #include "glm.hpp"
 #include "Mesh.h"
+#include <vector>
+#include <utility>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include "MappedFile.h"
+
+/* per-node state of the frame-coherent (split/merge) mode, indexed like m_triPool */
+struct BTTNodeInfo
+{
+    BTTNode *parent;
+    unsigned int variance_idx;
+    unsigned short left_x, left_y, right_x, right_y, apex_x, apex_y;
+    unsigned char tree; // 0 - left root, 1 - right root
+    float scale;        // ancestor distances: their product, the recursive errorMargin growth, or in
+                        // the screen-space metric the largest, the bound nodeError gets as nearest
+    float priority;     // variance/distance/scale for the current view
+    unsigned char visible; // INERSECT_* of the node for the current view and frustum
+    double deadline;    // camera travel up to which priority stays on its side of the margin
+    unsigned int stamp; // update() whose view scale was combined for
+};
+
+/* read-only view of a variance tree: the float array, or values quantized to
+   8/16 bits that are rounded up, so value*scale is never below the float one */
+struct VarianceTree
+{
+    const float *values;
+    const unsigned short *values16;
+    const unsigned char *values8;
+    float scale;
+
+    inline float get(int idx) const
+    {
+        if (values) {
+            return values[idx];
+        }
+        if (values16) {
+            return values16[idx]*scale;
+        }
+        return values8[idx]*scale;
+    }
+};
+
+/* a vertex that is new in this tessellation, it starts where the previous
+   (coarser) surface was, the middle of the edge it split, and moves to its place.
+   Only splits morph: vertices a merge removes are gone from the new mesh and pop out */
+struct MorphTarget
+{
+    GLuint index;
+    glm::vec3 from;
+    glm::vec3 to;
+};
+
+/* patch borders for linking, in heightmap texels */
+enum PatchEdge
+{
+    PATCH_EDGE_X0 = 0, // x == 0, left root
+    PATCH_EDGE_Y0 = 1, // y == 0, left root
+    PATCH_EDGE_X1 = 2, // x == width-1, right root
+    PATCH_EDGE_Y1 = 3  // y == height-1, right root
+};
+
+/* how a TerrainPatch generates (or finds) its terrain */
+struct TerrainSettings
+{
+    TerrainSettings();
+
+    /* heightmap, normals and variance trees are mapped from a cache file here when
+       one matches (offset, noise parameters, resolution, levels, varianceBits),
+       otherwise generated as usual and written there by computeVariance. Empty - no cache */
+    std::string cacheDir;
+    /* the generated map's width and height; any size works, 2^n+1 keeps splits
+       on texels. The patch covers the same terrain whatever the resolution,
+       only the detail changes */
+    int resolution;
+    /* picks the noise field (see Noise) */
+    unsigned int seed;
+    /* the patch is this cube-sphere face (its rotation, as m->World): the noise is
+       sampled on the sphere instead of the plane, so neighbouring faces meet
+       without seams, and the offsets only name the cache file. Only read by the
+       constructor */
+    const glm::mat4 *face;
+    /* threads the constructor generates the heightmap and its normals with,
+       0 uses every core. Only read by the constructor */
+    unsigned threads;
+    /* 8 or 16: computeVariance quantizes the trees (see quantizeVariance) and
+       the cache keeps them that way, 32 keeps floats */
+    int varianceBits;
+};
 
 class TerrainPatch
 {
@@ -17,6 +106,8 @@ private:
     float *m_leftVariance;
     float *m_rightVariance;
     size_t m_varianceSize;
+    VarianceTree m_leftTree;
+    VarianceTree m_rightTree;
 
     float m_varianceLimit;
 
@@ -31,41 +122,271 @@ private:
     size_t m_poolNext;
     void Init();
 
+    BTTNodeInfo *m_nodeInfo;
+    glm::vec3 m_view;
+    float m_errorMargin;
+    std::vector<BTTNode*> m_freeNodes;
+    std::vector<BTTNode*> m_touched;
+    std::vector<std::pair<float, BTTNode*>> m_splitQueue;
+    std::vector<std::pair<float, BTTNode*>> m_mergeQueue;
+    // refresh deadlines in buckets of TERRAIN_REFRESH_STEP travel, bucket k in slot
+    // k % TERRAIN_REFRESH_BUCKETS; slots from m_refreshBucket on are still to be drained
+    std::vector<std::vector<std::pair<double, BTTNode*>>> m_refreshWheel;
+    uint64_t m_refreshBucket;
+    size_t m_refreshEntries;
+    double m_travel;
+    bool m_refreshAll;
+    bool m_updating;
+    unsigned int m_stamp;
+
+    BTTCompactNode *m_compactPool;
+    uint32_t m_compactNext;
+
+    std::vector<GLuint> m_vertexLookup;
+
+    std::vector<unsigned char> m_morphTexels;
+    std::vector<GLuint> m_morphKeys;
+
+    const Frustum *m_cullFrustum;
+    bool m_cullHorizon;
+    float m_projectionScale;
+
+    int m_offsetX, m_offsetY;
+    int m_resolution;
+    unsigned int m_seed;
+    int m_varianceBits;
+    bool m_sphere;
+    float m_face[9];
+    std::string m_cacheDir;
+    MappedFile *m_cache;
+    bool m_varianceMapped;
+
+    // the heightmap pyramid is built on first use, culling and ray casts
+    // may want it from different threads
+    std::once_flag m_pyramidOnce;
+    unsigned m_pyramidThreads;
+
+    TerrainPatch *m_linkPatch[4];
+    int m_linkEdge[4];
+
 public:
-    TerrainPatch(int offset_x = 0, int offset_y = 0);
+    /* 2^n+1, so every split lands on a texel and shared borders split at the same points */
+    static const int DefaultResolution = 1025;
+
+    /* a given map (of any width and height) is adopted instead of generating one
+       (deleted with the patch), its resolution is the map's */
+    TerrainPatch(int offset_x = 0, int offset_y = 0, const TerrainSettings &settings = TerrainSettings(),
+        Heightmap *map = nullptr);
     ~TerrainPatch();
 
     void print() const;
 
-    void computeVariance(int maxTessellationLevels = 14);
+    /* threads == 0 uses every core, 1 runs the plain depth-first walk.
+       Levels past maxLevels() are not stored, they would only hold empty triangles.
+       threads is also what the heightmap pyramid is built with later */
+    void computeVariance(int maxTessellationLevels = 14, unsigned threads = 0);
+
+    /* bintree levels until the triangles are a texel wide, 20 for a 1025 map */
+    int maxLevels() const;
+
+    /* replaces the float variance trees with 8 or 16 bit ones (32 keeps floats).
+       Splits can only get more eager, never less. Call after computeVariance,
+       trees that are already quantized stay as they are */
+    void quantizeVariance(int bits);
+
+    /* memory held by the variance trees, mapped cache pages included */
+    size_t varianceBytes() const;
 
     void reset();
 
-    void tessellate(const glm::vec3 &view, float errorMargin = 0.001);
+    /* frustum (in patch space, see Frustum::Build) and horizon culling: subtrees
+       outside the frustum or behind the planet limb are not refined beyond the
+       base levels.
+       With a projectionScale (see projectionScale()) errorMargin is in pixels: a
+       triangle splits while its height variance or its sag under the sphere, projected
+       from its distance to the view, is above errorMargin. 0 keeps the variance /
+       (1 + distance) metric with the forced first levels */
+    void tessellate(const glm::vec3 &view, float errorMargin = 0.001, const Frustum *frustum = nullptr, bool horizon = false,
+        float projectionScale = 0);
 
-    /*(left_num_leaves + right_num_leaves)*(number of elements per triangle)*/
-    void getTessellation(float *vertices, float *colors, float *normalTexels);
+    /* frame-coherent alternative to reset() + tessellate(): keeps the previous tree
+       and only splits/merges where the error changed, without budgets it ends on the
+       tree reset() + tessellate() builds. maxTriangles and maxMilliseconds
+       bound the work per call, 0 means unlimited; work left over goes on in the next call.
+       Priorities are kept between calls too: a node is only evaluated again once the
+       camera has travelled far enough for its error to cross errorMargin, or when its
+       frustum/horizon visibility changes, so the cost follows the camera motion rather
+       than the triangle count. A different errorMargin, projectionScale or culling mode,
+       or a tree tessellate() built, evaluates every node.
+       Pays off with the screen-space metric and small moves only: under the distance
+       metric (no projectionScale) an error depends on every ancestor's distance, small
+       moves bring most nodes due and update() is slower than reset() + tessellate(),
+       and so is any large move */
+    void update(const glm::vec3 &view, float errorMargin = 0.001, size_t maxTriangles = 0, float maxMilliseconds = 0,
+        const Frustum *frustum = nullptr, bool horizon = false, float projectionScale = 0);
+
+    /* the next update() evaluates every node, e.g. after the camera jumped */
+    void invalidatePriorities();
+
+    /* pixels per unit of error at unit distance for a vertical field of view
+       in degrees (Camera::field_of_view) and a viewport height in pixels */
+    static float projectionScale(float fieldOfView, float viewportHeight);
+
+    /* 9 floats per leaf to vertices (x, y, height per corner), 6 to normalTexels */
+    void getTessellation(float *vertices, float *normalTexels);
+
+    /* shared vertices emitted once, keyed by heightmap texel: 3 floats per vertex
+       (x, y, height, x and y are also the normal map texel) and 3 indices per leaf.
+       A conforming tessellation has at most amountOfLeaves()+2 vertices.
+       Returns the number of vertices written */
+    size_t getIndexedTessellation(float *vertices, GLuint *indices);
+
+    /* writes finished mesh vertices (cube face position, normal, normal map texel)
+       straight into the given vectors in one leaf walk, no staging pools.
+       indexed shares vertices between leaves, otherwise 3 vertices per leaf.
+       With morphs, vertices that were not in the previous getMesh with morphs
+       get a MorphTarget (none on the first call). Merged away vertices get none */
+    void getMesh(std::vector<VertexPositionNormalTexture> &verteces, std::vector<GLuint> &indeces, bool indexed = true,
+        std::vector<MorphTarget> *morphs = nullptr);
+
+    /* geomorph of m: vertices in Morphs move from their start to their place,
+       t from 0 to 1. At t >= 1 they are final and Morphs is emptied */
+    void morph(float t);
+    std::vector<MorphTarget> Morphs;
 
     size_t amountOfLeaves() const;
 
     size_t poolSize() const;
 
+    /* switch the tree between the pointer pool and the compact one (32-bit handles,
+       children allocated as adjacent pairs), drops the current tessellation.
+       The compact pool is a standalone benchmark layout: nothing in ROAMSurface
+       turns it on, linkPatches() switches it off (linked faces need the pointer
+       pool) and update() falls back to reset() + tessellate() on it */
+    void setCompactPool(bool compact);
+    bool compactPool() const;
+
+    /* memory held by the node pool */
+    size_t poolBytes() const;
+
+    /* links the root triangles of patches whose borders meet under their m->World
+       (the cube faces of a sphere, rotated but never mirrored) as neighbours, so forced splits cross the seams
+       and the borders stay free of T-junctions. Linked patches share their trees:
+       refine them with tessellateLinked only, not one by one with reset(),
+       tessellate() or update(). Switches the patches to the pointer pool */
+    static void linkPatches(const std::vector<TerrainPatch*> &patches);
+    /* drops the links and resets the patches */
+    static void unlinkPatches(const std::vector<TerrainPatch*> &patches);
+
+    /* reset() + tessellate() over a set of linked patches, views[i] and frusta[i]
+       (empty - no frustum culling) in the space of patches[i] */
+    static void tessellateLinked(const std::vector<TerrainPatch*> &patches, const std::vector<glm::vec3> &views,
+        float errorMargin = 0.001, const std::vector<Frustum> &frusta = std::vector<Frustum>(), bool horizon = false,
+        float projectionScale = 0);
+
+    /* number of borders linked to another patch */
+    int linkedEdges() const;
+
     Heightmap *getHeightmap();
 
-    void Bind(float *vertices, float *colors, float *normalTexels);
+    /* ray casts against the full resolution surface getMesh vertices lie on
+       (each quad of texels as two triangles, see Heightmap_intersect), under
+       m->World. origin and dir are in world space, t is the distance along dir
+       and texel the hit on the heightmap. Cells of the heightmap pyramid bound
+       their part of the sphere, the ray only descends into the ones it passes.
+       The first ray cast or culled tessellation builds the pyramid */
+    bool intersect(const glm::vec3 &origin, const glm::vec3 &dir, float *t, glm::vec2 *texel = nullptr);
+    /* t[i] of ray i or -1 on a miss, blocks of rays go to threads workers (0 - every core) */
+    void intersect(const glm::vec3 *origins, const glm::vec3 *dirs, size_t count, float *t, unsigned threads = 0);
+
+    /* uploads m into its double-buffered stream buffers,
+       fill it with getMesh(m->Verteces, m->Indeces) first */
+    void Bind();
     void Render();
     Mesh* m;
     void FreeMaps();
 
+    /* cache file of this patch, empty without a cacheDir */
+    std::string cachePath() const;
+
+    /* heightmap and variance trees come from the cache file */
+    bool cached() const;
+
 private:
     BTTNode *allocateNode();
+    bool ownsNode(const BTTNode *node) const;
+    TerrainPatch *nodeOwner(BTTNode *node);
+    BTTNode *edgeRoot(int edge) const;
+    void freeNode(BTTNode *node);
 
     void split(BTTNode *node);
 
+    uint32_t allocateCompactPair();
+    void splitCompact(uint32_t node);
+
+    /* Heightmap_build_pyramid once, unless the map already has one */
+    void buildPyramid();
+
+    void initIncremental();
+    void initChildren(BTTNode *node);
+    void onSplit(BTTNode *node);
+    void merge(BTTNode *node);
+    void mergeChildren(BTTNode *node);
+    bool canSplit(BTTNode *node) const;
+    bool isMergeable(BTTNode *node) const;
+    bool onFrontier(BTTNode *node) const;
+    float diamondPriority(BTTNode *node) const;
+    /* returns the children's scale */
+    float updatePriority(BTTNode *node, const glm::vec3 &view, int *cull = nullptr);
+    double refreshDistance(const BTTNodeInfo &info, float nearest) const;
+    void schedule(BTTNode *node, float nearest);
+    /* sets and returns the node's scale for the current view */
+    float currentScale(BTTNode *node);
+    void refreshNode(BTTNode *node);
+    void pushTouched();
+    void refreshRecursive(BTTNode *node, const glm::vec3 &view, std::vector<BTTNode*> &diamonds, int cull);
+    void refreshVisibility(BTTNode *node, int cull);
+    void setVisibility(BTTNode *node, int cull);
+    void compactQueues();
+
+    /* INERSECT_OUT - culled, INERSECT_IN - the whole subtree is visible,
+       INERSECT_INTERSECT - children need their own test */
+    int cullTest(int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y) const;
+    int cullRoot() const;
+
+    /* distance the screen-space metric divides by */
+    float screenDistance(const glm::vec3 &view, int left_x, int left_y, int right_x, int right_y) const;
+
+    /* error of a triangle in the current metric, compared against errorMargin.
+       marginScale is what the children's margin is multiplied by. nearest comes in
+       as the parent's screen-space distance bound (0 at the roots) and leaves as
+       this triangle's */
+    float nodeError(
+        const glm::vec3 &view,
+        int left_x, int left_y, int right_x, int right_y,
+        const VarianceTree &variance_tree, unsigned int variance_idx, float *marginScale, float *nearest) const;
+
+    /* scale (see BTTNodeInfo) of the children of a node with the given info and scale */
+    float childScale(const BTTNodeInfo &info, float scale) const;
+
+    void morphTargets(const std::vector<VertexPositionNormalTexture> &verteces, std::vector<MorphTarget> &morphs);
+    glm::vec3 morphFrom(GLuint key, const std::unordered_map<GLuint, std::pair<GLuint, GLuint>> &parents,
+        std::unordered_map<GLuint, glm::vec3> &from);
+
+    bool splitTest(
+        const glm::vec3 &view, float errorMargin,
+        int left_x, int left_y, int right_x, int right_y,
+        const VarianceTree &variance_tree, unsigned int variance_idx, float *distance, float *nearest);
+
     void tessellateRecursive(
         BTTNode *node, const glm::vec3 &view, float errorMargin,
         int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
-        float *variance, int variance_idx, Heightmap *map);
+        const VarianceTree &variance, unsigned int variance_idx, Heightmap *map, int cull, float nearest);
+
+    void tessellateCompactRecursive(
+        uint32_t node, const glm::vec3 &view, float errorMargin,
+        int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
+        const VarianceTree &variance, unsigned int variance_idx, int cull, float nearest);
 
     void computeVarianceRecursive(
         int maxTessellationLevels, int level, float *varianceTree, int idx, Heightmap *map,
@@ -73,9 +394,60 @@ private:
         int right_x, int right_y, float right_z,
         int apex_x, int apex_y, float apex_z);
 
-    void getTessellationRecursive(
-        BTTNode *node, Heightmap *map,
-        float *vertices, float *colors, float *normalTexels, int *idx,
+    /* a variance subtree handed to one worker */
+    struct VarianceTask {
+        float *varianceTree;
+        int idx;
+        int left_x, left_y, right_x, right_y, apex_x, apex_y;
+        float left_z, right_z, apex_z;
+    };
+
+    Heightmap *loadCache();
+    bool loadCachedVariance(int maxTessellationLevels);
+    void saveCache(int maxTessellationLevels);
+    void freeVariance();
+
+    void collectVarianceTasks(
+        std::vector<VarianceTask> &tasks, int level, int taskLevel, float *varianceTree, int idx,
+        int left_x, int left_y, float left_z,
+        int right_x, int right_y, float right_z,
+        int apex_x, int apex_y, float apex_z);
+
+    /* calls emit(left_x, left_y, right_x, right_y, apex_x, apex_y) for every leaf,
+       whichever pool holds the tree */
+    template <typename LeafFunc>
+    void forEachLeaf(LeafFunc &emit);
+
+    /* calls newVertex(slot, x, y) once per vertex, slots in order, and writes
+       3 slots per leaf to indices. Returns the number of vertices */
+    template <typename VertexFunc>
+    size_t forEachIndexedLeaf(GLuint *indices, VertexFunc &newVertex);
+
+    template <typename VertexFunc, typename LeafFunc>
+    void forEachIndexedRecursive(
+        BTTNode *node, VertexFunc &vertex, LeafFunc &emit,
+        int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
+        GLuint left, GLuint right, GLuint apex);
+
+    template <typename VertexFunc, typename LeafFunc>
+    void forEachIndexedCompact(
+        uint32_t node, VertexFunc &vertex, LeafFunc &emit,
+        int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y,
+        GLuint left, GLuint right, GLuint apex);
+
+    /* same walk, also calls split(left_x, left_y, right_x, right_y) for every
+       inner node before its children */
+    template <typename LeafFunc, typename SplitFunc>
+    void forEachNode(LeafFunc &emit, SplitFunc &split);
+
+    template <typename LeafFunc, typename SplitFunc>
+    void forEachLeafRecursive(
+        BTTNode *node, LeafFunc &emit, SplitFunc &split,
+        int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y);
+
+    template <typename LeafFunc, typename SplitFunc>
+    void forEachLeafCompact(
+        uint32_t node, LeafFunc &emit, SplitFunc &split,
         int left_x, int left_y, int right_x, int right_y, int apex_x, int apex_y);
     
 };
@@ -90,6 +462,16 @@ inline size_t TerrainPatch::poolSize() const
     return m_poolSize;
 }
 
+inline bool TerrainPatch::compactPool() const
+{
+    return m_compactPool != nullptr;
+}
+
+inline bool TerrainPatch::ownsNode(const BTTNode *node) const
+{
+    return m_triPool && node >= m_triPool && node < m_triPool + m_poolSize;
+}
+
 inline Heightmap *TerrainPatch::getHeightmap()
 {
     return m_map;
@@ -0,0 +1,272 @@
+#include "TerrainPager.h"
+#include <algorithm>
+#include <math.h>
+
+TerrainPager::TerrainPager(unsigned threads) :
+    Radius(1),
+    MemoryBudget(512u << 20),
+    CompressedBudget(64u << 20),
+    VarianceLevels(20),
+    VarianceBits(16),
+    Generated(0),
+    Restored(0),
+    m_residentBytes(0),
+    m_packedBytes(0),
+    m_frame(0),
+    m_stop(false)
+{
+    if(threads == 0) {
+        threads = std::thread::hardware_concurrency();
+        threads = threads > 1 ? threads - 1 : 1;
+    }
+    for (unsigned i = 0; i < threads; i++)
+    {
+        m_workers.push_back(std::thread(&TerrainPager::Run, this));
+    }
+}
+
+TerrainPager::~TerrainPager()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_queue.clear();
+    }
+    m_signal.notify_all();
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        m_workers[i].join();
+    }
+    for (size_t i = 0; i < m_done.size(); i++)
+    {
+        delete m_done[i].patch;
+    }
+    for (auto it = m_resident.begin(); it != m_resident.end(); ++it)
+    {
+        delete it->second.patch;
+    }
+}
+
+unsigned long long TerrainPager::Key(int x, int y)
+{
+    return ((unsigned long long)(unsigned int)x << 32) | (unsigned int)y;
+}
+
+size_t TerrainPager::PatchBytes(TerrainPatch *patch)
+{
+    Heightmap *map = patch->getHeightmap();
+    // heights and normals, trees, node pool
+    return map->width*map->height*sizeof(float)*4 + patch->varianceBytes() + patch->poolBytes();
+}
+
+void TerrainPager::Update(float x, float y)
+{
+    m_frame++;
+
+    std::vector<Done> done;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        done.swap(m_done);
+    }
+    for (size_t i = 0; i < done.size(); i++)
+    {
+        if(m_resident.count(done[i].key)) {
+            delete done[i].patch;
+            continue;
+        }
+        Cell cell;
+        cell.patch = done[i].patch;
+        cell.bytes = PatchBytes(cell.patch);
+        cell.used = m_frame;
+        m_resident[done[i].key] = cell;
+        m_residentBytes += cell.bytes;
+        if(done[i].restored) {
+            Restored++;
+        } else {
+            Generated++;
+        }
+    }
+
+    int cx = (int)floorf(x);
+    int cy = (int)floorf(y);
+    std::vector<std::pair<float, std::pair<int, int>>> wanted;
+    for (int j = cy - Radius; j <= cy + Radius; j++)
+    {
+        for (int i = cx - Radius; i <= cx + Radius; i++)
+        {
+            auto it = m_resident.find(Key(i, j));
+            if(it != m_resident.end()) {
+                it->second.used = m_frame;
+                continue;
+            }
+            float dx = i + 0.5f - x, dy = j + 0.5f - y;
+            wanted.push_back(std::make_pair(dx*dx + dy*dy, std::make_pair(i, j)));
+        }
+    }
+    std::sort(wanted.begin(), wanted.end());
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // cells the camera left behind are dropped before they start
+        m_queue.clear();
+        for (size_t i = 0; i < wanted.size(); i++)
+        {
+            Job job;
+            job.x = wanted[i].second.first;
+            job.y = wanted[i].second.second;
+            unsigned long long key = Key(job.x, job.y);
+            if(m_running.count(key)) {
+                continue;
+            }
+            bool finished = false;
+            for (size_t k = 0; k < m_done.size() && !finished; k++)
+            {
+                finished = m_done[k].key == key;
+            }
+            if(finished) {
+                continue;
+            }
+            auto packed = m_packed.find(key);
+            if(packed != m_packed.end()) {
+                packed->second.used = m_frame;
+                job.packed = packed->second.data;
+            }
+            job.varianceLevels = VarianceLevels;
+            job.terrain = Terrain;
+            job.terrain.face = nullptr;
+            job.terrain.varianceBits = VarianceBits;
+            m_queue.push_back(job);
+        }
+    }
+    m_signal.notify_all();
+
+    Evict();
+}
+
+void TerrainPager::Evict()
+{
+    if(m_residentBytes > MemoryBudget) {
+        // least recently wanted first, cells wanted by this update stay
+        std::vector<std::pair<unsigned long long, unsigned long long>> order;
+        for (auto it = m_resident.begin(); it != m_resident.end(); ++it)
+        {
+            if(it->second.used < m_frame) {
+                order.push_back(std::make_pair(it->second.used, it->first));
+            }
+        }
+        std::sort(order.begin(), order.end());
+        for (size_t i = 0; i < order.size() && m_residentBytes > MemoryBudget; i++)
+        {
+            auto it = m_resident.find(order[i].second);
+            if(m_packed.find(it->first) == m_packed.end()) {
+                Heightmap *map = it->second.patch->getHeightmap();
+                Packed packed;
+                packed.data = std::make_shared<std::vector<unsigned char>>(Heightmap_compress_bound(map));
+                packed.data->resize(Heightmap_compress(map, &(*packed.data)[0]));
+                packed.data->shrink_to_fit();
+                packed.used = it->second.used;
+                m_packed[it->first] = packed;
+                m_packedBytes += packed.data->size();
+            }
+            m_residentBytes -= it->second.bytes;
+            delete it->second.patch;
+            m_resident.erase(it);
+        }
+    }
+
+    if(m_packedBytes > CompressedBudget) {
+        // dropped cells are generated from scratch next time
+        std::vector<std::pair<unsigned long long, unsigned long long>> order;
+        for (auto it = m_packed.begin(); it != m_packed.end(); ++it)
+        {
+            order.push_back(std::make_pair(it->second.used, it->first));
+        }
+        std::sort(order.begin(), order.end());
+        for (size_t i = 0; i < order.size() && m_packedBytes > CompressedBudget; i++)
+        {
+            auto it = m_packed.find(order[i].second);
+            m_packedBytes -= it->second.data->size();
+            m_packed.erase(it);
+        }
+    }
+}
+
+TerrainPatch *TerrainPager::Get(int x, int y) const
+{
+    auto it = m_resident.find(Key(x, y));
+    return it != m_resident.end() ? it->second.patch : nullptr;
+}
+
+void TerrainPager::Resident(std::vector<TerrainPatch*> &patches, std::vector<std::pair<int, int>> &cells) const
+{
+    patches.clear();
+    cells.clear();
+    for (auto it = m_resident.begin(); it != m_resident.end(); ++it)
+    {
+        patches.push_back(it->second.patch);
+        cells.push_back(std::make_pair((int)(unsigned int)(it->first >> 32), (int)(unsigned int)it->first));
+    }
+}
+
+void TerrainPager::Wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_queue.empty() || !m_running.empty()) {
+        m_signal.wait(lock);
+    }
+}
+
+size_t TerrainPager::ResidentBytes() const
+{
+    return m_residentBytes;
+}
+
+size_t TerrainPager::CompressedBytes() const
+{
+    return m_packedBytes;
+}
+
+void TerrainPager::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(;;) {
+        while (!m_stop && m_queue.empty()) {
+            m_signal.wait(lock);
+        }
+        if(m_stop) {
+            return;
+        }
+        Job job = m_queue.front();
+        m_queue.pop_front();
+        unsigned long long key = Key(job.x, job.y);
+        m_running.insert(key);
+        lock.unlock();
+
+        // the other workers take the other cores
+        job.terrain.threads = 1;
+        TerrainPatch *patch = nullptr;
+        bool restored = false;
+        if(job.packed) {
+            Heightmap *map = Heightmap_decompress(&(*job.packed)[0], job.packed->size(), 1);
+            if(map) {
+                TerrainSettings settings = job.terrain;
+                settings.cacheDir = "";
+                patch = new TerrainPatch(job.x, job.y, settings, map);
+                restored = true;
+            }
+        }
+        if(patch == nullptr) {
+            patch = new TerrainPatch(job.x, job.y, job.terrain);
+        }
+        patch->computeVariance(job.varianceLevels, 1);
+
+        lock.lock();
+        m_running.erase(key);
+        Done result;
+        result.key = key;
+        result.patch = patch;
+        result.restored = restored;
+        m_done.push_back(result);
+        m_signal.notify_all();
+    }
+}
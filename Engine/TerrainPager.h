@@ -0,0 +1,109 @@
+#pragma once
+#ifndef TerrainPager_h__
+#define TerrainPager_h__
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "ROAMgrid.h"
+
+//************************************
+// Pages TerrainPatch cells of an unbounded grid in and out around a point.
+// Cells near the point are generated (or restored) on worker threads, the
+// least recently wanted ones are evicted once the resident patches go over
+// MemoryBudget. An evicted cell keeps its heightmap packed with
+// Heightmap_compress, coming back to it skips the noise and only rebuilds
+// normals and variance trees.
+// Everything but the workers runs on the calling thread, patches are deleted
+// there too, so call it from the GL thread.
+//************************************
+class TerrainPager
+{
+public:
+    // threads == 0 uses every core but one
+    TerrainPager(unsigned threads = 0);
+    ~TerrainPager();
+
+    // (x, y) is in cells, cell (i, j) covers [i, i+1) x [j, j+1). Cells within
+    // Radius are wanted: missing ones are queued closest first (replacing the
+    // previous queue), finished ones become resident, then the resident set
+    // is trimmed to MemoryBudget. Pointers from Get/Resident stay valid until
+    // the next Update
+    void Update(float x, float y);
+
+    // resident patch of a cell or nullptr
+    TerrainPatch *Get(int x, int y) const;
+
+    // resident patches and their cells
+    void Resident(std::vector<TerrainPatch*> &patches, std::vector<std::pair<int, int>> &cells) const;
+
+    // blocks until the queue is empty and the workers are idle, for tests
+    void Wait();
+
+    // bytes held by resident patches and by packed evicted cells
+    size_t ResidentBytes() const;
+    size_t CompressedBytes() const;
+
+    // settings are copied when a cell is queued
+    int Radius;
+    size_t MemoryBudget;
+    size_t CompressedBudget;
+    int VarianceLevels;
+    int VarianceBits;
+    // face is ignored, cells are flat
+    TerrainSettings Terrain;
+
+    // cells built from noise (or the disk cache) and from packed heightmaps
+    size_t Generated;
+    size_t Restored;
+
+private:
+    struct Job {
+        int x, y;
+        std::shared_ptr<std::vector<unsigned char>> packed;
+        int varianceLevels;
+        TerrainSettings terrain;
+    };
+    struct Cell {
+        TerrainPatch *patch;
+        size_t bytes;
+        unsigned long long used;
+    };
+    struct Done {
+        unsigned long long key;
+        TerrainPatch *patch;
+        bool restored;
+    };
+    struct Packed {
+        std::shared_ptr<std::vector<unsigned char>> data;
+        unsigned long long used;
+    };
+
+    static unsigned long long Key(int x, int y);
+    static size_t PatchBytes(TerrainPatch *patch);
+    void Run();
+    void Evict();
+
+    std::unordered_map<unsigned long long, Cell> m_resident;
+    std::unordered_map<unsigned long long, Packed> m_packed;
+    size_t m_residentBytes;
+    size_t m_packedBytes;
+    unsigned long long m_frame;
+
+    // shared with the workers
+    std::mutex m_mutex;
+    std::condition_variable m_signal;
+    std::deque<Job> m_queue;
+    std::unordered_set<unsigned long long> m_running;
+    std::vector<Done> m_done;
+    bool m_stop;
+    std::vector<std::thread> m_workers;
+};
+
+#endif // TerrainPager_h__
@@ -12,3 +12,20 @@ size_t BTTNode_number_of_leaves(BTTNode *tree)
             BTTNode_number_of_leaves(tree->right_child);
     }
 }
+
+
+size_t BTTCompactNode_number_of_leaves(const BTTCompactNode *pool, uint32_t tree)
+{
+    uint32_t children;
+
+    if (tree == BTT_COMPACT_NULL)
+        return 0;
+
+    children = pool[tree].children;
+    if (children == BTT_COMPACT_NULL) {
+        return 1;
+    } else {
+        return BTTCompactNode_number_of_leaves(pool, children) +
+            BTTCompactNode_number_of_leaves(pool, children + 1);
+    }
+}
@@ -2,6 +2,7 @@
 #define BINARY_TRIANGLE_TREE_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -57,6 +58,35 @@ extern "C" {
     */
     size_t BTTNode_number_of_leaves(BTTNode *tree);
 
+    /*
+    * Compact layout of the same tree: 32-bit indices into a node pool
+    * instead of pointers (16 bytes per node instead of 40 on x64).
+    * Children are always allocated as an adjacent pair, so a single index
+    * addresses both: left child is pool[children], right is pool[children+1].
+    * Slot 0 of the pool is never used, index 0 means "no node".
+    */
+    typedef struct BTTCompactNodeT
+    {
+        uint32_t children;
+
+        uint32_t base_neighbor;
+        uint32_t left_neighbor;
+        uint32_t right_neighbor;
+
+    } BTTCompactNode;
+
+#define BTT_COMPACT_NULL 0
+
+    /**
+    * Calculate the number of leaves on given compact tree
+    *
+    * @param pool
+    * @param tree index of the root in the pool
+    *
+    * @return number of leaves
+    */
+    size_t BTTCompactNode_number_of_leaves(const BTTCompactNode *pool, uint32_t tree);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -383,7 +383,15 @@ void Game::Run()
     ss.m->material = stm;
 
 
-    ROAMSurface* planet = new ROAMSurface();
+    ROAMSurface* planet = new ROAMSurface("Data/", 16);
+    planet->LinkFaces = true;
+    planet->PixelError = 2;
+    planet->Async = true;
+    planet->FrustumCulling = true;
+    planet->HorizonCulling = true;
+    planet->TargetFrameTime = 1000/60.0f;
+    // new vertices glide in over one update interval
+    planet->MorphTime = 0.2f;
 
     Texture emptytex = Texture();
     emptytex.Empty(vec2(width,height));
@@ -486,6 +494,9 @@ void Game::Run()
     Mouse::SetFixedPosState(true);
     glCullFace(GL_BACK);
     vec3 camlast;
+    // a click on the planet puts the marker cube there
+    bool marked = false;
+    vec3 marker;
     while(Running && !glfwWindowShouldClose(window)) 
     {
         glEnable(GL_DEPTH_TEST);
@@ -638,19 +649,37 @@ void Game::Run()
         lightcam.projection = glm::ortho<float>(-100,100,-100,100,1,100);
 
         sec += gt.elapsed;
+        planet->FrameTime((float)gt.elapsed*1000);
         if(sec > 0.2 && distance(camlast, camera.position) > 0) {
             sec = 0;
-            planet->UpdateCells(camera.position);
-            planet->Bind();
+            planet->FieldOfView = (float)camera.field_of_view;
+            planet->ViewportHeight = (float)height;
+            planet->UpdateCells(camera.position, camera.VP());
         }
+        // uploads when a new tessellation is ready and while it morphs in
+        planet->Bind();
         camlast = camera.position;
 
+        if(Mouse::IsLeftPressed() && !Mouse::GetFixedPosState()) {
+            glm::vec3 ray_origin, ray_dir;
+            float hit;
+            ROAMSurface::CursorRay(camera.VP(), mpos, vec2(width, height), &ray_origin, &ray_dir);
+            if(planet->Pick(ray_origin, ray_dir, &hit)) {
+                marked = true;
+                marker = ray_origin + ray_dir*hit;
+            }
+        }
+
         PointLightSetup(BasicShader->program, pl);
 
         ss.m->World = glm::translate(Identity, camera.position);
 
         
-        cube->World = glm::translate(Identity, vec3(sin(rotated)*150, 2, cos(rotated)*150)) * glm::scale(Identity, vec3(20,20,20));
+        if(marked) {
+            cube->World = glm::translate(Identity, marker) * glm::scale(Identity, vec3(2,2,2));
+        } else {
+            cube->World = glm::translate(Identity, vec3(sin(rotated)*150, 2, cos(rotated)*150)) * glm::scale(Identity, vec3(20,20,20));
+        }
 
         
         ////////////////////////////////////////////////////////////////////////// WORLD PLACE
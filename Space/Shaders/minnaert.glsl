@@ -22,6 +22,7 @@ uniform struct Transform
 } transform;
 
 uniform int NoTangent;
+uniform int PackedNormals;
 
 uniform struct PointLight
 {
@@ -116,6 +117,11 @@ void main(void)
   {
     discard;
   }
+  if (PackedNormals == 1)
+  {
+    // terrain normals, RGB10A2 holds n * 0.5 + 0.5
+    Texcol.rgb = Texcol.rgb * 2.0 - 1.0;
+  }
   vec3 lightDir = normalize(Vert.lightDir);
   vec3 viewDir = normalize(Vert.viewDir);
   
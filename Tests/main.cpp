@@ -3,6 +3,7 @@
 #include <iostream>
 #include "sparse_vector.h"
 #include "sparse_vector_tests.h"
+#include "roam_tests.h"
 #include "test.h"
 
 
@@ -18,6 +19,28 @@ int main(int argc, char *argn[]) {
         base.add(&sparse_vector_tester5());
         base.add(&sparse_vector_tester6());
         base.add(&sparse_vector_tester7());
+        base.add(&roam_incremental_tester());
+        base.add(&roam_compact_pool_tester());
+        base.add(&roam_indexed_tessellation_tester());
+        base.add(&roam_mesh_output_tester());
+        base.add(&roam_async_tester());
+        base.add(&roam_parallel_variance_tester());
+        base.add(&roam_cache_tester());
+        base.add(&roam_quantized_variance_tester());
+        base.add(&roam_culling_tester());
+        base.add(&roam_linked_faces_tester());
+        base.add(&roam_screen_error_tester());
+        base.add(&roam_pager_tester());
+        base.add(&roam_geomorph_tester());
+        base.add(&roam_resolution_tester());
+        base.add(&roam_noise_batch_tester());
+        base.add(&roam_fractal_tester());
+        base.add(&roam_noise_seed_tester());
+        base.add(&roam_sphere_noise_tester());
+        base.add(&roam_normals_tester());
+        base.add(&roam_binary_heightmap_tester());
+        base.add(&roam_pyramid_tester());
+        base.add(&roam_picking_tester());
         base.make_all(BREAK_ON_ERROR);
 
         //LOG(INFO) << "PASSED: " << base.passed();
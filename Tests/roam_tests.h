@@ -0,0 +1,1569 @@
+#pragma once
+#include "ROAMgrid.h"
+#include "AsyncTessellator.h"
+#include "TerrainPager.h"
+#include "ClassicNoise.h"
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "test.h"
+#include "Frustum.h"
+#include <gtc/matrix_transform.hpp>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <float.h>
+
+static double roam_tests_ms(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000.0;
+}
+
+// same leaves, in the same order, from two patches
+static bool roam_tests_same_tessellation(TerrainPatch &a, TerrainPatch &b)
+{
+    size_t leaves = a.amountOfLeaves();
+    if (b.amountOfLeaves() != leaves) {
+        return false;
+    }
+    std::vector<float> va((leaves + 2)*3), vb((leaves + 2)*3);
+    std::vector<GLuint> ia(leaves*3), ib(leaves*3);
+    size_t count = a.getIndexedTessellation(&va[0], &ia[0]);
+    return count == b.getIndexedTessellation(&vb[0], &ib[0]) && ia == ib && va == vb;
+}
+
+// frame-coherent update: the tree matches evaluating every node, budgets hold, moving away merges
+class roam_incremental_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        // down towards the face, along it and back out
+        std::vector<glm::vec3> path;
+        for (int i = 0; i <= 20; i++) {
+            path.push_back(glm::mix(glm::vec3(0, 0, -3), glm::vec3(0.3f, 0.2f, -0.9f), i / 20.0f));
+        }
+        for (int i = 1; i <= 20; i++) {
+            path.push_back(glm::vec3(0.3f, 0.2f, -0.9f) + glm::vec3(i * 0.002f, i * 0.001f, 0));
+        }
+        glm::vec3 closest = path.back();
+        for (int i = 1; i <= 10; i++) {
+            path.push_back(glm::mix(closest, glm::vec3(-0.2f, 0.1f, -2), i / 10.0f));
+        }
+
+        // distance metric and screen-space metric; the second is what the game uses
+        // and the one where a small step leaves most priorities alone. In the first a
+        // node's priority holds its ancestors' distances, they move it on every step
+        float margins[] = { 0.001f, 2 };
+        float scales[] = { 0, TerrainPatch::projectionScale(45, 600) };
+        for (int metric = 0; metric < 2; metric++) {
+            TerrainPatch coherent, full;
+            coherent.computeVariance(20);
+            full.computeVariance(20);
+            bool same = true;
+            size_t nearest = 0;
+            double coherent_ms = 0, full_ms = 0, coherent_small_ms = 0, full_small_ms = 0;
+            for (size_t i = 0; i < path.size(); i++) {
+                auto start = std::chrono::high_resolution_clock::now();
+                coherent.update(path[i], margins[metric], 0, 0, nullptr, false, scales[metric]);
+                double ms = roam_tests_ms(start);
+                start = std::chrono::high_resolution_clock::now();
+                full.reset();
+                full.tessellate(path[i], margins[metric], nullptr, false, scales[metric]);
+                double reference_ms = roam_tests_ms(start);
+                coherent_ms += ms;
+                full_ms += reference_ms;
+                if (i > 20 && i <= 40) {
+                    coherent_small_ms += ms;
+                    full_small_ms += reference_ms;
+                }
+                if (!roam_tests_same_tessellation(coherent, full)) {
+                    LOG(INFO) << "metric " << metric << " step " << i << ": " << coherent.amountOfLeaves() << " leaves, reset()+tessellate() " << full.amountOfLeaves();
+                    same = false;
+                }
+                nearest = std::max(nearest, coherent.amountOfLeaves());
+            }
+            LOG(INFO) << "metric " << metric << ": path of " << path.size() << " updates, coherent " << coherent_ms << " ms, every node " << full_ms << " ms";
+            LOG(INFO) << "metric " << metric << ": small steps, coherent " << coherent_small_ms << " ms, every node " << full_small_ms << " ms";
+            TEST_ASSERT_TRUE(same, showpassed, fail);
+            if (metric) {
+                bool faster = coherent_small_ms < full_small_ms;
+                TEST_ASSERT_TRUE(faster, showpassed, fail);
+            }
+
+            // back out, the close-up detail was merged away
+            bool merged = coherent.amountOfLeaves() < nearest;
+            TEST_ASSERT_TRUE(merged, showpassed, fail);
+
+            // update() goes on from a tree tessellate() built
+            coherent.reset();
+            coherent.tessellate(closest, margins[metric], nullptr, false, scales[metric]);
+            coherent.update(path[0], margins[metric], 0, 0, nullptr, false, scales[metric]);
+            full.reset();
+            full.tessellate(path[0], margins[metric], nullptr, false, scales[metric]);
+            bool continued = roam_tests_same_tessellation(coherent, full);
+            TEST_ASSERT_TRUE(continued, showpassed, fail);
+        }
+
+        // triangle budget
+        TerrainPatch budget;
+        budget.computeVariance(20);
+        for (int i = 20; i <= 40; i += 5) {
+            budget.update(path[i], 0.001f, 2000);
+            bool within = budget.amountOfLeaves() <= 2000;
+            TEST_ASSERT_TRUE(within, showpassed, fail);
+        }
+
+        // time budget: the first call stops early, later ones finish the work
+        TerrainPatch full;
+        full.computeVariance(20);
+        full.update(closest);
+        TerrainPatch timed;
+        timed.computeVariance(20);
+        auto start = std::chrono::high_resolution_clock::now();
+        timed.update(closest, 0.001f, 0, 1.0f);
+        double ms = roam_tests_ms(start);
+        LOG(INFO) << "1 ms budget: " << timed.amountOfLeaves() << " of " << full.amountOfLeaves() << " leaves in " << ms << " ms";
+        bool partial = timed.amountOfLeaves() < full.amountOfLeaves();
+        TEST_ASSERT_TRUE(partial, showpassed, fail);
+        for (int i = 0; i < 1000 && timed.amountOfLeaves() != full.amountOfLeaves(); i++) {
+            timed.update(closest, 0.001f, 0, 1.0f);
+        }
+        bool finished = roam_tests_same_tessellation(timed, full);
+        TEST_ASSERT_TRUE(finished, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// pointer pool vs compact pool: same tessellation, memory and tessellate() time
+class roam_compact_pool_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch pointers, compact;
+        pointers.computeVariance(20);
+        compact.computeVariance(20);
+        compact.setCompactPool(true);
+
+        glm::vec3 views[] = { glm::vec3(0, 0, -1.2f), glm::vec3(0.3f, 0.2f, -0.9f), glm::vec3(0, 0, -3) };
+
+        bool fail = false;
+        for (int v = 0; v < 3; v++) {
+            double pointers_ms = 0, compact_ms = 0;
+            for (int run = 0; run < 10; run++) {
+                auto start = std::chrono::high_resolution_clock::now();
+                pointers.reset();
+                pointers.tessellate(views[v]);
+                pointers_ms += roam_tests_ms(start);
+
+                start = std::chrono::high_resolution_clock::now();
+                compact.reset();
+                compact.tessellate(views[v]);
+                compact_ms += roam_tests_ms(start);
+            }
+            LOG(INFO) << "leaves " << pointers.amountOfLeaves()
+                      << " pointer pool " << pointers.poolBytes() << " bytes " << pointers_ms/10 << " ms,"
+                      << " compact pool " << compact.poolBytes() << " bytes " << compact_ms/10 << " ms";
+
+            TEST_ASSERT_EQUAL(pointers.amountOfLeaves(), compact.amountOfLeaves(), showpassed, fail);
+
+            size_t floats = pointers.amountOfLeaves()*9;
+            std::vector<float> a(floats), b(floats), texels(floats);
+            pointers.getTessellation(&a[0], &texels[0]);
+            compact.getTessellation(&b[0], &texels[0]);
+            bool same_output = a == b;
+            TEST_ASSERT_TRUE(same_output, showpassed, fail);
+
+            std::vector<GLuint> a_indices(pointers.amountOfLeaves()*3), b_indices(a_indices.size());
+            size_t a_count = pointers.getIndexedTessellation(&a[0], &a_indices[0]);
+            size_t b_count = compact.getIndexedTessellation(&b[0], &b_indices[0]);
+            bool same_indexed = a_count == b_count && a_indices == b_indices &&
+                std::equal(a.begin(), a.begin() + a_count*3, b.begin());
+            TEST_ASSERT_TRUE(same_indexed, showpassed, fail);
+        }
+        bool smaller = compact.poolBytes() < pointers.poolBytes();
+        TEST_ASSERT_TRUE(smaller, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// indexed output describes the same triangles as the flat output with fewer vertices
+class roam_indexed_tessellation_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch patch;
+        patch.computeVariance(20);
+        patch.reset();
+        patch.tessellate(glm::vec3(0, 0, -1.2f));
+
+        size_t leaves = patch.amountOfLeaves();
+        std::vector<float> flat(leaves*9), texels(leaves*9), vertices(leaves*9);
+        std::vector<GLuint> indices(leaves*3);
+        patch.getTessellation(&flat[0], &texels[0]);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        size_t count = patch.getIndexedTessellation(&vertices[0], &indices[0]);
+        LOG(INFO) << "leaves " << leaves << " flat vertices " << leaves*3 << " indexed vertices " << count << " " << roam_tests_ms(start) << " ms";
+
+        bool fail = false;
+        bool same_triangles = true;
+        for (size_t i = 0; i < leaves*3; i++) {
+            for (int c = 0; c < 3; c++) {
+                if (vertices[indices[i]*3 + c] != flat[i*3 + c]) {
+                    same_triangles = false;
+                }
+            }
+        }
+        TEST_ASSERT_TRUE(same_triangles, showpassed, fail);
+        bool shared = count <= leaves + 2;
+        TEST_ASSERT_TRUE(shared, showpassed, fail);
+
+        // second call reuses the lookup table
+        size_t again = patch.getIndexedTessellation(&vertices[0], &indices[0]);
+        TEST_ASSERT_EQUAL(again, count, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// getMesh: indexed and flat mesh output describe the same triangles
+class roam_mesh_output_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch patch;
+        patch.computeVariance(20);
+        patch.reset();
+        patch.tessellate(glm::vec3(0.3f, 0.2f, -0.9f));
+
+        std::vector<VertexPositionNormalTexture> flat, shared;
+        std::vector<GLuint> flat_indices, shared_indices;
+        auto start = std::chrono::high_resolution_clock::now();
+        patch.getMesh(flat, flat_indices, false);
+        double flat_ms = roam_tests_ms(start);
+        start = std::chrono::high_resolution_clock::now();
+        patch.getMesh(shared, shared_indices, true);
+        LOG(INFO) << "leaves " << patch.amountOfLeaves() << " flat " << flat_ms << " ms, indexed " << roam_tests_ms(start) << " ms";
+
+        bool fail = false;
+        size_t indices = patch.amountOfLeaves()*3;
+        TEST_ASSERT_EQUAL(flat_indices.size(), indices, showpassed, fail);
+        TEST_ASSERT_EQUAL(shared_indices.size(), indices, showpassed, fail);
+
+        bool same_triangles = true;
+        for (size_t i = 0; i < indices; i++) {
+            const VertexPositionNormalTexture &a = flat[flat_indices[i]];
+            const VertexPositionNormalTexture &b = shared[shared_indices[i]];
+            if (a.Position != b.Position || a.Normal != b.Normal || a.Uv != b.Uv) {
+                same_triangles = false;
+            }
+        }
+        TEST_ASSERT_TRUE(same_triangles, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// AsyncTessellator produces the same tessellation as the synchronous path
+class roam_async_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch sync, async;
+        sync.computeVariance(20);
+        async.computeVariance(20);
+
+        std::vector<TerrainPatch*> patches(1, &async);
+        AsyncTessellator tessellator(patches);
+
+        glm::vec3 views[] = { glm::vec3(0, 0, -1.2f), glm::vec3(0.3f, 0.2f, -0.9f), glm::vec3(0, 0, -3) };
+
+        bool fail = false;
+        for (int v = 0; v < 3; v++) {
+            sync.reset();
+            sync.tessellate(views[v]);
+
+            tessellator.Post(std::vector<glm::vec3>(1, views[v]));
+            tessellator.Wait();
+            bool swapped = tessellator.Swap();
+            TEST_ASSERT_TRUE(swapped, showpassed, fail);
+
+            TEST_ASSERT_EQUAL(async.amountOfLeaves(), sync.amountOfLeaves(), showpassed, fail);
+            size_t indices = sync.amountOfLeaves()*3;
+            TEST_ASSERT_EQUAL(async.m->Indeces.size(), indices, showpassed, fail);
+
+            // nothing new until the next post
+            bool again = tessellator.Swap();
+            TEST_ASSERT_FALSE(again, showpassed, fail);
+        }
+
+        // only the latest of several posts matters
+        tessellator.Post(std::vector<glm::vec3>(1, views[2]));
+        tessellator.Post(std::vector<glm::vec3>(1, views[0]));
+        tessellator.Wait();
+        tessellator.Swap();
+        tessellator.Wait();
+        tessellator.Swap();
+        sync.reset();
+        sync.tessellate(views[0]);
+        TEST_ASSERT_EQUAL(async.amountOfLeaves(), sync.amountOfLeaves(), showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// parallel variance build gives the same trees as the depth-first walk
+class roam_parallel_variance_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch serial, parallel;
+        auto start = std::chrono::high_resolution_clock::now();
+        serial.computeVariance(20, 1);
+        double serial_ms = roam_tests_ms(start);
+        start = std::chrono::high_resolution_clock::now();
+        parallel.computeVariance(20);
+        LOG(INFO) << "computeVariance(20) serial " << serial_ms << " ms, parallel " << roam_tests_ms(start) << " ms";
+
+        glm::vec3 views[] = { glm::vec3(0, 0, -1.2f), glm::vec3(0.3f, 0.2f, -0.9f), glm::vec3(0, 0, -3) };
+
+        bool fail = false;
+        for (int v = 0; v < 3; v++) {
+            serial.reset();
+            serial.tessellate(views[v]);
+            parallel.reset();
+            parallel.tessellate(views[v]);
+            TEST_ASSERT_EQUAL(parallel.amountOfLeaves(), serial.amountOfLeaves(), showpassed, fail);
+
+            std::vector<VertexPositionNormalTexture> a, b;
+            std::vector<GLuint> a_indices, b_indices;
+            serial.getMesh(a, a_indices, false);
+            parallel.getMesh(b, b_indices, false);
+            bool same_mesh = a.size() == b.size();
+            for (size_t i = 0; same_mesh && i < a.size(); i++) {
+                same_mesh = a[i].Position == b[i].Position;
+            }
+            TEST_ASSERT_TRUE(same_mesh, showpassed, fail);
+        }
+
+        return !fail;
+    }
+};
+
+// variance trees and heightmap survive a round trip through the disk cache
+class roam_cache_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+        std::string path;
+        {
+            TerrainSettings settings;
+            settings.cacheDir = ".";
+            auto start = std::chrono::high_resolution_clock::now();
+            TerrainPatch cold(7, 3, settings);
+            cold.computeVariance(16);
+            double cold_ms = roam_tests_ms(start);
+            path = cold.cachePath();
+
+            start = std::chrono::high_resolution_clock::now();
+            TerrainPatch warm(7, 3, settings);
+            warm.computeVariance(16);
+            LOG(INFO) << "cold start " << cold_ms << " ms, warm cache " << roam_tests_ms(start) << " ms";
+
+            bool cached = warm.cached();
+            TEST_ASSERT_TRUE(cached, showpassed, fail);
+
+            Heightmap *a = cold.getHeightmap(), *b = warm.getHeightmap();
+            size_t texels = a->width*a->height;
+            bool same_map = memcmp(a->map, b->map, texels*sizeof(float)) == 0 &&
+                memcmp(a->normal_map, b->normal_map, texels*3*sizeof(float)) == 0;
+            TEST_ASSERT_TRUE(same_map, showpassed, fail);
+
+            glm::vec3 view(0.3f, 0.2f, -0.9f);
+            cold.reset();
+            cold.tessellate(view);
+            warm.reset();
+            warm.tessellate(view);
+            TEST_ASSERT_EQUAL(warm.amountOfLeaves(), cold.amountOfLeaves(), showpassed, fail);
+
+            // other levels are computed, the file stays as it is
+            TerrainPatch other(7, 3, settings);
+            other.computeVariance(14);
+            other.reset();
+            other.tessellate(view);
+            size_t leaves = other.amountOfLeaves();
+            bool tessellated = leaves > 0;
+            TEST_ASSERT_TRUE(tessellated, showpassed, fail);
+
+            // quantized trees are written as they are and mapped back without the floats
+            settings.varianceBits = 16;
+            TerrainPatch cold16(7, 3, settings);
+            cold16.computeVariance(16);
+            start = std::chrono::high_resolution_clock::now();
+            TerrainPatch warm16(7, 3, settings);
+            warm16.computeVariance(16);
+            LOG(INFO) << "warm cache u16 " << roam_tests_ms(start) << " ms";
+
+            bool cached16 = warm16.cached();
+            TEST_ASSERT_TRUE(cached16, showpassed, fail);
+            TEST_ASSERT_EQUAL(warm16.varianceBytes(), cold16.varianceBytes(), showpassed, fail);
+            bool half = warm16.varianceBytes()*2 == warm.varianceBytes();
+            TEST_ASSERT_TRUE(half, showpassed, fail);
+
+            cold16.reset();
+            cold16.tessellate(view);
+            warm16.reset();
+            warm16.tessellate(view);
+            TEST_ASSERT_EQUAL(warm16.amountOfLeaves(), cold16.amountOfLeaves(), showpassed, fail);
+            bool conservative = warm16.amountOfLeaves() >= cold.amountOfLeaves();
+            TEST_ASSERT_TRUE(conservative, showpassed, fail);
+        }
+        remove(path.c_str());
+        return !fail;
+    }
+};
+
+// quantized variance: leaf counts never drop below the float trees, timings and memory compared
+class roam_quantized_variance_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch patches[3];
+        int bits[] = { 32, 16, 8 };
+        for (int i = 0; i < 3; i++) {
+            patches[i].computeVariance(20);
+            patches[i].quantizeVariance(bits[i]);
+        }
+
+        glm::vec3 views[] = { glm::vec3(0, 0, -1.2f), glm::vec3(0.3f, 0.2f, -0.9f), glm::vec3(0, 0, -3) };
+
+        bool fail = false;
+        for (int v = 0; v < 3; v++) {
+            size_t leaves[3];
+            double ms[3];
+            for (int i = 0; i < 3; i++) {
+                ms[i] = 0;
+                for (int run = 0; run < 10; run++) {
+                    auto start = std::chrono::high_resolution_clock::now();
+                    patches[i].reset();
+                    patches[i].tessellate(views[v]);
+                    ms[i] += roam_tests_ms(start);
+                }
+                leaves[i] = patches[i].amountOfLeaves();
+            }
+            LOG(INFO) << "float " << leaves[0] << " leaves " << ms[0]/10 << " ms, "
+                      << "u16 " << leaves[1] << " leaves " << ms[1]/10 << " ms, "
+                      << "u8 " << leaves[2] << " leaves " << ms[2]/10 << " ms";
+
+            bool conservative = leaves[1] >= leaves[0] && leaves[2] >= leaves[0];
+            TEST_ASSERT_TRUE(conservative, showpassed, fail);
+        }
+        LOG(INFO) << "variance bytes float " << patches[0].varianceBytes() << " u16 " << patches[1].varianceBytes() << " u8 " << patches[2].varianceBytes();
+
+        bool smaller = patches[2].varianceBytes() < patches[1].varianceBytes() && patches[1].varianceBytes() < patches[0].varianceBytes();
+        TEST_ASSERT_TRUE(smaller, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// horizon and frustum culling only drop refinement the camera cannot see
+// rotations of the six cube faces, as ROAMSurface places them (without its scale)
+static void roam_tests_face_worlds(glm::mat4 worlds[6])
+{
+    worlds[0] = glm::mat4(1);
+    worlds[1] = glm::rotate(glm::mat4(1), 3.14159265f, glm::vec3(1, 0, 0));
+    worlds[2] = glm::rotate(glm::mat4(1), 1.57079633f, glm::vec3(1, 0, 0));
+    worlds[3] = glm::rotate(glm::mat4(1), -1.57079633f, glm::vec3(1, 0, 0));
+    worlds[4] = glm::rotate(glm::mat4(1), 1.57079633f, glm::vec3(0, 1, 0));
+    worlds[5] = glm::rotate(glm::mat4(1), -1.57079633f, glm::vec3(0, 1, 0));
+}
+
+class roam_culling_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch patch;
+        patch.computeVariance(20);
+        bool fail = false;
+
+        // low over the edge of the face, half of it is behind the limb
+        glm::vec3 side(0.9f, 0, -0.7f);
+        patch.reset();
+        patch.tessellate(side);
+        size_t all = patch.amountOfLeaves();
+        auto start = std::chrono::high_resolution_clock::now();
+        patch.reset();
+        patch.tessellate(side, 0.001f, nullptr, true);
+        size_t horizon = patch.amountOfLeaves();
+        LOG(INFO) << "horizon culling " << all << " -> " << horizon << " leaves " << roam_tests_ms(start) << " ms";
+        bool fewer = horizon < all;
+        TEST_ASSERT_TRUE(fewer, showpassed, fail);
+
+        // high above the face everything is in front of the horizon
+        glm::vec3 above(0, 0, -2.0f);
+        patch.reset();
+        patch.tessellate(above);
+        all = patch.amountOfLeaves();
+        patch.reset();
+        patch.tessellate(above, 0.001f, nullptr, true);
+        horizon = patch.amountOfLeaves();
+        TEST_ASSERT_EQUAL(horizon, all, showpassed, fail);
+
+        // 60 degree frustum looking at one corner of the face
+        float f = 1.0f / tanf(0.5236f), n = 0.01f, far_clip = 10.0f;
+        glm::mat4 projection(0.0f);
+        projection[0][0] = f;
+        projection[1][1] = f;
+        projection[2][2] = -(far_clip + n) / (far_clip - n);
+        projection[2][3] = -1;
+        projection[3][2] = -2*far_clip*n / (far_clip - n);
+        glm::mat4 view = glm::lookAt(above, glm::vec3(0.4f, 0.4f, -0.6f), glm::vec3(0, 1, 0));
+        Frustum frustum;
+        frustum.Build(projection * view);
+
+        bool in = frustum.ContainsSphere(glm::vec3(0.35f, 0.35f, -0.65f), 0.01f) == INERSECT_IN;
+        TEST_ASSERT_TRUE(in, showpassed, fail);
+        bool out = frustum.ContainsSphere(glm::vec3(-0.5f, -0.5f, -0.6f), 0.01f) == INERSECT_OUT;
+        TEST_ASSERT_TRUE(out, showpassed, fail);
+
+        start = std::chrono::high_resolution_clock::now();
+        patch.reset();
+        patch.tessellate(above, 0.001f, &frustum, true);
+        size_t culled = patch.amountOfLeaves();
+        LOG(INFO) << "frustum culling " << all << " -> " << culled << " leaves " << roam_tests_ms(start) << " ms";
+        fewer = culled < all;
+        TEST_ASSERT_TRUE(fewer, showpassed, fail);
+
+        // the incremental path agrees with the full rebuild
+        patch.update(above, 0.001f, 0, 0, &frustum, true);
+        size_t incremental = patch.amountOfLeaves();
+        TEST_ASSERT_EQUAL(incremental, culled, showpassed, fail);
+
+        // the whole planet as ROAMSurface draws it (six faces, one pixel of screen
+        // error), low over face 0: the other five faces are behind the limb
+        glm::mat4 worlds[6];
+        roam_tests_face_worlds(worlds);
+        glm::vec3 cam = normalize(glm::vec3(0.2f, 0.1f, -1)) * 1.05f;
+        float pixelError = 1, scale = TerrainPatch::projectionScale(45, 600);
+        size_t planet_all = 0, planet_horizon = 0;
+        double planet_ms = 0;
+        for (int i = 0; i < 6; i++) {
+            TerrainSettings settings;
+            settings.face = &worlds[i];
+            TerrainPatch face(0, 0, settings);
+            face.computeVariance(20);
+            glm::vec3 view = glm::inverse(glm::mat3(worlds[i])) * cam;
+            face.reset();
+            face.tessellate(view, pixelError, nullptr, false, scale);
+            size_t face_all = face.amountOfLeaves();
+            start = std::chrono::high_resolution_clock::now();
+            face.reset();
+            face.tessellate(view, pixelError, nullptr, true, scale);
+            planet_ms += roam_tests_ms(start);
+            size_t face_horizon = face.amountOfLeaves();
+            LOG(INFO) << "face " << i << " horizon culling " << face_all << " -> " << face_horizon << " leaves";
+            planet_all += face_all;
+            planet_horizon += face_horizon;
+
+            // hidden faces keep only the coarse levels that are never culled
+            if (i > 0) {
+                bool hidden = face_horizon*10 <= face_all;
+                TEST_ASSERT_TRUE(hidden, showpassed, fail);
+            }
+        }
+        LOG(INFO) << "planet horizon culling " << planet_all << " -> " << planet_horizon << " leaves " << planet_ms << " ms";
+        bool quarter = planet_horizon*4 <= planet_all*3;
+        TEST_ASSERT_TRUE(quarter, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// border vertices of a face (on the unit sphere) that the face across the seam does not have
+static size_t roam_tests_seam_t_junctions(const std::vector<TerrainPatch*> &faces)
+{
+    std::vector<std::vector<glm::vec3>> borders(faces.size());
+    for (size_t i = 0; i < faces.size(); i++) {
+        size_t leaves = faces[i]->amountOfLeaves();
+        std::vector<float> vertices((leaves + 2)*3);
+        std::vector<GLuint> indices(leaves*3);
+        size_t count = faces[i]->getIndexedTessellation(&vertices[0], &indices[0]);
+        for (size_t v = 0; v < count; v++) {
+            float x = vertices[v*3], y = vertices[v*3+1];
+            if (x == 0 || y == 0 || x == 1 || y == 1) {
+                glm::vec3 local = normalize(glm::vec3(x - 0.5f, y - 0.5f, -0.5f));
+                borders[i].push_back(normalize(glm::mat3(faces[i]->m->World) * local));
+            }
+        }
+    }
+    size_t unmatched = 0;
+    for (size_t i = 0; i < faces.size(); i++) {
+        for (size_t v = 0; v < borders[i].size(); v++) {
+            bool found = false;
+            for (size_t j = 0; j < faces.size() && !found; j++) {
+                for (size_t k = 0; j != i && k < borders[j].size() && !found; k++) {
+                    found = glm::distance(borders[i][v], borders[j][k]) < 1e-5f;
+                }
+            }
+            if (!found) {
+                unmatched++;
+            }
+        }
+    }
+    return unmatched;
+}
+
+// largest world distance between displaced getMesh vertices that two faces share on a seam
+static float roam_tests_seam_gap(const std::vector<TerrainPatch*> &faces)
+{
+    std::vector<std::vector<glm::vec3>> borders(faces.size());
+    for (size_t i = 0; i < faces.size(); i++) {
+        std::vector<VertexPositionNormalTexture> verteces;
+        std::vector<GLuint> indeces;
+        faces[i]->getMesh(verteces, indeces);
+        for (size_t v = 0; v < verteces.size(); v++) {
+            const glm::vec2 &uv = verteces[v].Uv;
+            if (uv.x == 0 || uv.y == 0 || uv.x == 1 || uv.y == 1) {
+                borders[i].push_back(glm::vec3(faces[i]->m->World * glm::vec4(verteces[v].Position, 1)));
+            }
+        }
+    }
+    float gap = 0;
+    for (size_t i = 0; i < faces.size(); i++) {
+        for (size_t v = 0; v < borders[i].size(); v++) {
+            for (size_t j = i + 1; j < faces.size(); j++) {
+                for (size_t k = 0; k < borders[j].size(); k++) {
+                    if (glm::distance(normalize(borders[i][v]), normalize(borders[j][k])) < 1e-5f) {
+                        gap = std::max(gap, glm::distance(borders[i][v], borders[j][k]));
+                    }
+                }
+            }
+        }
+    }
+    return gap;
+}
+
+// six cube faces: independent trees leave T-junctions on the seams, linked ones do not
+class roam_linked_faces_tester : public test{
+    virtual bool make(int showpassed){
+        glm::mat4 worlds[6];
+        roam_tests_face_worlds(worlds);
+        // sphere noise, the heights agree along the seams
+        std::vector<TerrainPatch*> faces;
+        for (int i = 0; i < 6; i++) {
+            TerrainSettings settings;
+            settings.face = &worlds[i];
+            TerrainPatch *face = new TerrainPatch(0, 0, settings);
+            face->computeVariance(20);
+            faces.push_back(face);
+        }
+        bool fail = false;
+
+        // close to the seam between two faces, near a cube corner
+        glm::vec3 cam = normalize(glm::vec3(0.6f, 0.5f, -0.62f)) * 1.05f;
+        std::vector<glm::vec3> views;
+        for (int i = 0; i < 6; i++) {
+            views.push_back(glm::inverse(glm::mat3(worlds[i])) * cam);
+        }
+
+        size_t leaves = 0;
+        for (int i = 0; i < 6; i++) {
+            faces[i]->reset();
+            faces[i]->tessellate(views[i]);
+            leaves += faces[i]->amountOfLeaves();
+        }
+        size_t independent = roam_tests_seam_t_junctions(faces);
+        LOG(INFO) << "independent faces " << leaves << " leaves, " << independent << " seam T-junctions";
+        bool cracks = independent > 0;
+        TEST_ASSERT_TRUE(cracks, showpassed, fail);
+
+        TerrainPatch::linkPatches(faces);
+        for (int i = 0; i < 6; i++) {
+            TEST_ASSERT_EQUAL(faces[i]->linkedEdges(), 4, showpassed, fail);
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        TerrainPatch::tessellateLinked(faces, views);
+        double ms = roam_tests_ms(start);
+        size_t linked_leaves = 0;
+        for (int i = 0; i < 6; i++) {
+            linked_leaves += faces[i]->amountOfLeaves();
+        }
+        size_t linked = roam_tests_seam_t_junctions(faces);
+        LOG(INFO) << "linked faces " << linked_leaves << " leaves, " << linked << " seam T-junctions " << ms << " ms";
+        TEST_ASSERT_EQUAL(linked, 0, showpassed, fail);
+        // and the displaced vertices they share are the same points
+        float gap = roam_tests_seam_gap(faces);
+        LOG(INFO) << "largest seam vertex gap " << gap;
+        bool closed = gap < 1e-4f;
+        TEST_ASSERT_TRUE(closed, showpassed, fail);
+
+        // unlinking gives the independent tessellation back
+        TerrainPatch::unlinkPatches(faces);
+        leaves = 0;
+        for (int i = 0; i < 6; i++) {
+            faces[i]->tessellate(views[i]);
+            leaves += faces[i]->amountOfLeaves();
+        }
+        TEST_ASSERT_EQUAL(roam_tests_seam_t_junctions(faces), independent, showpassed, fail);
+
+        for (int i = 0; i < 6; i++) {
+            delete faces[i];
+        }
+        return !fail;
+    }
+};
+
+// screen-space metric: leaves follow the pixel tolerance and the distance, no forced levels
+class roam_screen_error_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch patch;
+        patch.computeVariance(20);
+        bool fail = false;
+
+        float scale = TerrainPatch::projectionScale(90, 600);
+        bool right_angle = fabs(scale - 300) < 0.01f;
+        TEST_ASSERT_TRUE(right_angle, showpassed, fail);
+        scale = TerrainPatch::projectionScale(45, 600);
+
+        glm::vec3 near_view(0.1f, 0.1f, -0.7f);
+        size_t leaves[3];
+        float pixels[3] = {16, 6, 2};
+        for (int i = 0; i < 3; i++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            patch.reset();
+            patch.tessellate(near_view, pixels[i], nullptr, false, scale);
+            leaves[i] = patch.amountOfLeaves();
+            LOG(INFO) << pixels[i] << " px " << leaves[i] << " leaves " << roam_tests_ms(start) << " ms";
+        }
+        bool finer = leaves[0] < leaves[1] && leaves[1] < leaves[2];
+        TEST_ASSERT_TRUE(finer, showpassed, fail);
+
+        // far away the face is a few pixels, nothing is split just because it is shallow
+        patch.reset();
+        patch.tessellate(glm::vec3(0, 0, -200), 2, nullptr, false, scale);
+        size_t far_leaves = patch.amountOfLeaves();
+        bool coarse = far_leaves < 64;
+        TEST_ASSERT_TRUE(coarse, showpassed, fail);
+
+        // the incremental path follows the same metric and ends on the same tree
+        TerrainPatch coherent;
+        coherent.computeVariance(20);
+        coherent.update(glm::vec3(0, 0, -3), 2, 0, 0, nullptr, false, scale);
+        coherent.update(near_view, 2, 0, 0, nullptr, false, scale);
+        patch.reset();
+        patch.tessellate(near_view, 2, nullptr, false, scale);
+        LOG(INFO) << "full " << patch.amountOfLeaves() << " incremental " << coherent.amountOfLeaves() << " leaves";
+        bool same = roam_tests_same_tessellation(coherent, patch);
+        TEST_ASSERT_TRUE(same, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// pager: a cell leaves when the budget is full and comes back from its packed heightmap
+class roam_pager_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPager pager(1);
+        pager.Radius = 0;
+        pager.VarianceLevels = 14;
+        bool fail = false;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        pager.Update(0.5f, 0.5f);
+        pager.Wait();
+        pager.Update(0.5f, 0.5f);
+        LOG(INFO) << "generated cell " << roam_tests_ms(start) << " ms, " << pager.ResidentBytes() << " bytes";
+        TerrainPatch *first = pager.Get(0, 0);
+        bool resident = first != nullptr;
+        TEST_ASSERT_TRUE(resident, showpassed, fail);
+        if (!resident) {
+            return false;
+        }
+        Heightmap *map = first->getHeightmap();
+        std::vector<float> heights(map->map, map->map + map->width*map->height);
+
+        // room for a single cell
+        pager.MemoryBudget = pager.ResidentBytes();
+        pager.Update(1.5f, 0.5f);
+        pager.Wait();
+        pager.Update(1.5f, 0.5f);
+        bool moved = pager.Get(1, 0) != nullptr && pager.Get(0, 0) == nullptr;
+        TEST_ASSERT_TRUE(moved, showpassed, fail);
+        bool bounded = pager.ResidentBytes() <= pager.MemoryBudget;
+        TEST_ASSERT_TRUE(bounded, showpassed, fail);
+        size_t packed = pager.CompressedBytes();
+        LOG(INFO) << "packed heightmap " << packed << " bytes, " << heights.size()*sizeof(float) << " as floats";
+        bool small = packed > 0 && packed < heights.size()*sizeof(float)/2;
+        TEST_ASSERT_TRUE(small, showpassed, fail);
+
+        start = std::chrono::high_resolution_clock::now();
+        pager.Update(0.5f, 0.5f);
+        pager.Wait();
+        pager.Update(0.5f, 0.5f);
+        LOG(INFO) << "restored cell " << roam_tests_ms(start) << " ms";
+        TEST_ASSERT_EQUAL(pager.Generated, 2, showpassed, fail);
+        TEST_ASSERT_EQUAL(pager.Restored, 1, showpassed, fail);
+        TerrainPatch *back = pager.Get(0, 0);
+        resident = back != nullptr;
+        TEST_ASSERT_TRUE(resident, showpassed, fail);
+        if (resident) {
+            float error = 0;
+            for (size_t i = 0; i < heights.size(); i++) {
+                float diff = fabsf(back->getHeightmap()->map[i] - heights[i]);
+                if (diff > error) {
+                    error = diff;
+                }
+            }
+            bool close = error <= 1.0f/65535;
+            TEST_ASSERT_TRUE(close, showpassed, fail);
+        }
+
+        return !fail;
+    }
+};
+
+// geomorph: vertices a finer tessellation adds start on the coarser surface
+class roam_geomorph_tester : public test{
+    virtual bool make(int showpassed){
+        TerrainPatch patch;
+        patch.computeVariance(20);
+        bool fail = false;
+
+        std::vector<VertexPositionNormalTexture> far_verteces;
+        std::vector<GLuint> indeces;
+        std::vector<MorphTarget> morphs;
+        patch.reset();
+        patch.tessellate(glm::vec3(0, 0, -3));
+        patch.getMesh(far_verteces, indeces, true, &morphs);
+        TEST_ASSERT_EQUAL(morphs.size(), 0, showpassed, fail);
+
+        std::vector<VertexPositionNormalTexture> verteces;
+        patch.reset();
+        patch.tessellate(glm::vec3(0.1f, 0.1f, -0.6f));
+        patch.getMesh(verteces, indeces, true, &morphs);
+        LOG(INFO) << far_verteces.size() << " -> " << verteces.size() << " verteces, " << morphs.size() << " morphing";
+        bool some = morphs.size() > 0;
+        TEST_ASSERT_TRUE(some, showpassed, fail);
+
+        // exactly the vertices the far mesh did not have
+        size_t added = 0;
+        for (size_t i = 0; i < verteces.size(); i++) {
+            bool known = false;
+            for (size_t j = 0; j < far_verteces.size() && !known; j++) {
+                known = verteces[i].Uv == far_verteces[j].Uv;
+            }
+            if (!known) {
+                added++;
+            }
+        }
+        TEST_ASSERT_EQUAL(morphs.size(), added, showpassed, fail);
+        bool targets = true;
+        for (size_t i = 0; i < morphs.size() && targets; i++) {
+            targets = morphs[i].index < verteces.size() && morphs[i].to == verteces[morphs[i].index].Position;
+        }
+        TEST_ASSERT_TRUE(targets, showpassed, fail);
+
+        // nothing new, nothing moves
+        patch.getMesh(verteces, indeces, true, &morphs);
+        TEST_ASSERT_EQUAL(morphs.size(), 0, showpassed, fail);
+
+        // the blend ends on the real surface
+        patch.reset();
+        patch.tessellate(glm::vec3(0, 0, -3));
+        patch.getMesh(patch.m->Verteces, patch.m->Indeces);
+        patch.getMesh(patch.m->Verteces, patch.m->Indeces, true, &patch.Morphs);
+        patch.reset();
+        patch.tessellate(glm::vec3(0.1f, 0.1f, -0.6f));
+        patch.getMesh(patch.m->Verteces, patch.m->Indeces, true, &patch.Morphs);
+        std::vector<MorphTarget> started = patch.Morphs;
+        patch.morph(0);
+        bool from = started.empty() || patch.m->Verteces[started[0].index].Position == started[0].from;
+        TEST_ASSERT_TRUE(from, showpassed, fail);
+        patch.morph(1);
+        bool done = patch.Morphs.empty();
+        TEST_ASSERT_TRUE(done, showpassed, fail);
+        bool to = true;
+        for (size_t i = 0; i < started.size() && to; i++) {
+            to = patch.m->Verteces[started[i].index].Position == started[i].to;
+        }
+        TEST_ASSERT_TRUE(to, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// resolution: generated maps of any size, rectangular maps addressed row-major
+class roam_resolution_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        Heightmap *rect = new Heightmap();
+        rect->width = 65;
+        rect->height = 33;
+        rect->external = false;
+        rect->map = new float[rect->width*rect->height];
+        rect->minZ = 0;
+        rect->maxZ = 1;
+        for (size_t y = 0; y < rect->height; y++) {
+            for (size_t x = 0; x < rect->width; x++) {
+                rect->map[y*rect->width + x] = x/64.0f;
+            }
+        }
+        bool row_major = Heightmap_get(rect, 64, 0) == 1.0f && Heightmap_get(rect, 3, 32) == 3/64.0f;
+        TEST_ASSERT_TRUE(row_major, showpassed, fail);
+        // a slope along x leans every inner normal the same way
+        Heightmap_calculate_normals(rect);
+        float nx, ny, nz, last_x, last_y, last_z;
+        Heightmap_get_normal(rect, 1, 1, &last_x, &last_y, &last_z);
+        Heightmap_get_normal(rect, 63, 31, &nx, &ny, &nz);
+        bool normals = nx == last_x && ny == last_y && nz == last_z && nx > 0;
+        TEST_ASSERT_TRUE(normals, showpassed, fail);
+
+        TerrainPatch adopted(0, 0, TerrainSettings(), rect);
+        TEST_ASSERT_EQUAL(adopted.maxLevels(), 11, showpassed, fail);
+        adopted.computeVariance(20);
+        adopted.reset();
+        adopted.tessellate(glm::vec3(0.1f, 0.1f, -0.6f));
+        std::vector<VertexPositionNormalTexture> verteces;
+        std::vector<GLuint> indeces;
+        adopted.getMesh(verteces, indeces);
+        bool in_range = verteces.size() > 0;
+        for (size_t i = 0; i < verteces.size() && in_range; i++) {
+            in_range = verteces[i].Uv.x >= 0 && verteces[i].Uv.x <= 1 && verteces[i].Uv.y >= 0 && verteces[i].Uv.y <= 1;
+        }
+        TEST_ASSERT_TRUE(in_range, showpassed, fail);
+
+        // same terrain, a quarter of the texels per axis (each map is normalized by its own peak)
+        TerrainSettings settings;
+        settings.resolution = 257;
+        auto start = std::chrono::high_resolution_clock::now();
+        TerrainPatch coarse(0, 0, settings);
+        coarse.computeVariance(20);
+        LOG(INFO) << "257 patch " << roam_tests_ms(start) << " ms, variance " << coarse.varianceBytes() << " bytes";
+        TerrainPatch fine;
+        TEST_ASSERT_EQUAL(coarse.getHeightmap()->width, 257, showpassed, fail);
+        TEST_ASSERT_EQUAL(coarse.maxLevels(), 16, showpassed, fail);
+        TEST_ASSERT_EQUAL(fine.maxLevels(), 20, showpassed, fail);
+        bool same = true;
+        for (int y = 0; y < 257 && same; y += 16) {
+            for (int x = 0; x < 257 && same; x += 16) {
+                same = fabsf(Heightmap_get(coarse.getHeightmap(), x, y) - Heightmap_get(fine.getHeightmap(), x*4, y*4)) < 0.05f;
+            }
+        }
+        TEST_ASSERT_TRUE(same, showpassed, fail);
+        coarse.reset();
+        coarse.tessellate(glm::vec3(0.1f, 0.1f, -0.6f));
+        bool split = coarse.amountOfLeaves() > 2;
+        TEST_ASSERT_TRUE(split, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// batched noise: every kernel matches the scalar functions and the row helper
+class roam_noise_batch_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+        const size_t count = 1 << 20;
+        std::vector<float> x(count), y(count), z(count), scalar(count), batch(count);
+        srand(7);
+        for (size_t i = 0; i < count; i++) {
+            x[i] = (rand() - RAND_MAX/2)/(float)RAND_MAX*600;
+            y[i] = (rand() - RAND_MAX/2)/(float)RAND_MAX*600;
+            z[i] = (rand() - RAND_MAX/2)/(float)RAND_MAX*600;
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            scalar[i] = simplexnoise(x[i], y[i]);
+        }
+        double scalar_ms = roam_tests_ms(start);
+        std::vector<float> scalar3(count);
+        start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            scalar3[i] = simplexnoise(x[i], y[i], z[i]);
+        }
+        double scalar3_ms = roam_tests_ms(start);
+        LOG(INFO) << "scalar 2d " << scalar_ms << " ms, 3d " << scalar3_ms << " ms";
+
+        NoiseKernel best = noiseKernel();
+        const char *names[] = {"scalar", "sse2", "avx2"};
+        for (int k = NOISE_KERNEL_SCALAR; k <= best; k++) {
+            setNoiseKernel((NoiseKernel)k);
+            TEST_ASSERT_EQUAL(noiseKernel(), k, showpassed, fail);
+            // odd count for the tail
+            start = std::chrono::high_resolution_clock::now();
+            simplexnoise(&x[0], &y[0], &batch[0], count - 3);
+            double ms = roam_tests_ms(start);
+            float error = 0;
+            for (size_t i = 0; i < count - 3; i++) {
+                float diff = fabsf(batch[i] - scalar[i]);
+                if (diff > error) {
+                    error = diff;
+                }
+            }
+            start = std::chrono::high_resolution_clock::now();
+            simplexnoise(&x[0], &y[0], &z[0], &batch[0], count - 5);
+            double ms3 = roam_tests_ms(start);
+            float error3 = 0;
+            for (size_t i = 0; i < count - 5; i++) {
+                float diff = fabsf(batch[i] - scalar3[i]);
+                if (diff > error3) {
+                    error3 = diff;
+                }
+            }
+            LOG(INFO) << names[k] << " 2d " << ms << " ms, error " << error << ", 3d " << ms3 << " ms, error " << error3;
+            bool close = error < 1e-5f && error3 < 1e-5f;
+            TEST_ASSERT_TRUE(close, showpassed, fail);
+        }
+        setNoiseKernel(best);
+
+        float row[100];
+        simplexnoise_row(3.5f, -2.0f, 0, 1/64.0f, row, 100);
+        bool same_row = fabsf(row[99] - simplexnoise(3.5f, -2.0f + 99/64.0f)) < 1e-5f;
+        TEST_ASSERT_TRUE(same_row, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// fractal noise: fused octaves match the plain sum, tiles fill the whole map
+class roam_fractal_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        FractalNoise fbm;
+        fbm.Octaves = 3;
+        fbm.Frequency = 1/64.0f;
+        float x = 37.25f, y = -81.5f;
+        float sum = simplexnoise(x/64, y/64) + simplexnoise(x/32, y/32)*0.5f + simplexnoise(x/16, y/16)*0.25f;
+        bool octaves = fabsf(fbm.Get(x, y) - sum) < 1e-6f;
+        TEST_ASSERT_TRUE(octaves, showpassed, fail);
+
+        FractalType types[] = {FRACTAL_FBM, FRACTAL_RIDGED, FRACTAL_BILLOW};
+        float xs[37], ys[37], out[37];
+        for (int i = 0; i < 37; i++) {
+            xs[i] = i*3.7f - 50;
+            ys[i] = i*1.3f + 20;
+        }
+        for (int t = 0; t < 3; t++) {
+            FractalNoise f;
+            f.Type = types[t];
+            f.Frequency = 1/16.0f;
+            f.Warp = 2;
+            f.WarpFrequency = 1/32.0f;
+            f.Get(xs, ys, out, 37);
+            bool batched = true;
+            for (int i = 0; i < 37 && batched; i++) {
+                batched = fabsf(out[i] - f.Get(xs[i], ys[i])) < 1e-5f;
+            }
+            TEST_ASSERT_TRUE(batched, showpassed, fail);
+        }
+        FractalNoise ridged;
+        ridged.Type = FRACTAL_RIDGED;
+        bool positive = ridged.Get(3.3f, 4.4f) >= 0;
+        TEST_ASSERT_TRUE(positive, showpassed, fail);
+
+        Heightmap map;
+        map.width = 1025;
+        map.height = 1025;
+        map.external = false;
+        map.normal_map = nullptr;
+        std::vector<float> values(map.width*map.height), single(map.width*map.height);
+        map.map = &single[0];
+        auto start = std::chrono::high_resolution_clock::now();
+        fbm.Fill(&map, 64, 128, 1, 1);
+        LOG(INFO) << "fractal fill 1 thread " << roam_tests_ms(start) << " ms";
+        map.map = &values[0];
+        start = std::chrono::high_resolution_clock::now();
+        fbm.Fill(&map, 64, 128, 1);
+        LOG(INFO) << "fractal fill " << roam_tests_ms(start) << " ms";
+        bool same = values == single;
+        TEST_ASSERT_TRUE(same, showpassed, fail);
+        bool placed = fabsf(values[1000*map.width + 3] - fbm.Get(64 + 3, 128 + 1000)) < 1e-5f;
+        TEST_ASSERT_TRUE(placed, showpassed, fail);
+        float low = values[0], high = values[0];
+        for (size_t i = 0; i < values.size(); i++) {
+            if (values[i] < low) {
+                low = values[i];
+            }
+            if (values[i] > high) {
+                high = values[i];
+            }
+        }
+        bool range = map.minZ == low && map.maxZ == high;
+        TEST_ASSERT_TRUE(range, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// seeded noise: seed 0 is the reference field, other seeds are other fields
+class roam_noise_seed_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        Noise reference, a(1), b(2), again(1);
+        bool same = reference.Simplex(3.7f, 1.2f) == simplexnoise(3.7f, 1.2f) &&
+            reference.Simplex(3.7f, 1.2f, -4.1f) == simplexnoise(3.7f, 1.2f, -4.1f) &&
+            reference.Classic(3.7f, 1.2f, -4.1f) == noise(3.7f, 1.2f, -4.1f);
+        TEST_ASSERT_TRUE(same, showpassed, fail);
+
+        const Noise::Tables &tables = a.GetTables();
+        bool seen[256] = {false};
+        bool permutation = true;
+        for (int i = 0; i < 256 && permutation; i++) {
+            permutation = !seen[tables.perm[i]] && tables.perm[i + 256] == tables.perm[i];
+            seen[tables.perm[i]] = true;
+        }
+        TEST_ASSERT_TRUE(permutation, showpassed, fail);
+
+        int differ_a = 0, differ_b = 0, repeat = 0;
+        float xs[64], ys[64], batched[64];
+        for (int i = 0; i < 64; i++) {
+            xs[i] = i*0.71f;
+            ys[i] = i*0.37f - 5;
+            float na = a.Simplex(xs[i], ys[i]);
+            differ_a += na != reference.Simplex(xs[i], ys[i]);
+            differ_b += na != b.Simplex(xs[i], ys[i]);
+            repeat += na == again.Simplex(xs[i], ys[i]);
+        }
+        bool independent = differ_a > 48 && differ_b > 48 && repeat == 64;
+        TEST_ASSERT_TRUE(independent, showpassed, fail);
+
+        a.Simplex(xs, ys, batched, 64);
+        bool kernels = true;
+        for (int i = 0; i < 64 && kernels; i++) {
+            kernels = fabsf(batched[i] - a.Simplex(xs[i], ys[i])) < 1e-5f;
+        }
+        TEST_ASSERT_TRUE(kernels, showpassed, fail);
+
+        TerrainSettings settings;
+        settings.resolution = 65;
+        settings.seed = 1;
+        TerrainPatch first(0, 0, settings);
+        settings.seed = 2;
+        TerrainPatch second(0, 0, settings);
+        bool terrain = memcmp(first.getHeightmap()->map, second.getHeightmap()->map, 65*65*sizeof(float)) != 0;
+        TEST_ASSERT_TRUE(terrain, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// cube-sphere faces sample the noise on the sphere and agree along shared edges
+class roam_sphere_noise_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        FractalNoise noise;
+        noise.Octaves = 4;
+        noise.Warp = 2;
+        float xs[37], ys[37], zs[37], batched[37];
+        for (int i = 0; i < 37; i++) {
+            xs[i] = i*0.71f - 9;
+            ys[i] = i*0.37f;
+            zs[i] = 4 - i*0.53f;
+        }
+        noise.Get(xs, ys, zs, batched, 37);
+        bool kernels = true;
+        for (int i = 0; i < 37 && kernels; i++) {
+            kernels = fabsf(batched[i] - noise.Get(xs[i], ys[i], zs[i])) < 1e-4f;
+        }
+        TEST_ASSERT_TRUE(kernels, showpassed, fail);
+
+        // the +z face and the face turned a quarter around y, scaled like ROAMSurface's
+        const int size = 65;
+        glm::mat4 front(500), side(0);
+        side[0] = glm::vec4(0, 0, -500, 0);
+        side[1] = glm::vec4(0, 500, 0, 0);
+        side[2] = glm::vec4(500, 0, 0, 0);
+        side[3] = glm::vec4(0, 0, 0, 1);
+        front[3][3] = 1;
+        TerrainSettings settings;
+        settings.resolution = size;
+        settings.seed = 3;
+        settings.face = &front;
+        auto start = std::chrono::high_resolution_clock::now();
+        TerrainPatch a(0, 0, settings);
+        settings.face = &side;
+        TerrainPatch b(0, 0, settings);
+        LOG(INFO) << "two " << size << " sphere faces " << roam_tests_ms(start) << " ms";
+
+        // column 0 of the front face lies on column size-1 of the side face
+        bool shared = true, seamless = true;
+        for (int row = 0; row < size; row++) {
+            float v = row/(float)(size - 1) - 0.5f;
+            glm::vec4 pa = front*glm::vec4(-0.5f, v, -0.5f, 1), pb = side*glm::vec4(0.5f, v, -0.5f, 1);
+            shared = shared && fabsf(pa.x - pb.x) < 1e-3f && fabsf(pa.y - pb.y) < 1e-3f && fabsf(pa.z - pb.z) < 1e-3f;
+            float ha = a.getHeightmap()->map[row*size], hb = b.getHeightmap()->map[row*size + size - 1];
+            seamless = seamless && fabsf(ha - hb) < 1e-4f;
+        }
+        TEST_ASSERT_TRUE(shared, showpassed, fail);
+        TEST_ASSERT_TRUE(seamless, showpassed, fail);
+
+        bool differ = memcmp(a.getHeightmap()->map, b.getHeightmap()->map, size*size*sizeof(float)) != 0;
+        TEST_ASSERT_TRUE(differ, showpassed, fail);
+
+        // displaced mesh vertices on the seam land on the same world points from both faces
+        glm::vec3 eye = glm::vec3(front*glm::vec4(normalize(glm::vec3(-0.5f, 0.1f, -0.5f))*1.1f, 1));
+        TerrainPatch *faces[2] = { &a, &b };
+        std::vector<glm::vec3> seam[2];
+        for (int f = 0; f < 2; f++) {
+            faces[f]->computeVariance(20);
+            faces[f]->reset();
+            faces[f]->tessellate(glm::vec3(glm::inverse(faces[f]->m->World)*glm::vec4(eye, 1)));
+            std::vector<VertexPositionNormalTexture> verteces;
+            std::vector<GLuint> indeces;
+            faces[f]->getMesh(verteces, indeces);
+            seam[f].assign(size, glm::vec3(FLT_MAX));
+            for (size_t i = 0; i < verteces.size(); i++) {
+                if (verteces[i].Uv.x == (f == 0 ? 0.0f : 1.0f)) {
+                    int row = (int)(verteces[i].Uv.y*(size - 1) + 0.5f);
+                    seam[f][row] = glm::vec3(faces[f]->m->World*glm::vec4(verteces[i].Position, 1));
+                }
+            }
+        }
+        int compared = 0;
+        float seam_error = 0;
+        for (int row = 0; row < size; row++) {
+            if (seam[0][row].x != FLT_MAX && seam[1][row].x != FLT_MAX) {
+                seam_error = std::max(seam_error, glm::distance(seam[0][row], seam[1][row]));
+                compared++;
+            }
+        }
+        LOG(INFO) << compared << " seam vertices, largest world distance " << seam_error;
+        bool compared_seam = compared > 2;
+        TEST_ASSERT_TRUE(compared_seam, showpassed, fail);
+        bool closed = seam_error < 1e-3f;
+        TEST_ASSERT_TRUE(closed, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// row-parallel Sobel normals match the per-texel filter, packed normals decode close to them
+class roam_normals_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        TerrainPatch patch;
+        Heightmap *map = patch.getHeightmap();
+        size_t texels = map->width*map->height;
+
+        float max_error = 0;
+        for (int y = 1; y < (int)map->height - 1; y += 7) {
+            for (int x = 1; x < (int)map->width - 1; x++) {
+                float dx = Heightmap_get(map, x+1, y-1) + 2*Heightmap_get(map, x+1, y) + Heightmap_get(map, x+1, y+1) -
+                    Heightmap_get(map, x-1, y-1) - 2*Heightmap_get(map, x-1, y) - Heightmap_get(map, x-1, y+1);
+                float dy = Heightmap_get(map, x-1, y+1) + 2*Heightmap_get(map, x, y+1) + Heightmap_get(map, x+1, y+1) -
+                    Heightmap_get(map, x-1, y-1) - 2*Heightmap_get(map, x, y-1) - Heightmap_get(map, x+1, y-1);
+                float length = sqrtf(dx*dx + dy*dy + 1/1024.0f);
+                float nx, ny, nz;
+                Heightmap_get_normal(map, x, y, &nx, &ny, &nz);
+                max_error = glm::max(max_error, fabsf(nx - dx/length));
+                max_error = glm::max(max_error, fabsf(ny - dy/length));
+                max_error = glm::max(max_error, fabsf(nz - 1/(32*length)));
+            }
+        }
+        // the sums are added in another order, flat texels scale their rounding by 32
+        bool sobel = max_error < 1e-4f;
+        TEST_ASSERT_TRUE(sobel, showpassed, fail);
+
+        std::vector<unsigned int> oct(texels), rgb(texels);
+        auto start = std::chrono::high_resolution_clock::now();
+        float *floats = map->normal_map;
+        Heightmap_calculate_normals(map, 1);
+        double serial_ms = roam_tests_ms(start);
+        bool same = memcmp(floats, map->normal_map, texels*3*sizeof(float)) == 0;
+        TEST_ASSERT_TRUE(same, showpassed, fail);
+        delete[] floats;
+        start = std::chrono::high_resolution_clock::now();
+        Heightmap_pack_normals(map, HEIGHTMAP_NORMALS_OCT16, &oct[0]);
+        double oct_ms = roam_tests_ms(start);
+        Heightmap_pack_normals(map, HEIGHTMAP_NORMALS_RGB10A2, &rgb[0]);
+        LOG(INFO) << "normals 1 thread " << serial_ms << " ms, oct16 " << oct_ms << " ms, "
+            << texels*3*sizeof(float) << " -> " << texels*sizeof(unsigned int) << " bytes";
+
+        float oct_error = 0, rgb_error = 0;
+        for (size_t i = 0; i < texels; i++) {
+            const float *n = map->normal_map + 3*i;
+            float x, y, z;
+            Heightmap_unpack_normal(oct[i], HEIGHTMAP_NORMALS_OCT16, &x, &y, &z);
+            oct_error = glm::max(oct_error, glm::max(fabsf(x - n[0]), glm::max(fabsf(y - n[1]), fabsf(z - n[2]))));
+            Heightmap_unpack_normal(rgb[i], HEIGHTMAP_NORMALS_RGB10A2, &x, &y, &z);
+            rgb_error = glm::max(rgb_error, glm::max(fabsf(x - n[0]), glm::max(fabsf(y - n[1]), fabsf(z - n[2]))));
+        }
+        bool packed = oct_error < 1e-4f && rgb_error < 4e-3f;
+        TEST_ASSERT_TRUE(packed, showpassed, fail);
+
+        // words past the diamond's edges are the folded lower hemisphere
+        float x, y, z;
+        unsigned int word = (unsigned short)(short)-24575 | (unsigned int)(unsigned short)(short)16384 << 16;
+        Heightmap_unpack_normal(word, HEIGHTMAP_NORMALS_OCT16, &x, &y, &z);
+        bool lower = z < 0 && x < 0 && y > 0;
+        TEST_ASSERT_TRUE(lower, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// text maps convert to binary ones that load by mapping the file
+class roam_binary_heightmap_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        TerrainSettings settings;
+        settings.resolution = 513;
+        TerrainPatch patch(0, 0, settings);
+        Heightmap *source = patch.getHeightmap();
+        size_t texels = source->width*source->height;
+        FILE *text = fopen("roam_heightmap.txt", "w");
+        fprintf(text, "%lu %lu\n", (unsigned long)source->width, (unsigned long)source->height);
+        for (size_t i = 0; i < texels; i++) {
+            fprintf(text, "%.9g\n", source->map[i]);
+        }
+        fclose(text);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        Heightmap *parsed = Heightmap_read("roam_heightmap.txt");
+        double text_ms = roam_tests_ms(start);
+        bool exact = parsed && memcmp(parsed->map, source->map, texels*sizeof(float)) == 0;
+        TEST_ASSERT_TRUE(exact, showpassed, fail);
+        maps_delete(parsed);
+
+        bool converted = Heightmap_convert("roam_heightmap.txt", "roam_heightmap.f32", HEIGHTMAP_F32) &&
+            Heightmap_convert("roam_heightmap.txt", "roam_heightmap.u16", HEIGHTMAP_U16);
+        TEST_ASSERT_TRUE(converted, showpassed, fail);
+
+        start = std::chrono::high_resolution_clock::now();
+        Heightmap *mapped = Heightmap_load("roam_heightmap.f32");
+        double load_ms = roam_tests_ms(start);
+        bool in_place = mapped && mapped->mapping && mapped->width == source->width && mapped->height == source->height &&
+            memcmp(mapped->map, source->map, texels*sizeof(float)) == 0;
+        TEST_ASSERT_TRUE(in_place, showpassed, fail);
+        LOG(INFO) << source->width << " map text " << text_ms << " ms, mapped " << load_ms << " ms";
+
+        Heightmap *quantized = Heightmap_load("roam_heightmap.u16");
+        bool close = quantized && !quantized->mapping;
+        float step = (mapped->maxZ - mapped->minZ) / 65535.0f;
+        for (size_t i = 0; i < texels && close; i++) {
+            close = fabsf(quantized->map[i] - source->map[i]) <= step;
+        }
+        TEST_ASSERT_TRUE(close, showpassed, fail);
+
+        maps_delete(quantized);
+        {
+            // the adopted map is not written, normals are calculated aside.
+            // The patch closes the mapping before the files go
+            Heightmap_calculate_normals(mapped);
+            TerrainPatch adopted(0, 0, TerrainSettings(), mapped);
+            adopted.computeVariance(16);
+            adopted.reset();
+            adopted.tessellate(glm::vec3(0.3f, 0.2f, -0.9f));
+            bool tessellated = adopted.amountOfLeaves() > 0;
+            TEST_ASSERT_TRUE(tessellated, showpassed, fail);
+        }
+
+        bool rejected = Heightmap_load("roam_heightmap.txt") == nullptr && Heightmap_load("roam_missing.f32") == nullptr;
+        TEST_ASSERT_TRUE(rejected, showpassed, fail);
+
+        remove("roam_heightmap.txt");
+        remove("roam_heightmap.f32");
+        remove("roam_heightmap.u16");
+        return !fail;
+    }
+};
+
+// pyramid queries agree with reading every texel
+class roam_pyramid_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        TerrainSettings settings;
+        settings.resolution = 257;
+        TerrainPatch patch(0, 0, settings);
+        Heightmap *map = patch.getHeightmap();
+        Heightmap_build_pyramid(map);
+        int size = (int)map->width;
+
+        size_t w, h;
+        Heightmap_level_size(map, Heightmap_levels(map) - 1, &w, &h);
+        float low = FLT_MAX, high = -FLT_MAX;
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                low = glm::min(low, Heightmap_get(map, x, y));
+                high = glm::max(high, Heightmap_get(map, x, y));
+            }
+        }
+        float top_low, top_high;
+        Heightmap_range(map, 0, 0, size - 1, size - 1, &top_low, &top_high);
+        bool top = Heightmap_levels(map) == 9 && w == 1 && h == 1 && top_low == low && top_high == high &&
+            Heightmap_get_level(map, 0, 3, 5) == (Heightmap_get(map, 3, 5) + Heightmap_get(map, 4, 5) +
+            Heightmap_get(map, 3, 6) + Heightmap_get(map, 4, 6))*0.25f;
+        TEST_ASSERT_TRUE(top, showpassed, fail);
+
+        unsigned int random = 12345;
+        bool ranges = true;
+        for (int i = 0; i < 200 && ranges; i++) {
+            random = random*1103515245u + 12345u;
+            int x0 = random >> 8 & 255, y0 = random >> 16 & 255;
+            random = random*1103515245u + 12345u;
+            int x1 = x0 + (random >> 8 & 63), y1 = y0 + (random >> 16 & 63);
+            float lo = FLT_MAX, hi = -FLT_MAX, pyramid_lo, pyramid_hi;
+            for (int y = y0; y <= glm::min(y1, size - 1); y++) {
+                for (int x = x0; x <= glm::min(x1, size - 1); x++) {
+                    lo = glm::min(lo, Heightmap_get(map, x, y));
+                    hi = glm::max(hi, Heightmap_get(map, x, y));
+                }
+            }
+            Heightmap_range(map, x0, y0, x1, y1, &pyramid_lo, &pyramid_hi);
+            ranges = lo == pyramid_lo && hi == pyramid_hi;
+            // the constant-time bound the culling uses holds the exact range
+            float bound_lo, bound_hi;
+            ranges = ranges && Heightmap_range_bound(map, x0, y0, x1, y1, &bound_lo, &bound_hi) &&
+                bound_lo <= lo && bound_hi >= hi;
+        }
+        TEST_ASSERT_TRUE(ranges, showpassed, fail);
+
+        // every quad's two triangles, the linear scan the pyramid replaces
+        auto scan = [&](const float *o, const float *d) -> float {
+            float best = FLT_MAX;
+            for (int y = 0; y < size - 1; y++) {
+                for (int x = 0; x < size - 1; x++) {
+                    float a[3] = { (float)x, (float)y, Heightmap_get(map, x, y) };
+                    float b[3] = { (float)x + 1, (float)y, Heightmap_get(map, x + 1, y) };
+                    float c[3] = { (float)x + 1, (float)y + 1, Heightmap_get(map, x + 1, y + 1) };
+                    float e[3] = { (float)x, (float)y + 1, Heightmap_get(map, x, y + 1) };
+                    const float *tri[2][3] = { { a, b, c }, { a, c, e } };
+                    for (int k = 0; k < 2; k++) {
+                        glm::vec3 p0(tri[k][0][0], tri[k][0][1], tri[k][0][2]);
+                        glm::vec3 e1 = glm::vec3(tri[k][1][0], tri[k][1][1], tri[k][1][2]) - p0;
+                        glm::vec3 e2 = glm::vec3(tri[k][2][0], tri[k][2][1], tri[k][2][2]) - p0;
+                        glm::vec3 dir(d[0], d[1], d[2]), s = glm::vec3(o[0], o[1], o[2]) - p0;
+                        glm::vec3 p = glm::cross(dir, e2);
+                        float det = glm::dot(e1, p);
+                        if (fabsf(det) < 1e-12f) {
+                            continue;
+                        }
+                        float u = glm::dot(s, p)/det;
+                        glm::vec3 q = glm::cross(s, e1);
+                        float v = glm::dot(dir, q)/det, t = glm::dot(e2, q)/det;
+                        if (u >= 0 && v >= 0 && u + v <= 1 && t >= 0 && t < best) {
+                            best = t;
+                        }
+                    }
+                }
+            }
+            return best;
+        };
+
+        int hits = 0;
+        bool rays = true;
+        double scan_ms = 0, pyramid_ms = 0;
+        for (int i = 0; i < 32 && rays; i++) {
+            random = random*1103515245u + 12345u;
+            float origin[3] = { (random >> 8 & 255)*1.0f, (random >> 16 & 255)*1.0f, 1.5f };
+            random = random*1103515245u + 12345u;
+            float dir[3] = { ((int)(random >> 8 & 255) - 128)/16.0f, ((int)(random >> 16 & 255) - 128)/16.0f, -0.1f - (random >> 24 & 3)*0.1f };
+            auto start = std::chrono::high_resolution_clock::now();
+            float expected = scan(origin, dir);
+            scan_ms += roam_tests_ms(start);
+            start = std::chrono::high_resolution_clock::now();
+            float t = FLT_MAX;
+            bool hit = Heightmap_intersect(map, origin, dir, &t);
+            pyramid_ms += roam_tests_ms(start);
+            rays = hit == (expected != FLT_MAX) && (!hit || fabsf(t - expected) <= 1e-4f*expected);
+            hits += hit;
+        }
+        TEST_ASSERT_TRUE(rays, showpassed, fail);
+        LOG(INFO) << hits << "/32 rays hit, scan " << scan_ms << " ms, pyramid " << pyramid_ms << " ms";
+
+        float up[3] = { 10, 10, 2 }, away[3] = { 0.3f, 0.1f, 1 }, t;
+        bool missed = !Heightmap_intersect(map, up, away, &t);
+        TEST_ASSERT_TRUE(missed, showpassed, fail);
+
+        return !fail;
+    }
+};
+
+// rays hit the sphere-projected surface where testing every triangle of it does
+class roam_picking_tester : public test{
+    virtual bool make(int showpassed){
+        bool fail = false;
+
+        const int size = 129;
+        glm::mat4 side(0);
+        side[0] = glm::vec4(0, 0, -500, 0);
+        side[1] = glm::vec4(0, 500, 0, 0);
+        side[2] = glm::vec4(500, 0, 0, 0);
+        side[3] = glm::vec4(0, 0, 0, 1);
+        TerrainSettings settings;
+        settings.resolution = size;
+        settings.face = &side;
+        TerrainPatch patch(0, 0, settings);
+        Heightmap *map = patch.getHeightmap();
+        // the rays would build it on the first cast, outside the timing
+        Heightmap_build_pyramid(map);
+
+        // the surface getMesh puts its vertices on, in world space
+        auto surface = [&](int x, int y) -> glm::vec3 {
+            glm::vec3 p = normalize(glm::vec3(x/(float)(size - 1) - 0.5f, y/(float)(size - 1) - 0.5f, -0.5f));
+            p *= (99 + Heightmap_get(map, x, y))/100.0f;
+            glm::vec4 w = side*glm::vec4(p, 1);
+            return glm::vec3(w.x, w.y, w.z);
+        };
+        auto scan = [&](const glm::vec3 &o, const glm::vec3 &d) -> float {
+            float best = FLT_MAX;
+            for (int y = 0; y < size - 1; y++) {
+                for (int x = 0; x < size - 1; x++) {
+                    glm::vec3 a = surface(x, y), b = surface(x + 1, y), c = surface(x + 1, y + 1), e = surface(x, y + 1);
+                    glm::vec3 tri[2][3] = { { a, b, c }, { a, c, e } };
+                    for (int k = 0; k < 2; k++) {
+                        glm::vec3 e1 = tri[k][1] - tri[k][0], e2 = tri[k][2] - tri[k][0], s = o - tri[k][0];
+                        glm::vec3 p = glm::cross(d, e2), q = glm::cross(s, e1);
+                        float det = glm::dot(e1, p);
+                        float u = glm::dot(s, p)/det, v = glm::dot(d, q)/det, t = glm::dot(e2, q)/det;
+                        if (u >= 0 && v >= 0 && u + v <= 1 && t >= 0 && t < best) {
+                            best = t;
+                        }
+                    }
+                }
+            }
+            return best;
+        };
+
+        // from outside the planet towards points of the face, some grazing
+        const int rays = 24;
+        std::vector<glm::vec3> origins, dirs;
+        unsigned int random = 777;
+        for (int i = 0; i < rays; i++) {
+            random = random*1103515245u + 12345u;
+            // inside a triangle, rays through vertices may slip between the triangles
+            int x = random >> 8 & 127, y = random >> 16 & 127;
+            glm::vec3 target = (surface(x, y) + surface(x + 1, y) + surface(x + 1, y + 1))/3.0f;
+            random = random*1103515245u + 12345u;
+            glm::vec3 offset(((int)(random >> 8 & 255) - 128)*4.0f, ((int)(random >> 16 & 255) - 128)*4.0f, 0);
+            glm::vec3 origin = target*(1.5f + (random >> 24 & 3)*0.5f) + offset;
+            origins.push_back(origin);
+            dirs.push_back(target - origin);
+        }
+        // straight up from the centre misses
+        origins.push_back(surface(64, 64)*1.1f);
+        dirs.push_back(surface(64, 64));
+
+        std::vector<float> batched(origins.size());
+        auto start = std::chrono::high_resolution_clock::now();
+        patch.intersect(&origins[0], &dirs[0], origins.size(), &batched[0]);
+        double pick_ms = roam_tests_ms(start);
+
+        bool same = true;
+        int hits = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < origins.size() && same; i++) {
+            float expected = scan(origins[i], dirs[i]);
+            float t = -1;
+            glm::vec2 texel;
+            bool hit = patch.intersect(origins[i], dirs[i], &t, &texel);
+            same = hit == (expected != FLT_MAX) && batched[i] == (hit ? t : -1.0f) &&
+                (!hit || (fabsf(t - expected) <= 1e-4f*expected && texel.x >= 0 && texel.x <= size - 1 &&
+                texel.y >= 0 && texel.y <= size - 1));
+            hits += hit;
+        }
+        double scan_ms = roam_tests_ms(start);
+        TEST_ASSERT_TRUE(same, showpassed, fail);
+        bool missed = batched[rays] == -1.0f && hits >= rays/2 && hits <= rays;
+        TEST_ASSERT_TRUE(missed, showpassed, fail);
+        LOG(INFO) << hits << "/" << origins.size() << " rays hit, pyramid " << pick_ms << " ms, triangles " << scan_ms << " ms";
+
+        return !fail;
+    }
+};